@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+
+#include "bench_stats.h"
+
+
+double bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec*1e9 + (double)ts.tv_nsec;
+}
+
+
+static int double_cmp(const void *a, const void *b)
+{
+    double x=*(const double *)a, y=*(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile on sorted samples
+static double percentile(const double *sorted, int n, double p)
+{
+    int rank=(int)(p*n + 0.999999);
+
+    if(rank < 1) rank=1;
+    if(rank > n) rank=n;
+    return sorted[rank-1];
+}
+
+
+void bench_summarize(double *samples, int n, bench_stats_t *st)
+{
+    int idx;
+    double sum=0.0, var=0.0;
+
+    st->n=n;
+    if(n < 1)
+    {
+        st->min=st->median=st->p99=st->max=st->mean=st->stddev=0.0;
+        return;
+    }
+
+    qsort(samples, n, sizeof(double), double_cmp);
+    for(idx=0; idx<n; idx++)
+        sum+=samples[idx];
+
+    st->min=samples[0];
+    st->max=samples[n-1];
+    st->mean=sum/n;
+    for(idx=0; idx<n; idx++)
+        var+=(samples[idx]-st->mean)*(samples[idx]-st->mean);
+    st->stddev=sqrt(var/n);
+    st->median=(n & 1) ? samples[n/2] : 0.5*(samples[n/2-1]+samples[n/2]);
+    st->p99=percentile(samples, n, 0.99);
+}
@@ -0,0 +1,23 @@
+#ifndef BENCH_STATS_H
+#define BENCH_STATS_H
+
+// Wall-clock timing and order statistics for the sharpen benchmarks
+
+typedef struct
+{
+    int n;
+    double min;
+    double median;
+    double p99;
+    double max;
+    double mean;
+    double stddev;
+} bench_stats_t;
+
+// CLOCK_MONOTONIC in nanoseconds
+double bench_now_ns(void);
+
+// Summarize n samples (sorted in place).
+void bench_summarize(double *samples, int n, bench_stats_t *st);
+
+#endif
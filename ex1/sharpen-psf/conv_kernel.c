@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "conv_kernel.h"
+
+// Output rows per separable strip, keeps the float intermediate in cache
+#define CONV_STRIP 32
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+
+// Per-thread float scratch so tiles can run on any worker.  Sized up front by
+// conv_scratch_reserve(), grown only if a wider tile comes along.
+static __thread float *scratch;
+static __thread size_t scratch_len;
+
+static float *conv_scratch(size_t n)
+{
+    if(n > scratch_len)
+    {
+        float *p=realloc(scratch, n*sizeof(float));
+        if(!p)
+        {
+            printf("Error allocating %zu bytes of convolution scratch\n", n*sizeof(float));
+            return NULL;
+        }
+        scratch=p;
+        scratch_len=n;
+    }
+    return scratch;
+}
+
+
+// Floats of scratch a w column tile needs: one accumulator row, plus a strip
+// of horizontal pass rows when separable.  Must match the bodies below.
+static size_t conv_scratch_need(const conv_kernel_t *k, int w)
+{
+    return k->separable ? (size_t)(CONV_STRIP+k->size)*w : (size_t)w;
+}
+
+
+int conv_scratch_reserve(const conv_kernel_t *k, int w)
+{
+    return conv_scratch(conv_scratch_need(k, w)) ? 0 : -1;
+}
+
+
+ALWAYS_INLINE void conv_store(const float *acc, unsigned char *out, int w)
+{
+    int x;
+    float v;
+
+    for(x=0; x<w; x++)
+    {
+        v=acc[x];
+        if(v<0.0f) v=0.0f;
+        if(v>255.0f) v=255.0f;
+        out[x]=(unsigned char)v;
+    }
+}
+
+
+// Direct 2-D body.  Called with a literal N from the fixed-size wrappers.
+ALWAYS_INLINE int conv2d_body(const conv_kernel_t *k, const unsigned char *src, unsigned char *dst,
+                              size_t stride, int i, int j, int h, int w, const int N)
+{
+    const int r=N/2;
+    float *acc=conv_scratch(w);
+    int y, ky, kx, x;
+
+    if(!acc)
+        return -1;
+
+    for(y=i; y<i+h; y++)
+    {
+        for(x=0; x<w; x++)
+            acc[x]=0.0f;
+
+        for(ky=0; ky<N; ky++)
+        {
+            const unsigned char *s=src + (size_t)(y+ky-r)*stride + j - r;
+
+            for(kx=0; kx<N; kx++)
+            {
+                const float t=k->tap[ky*N+kx];
+                for(x=0; x<w; x++)
+                    acc[x]+=t*(float)s[x+kx];
+            }
+        }
+
+        conv_store(acc, dst + (size_t)y*stride + j, w);
+    }
+
+    return 0;
+}
+
+
+// Separable body: horizontal pass into a float strip, then vertical pass.
+ALWAYS_INLINE int conv_sep_body(const conv_kernel_t *k, const unsigned char *src, unsigned char *dst,
+                                size_t stride, int i, int j, int h, int w, const int N)
+{
+    const int r=N/2;
+    float *tmp=conv_scratch((size_t)(CONV_STRIP+N)*w);
+    float *acc;
+    int y0, rows, y, ky, kx, x;
+
+    if(!tmp)
+        return -1;
+    acc=tmp + (size_t)(CONV_STRIP+N-1)*w;
+
+    for(y0=i; y0<i+h; y0+=CONV_STRIP)
+    {
+        rows=(i+h-y0 < CONV_STRIP) ? (i+h-y0) : CONV_STRIP;
+
+        for(y=0; y<rows+N-1; y++)
+        {
+            const unsigned char *s=src + (size_t)(y0+y-r)*stride + j - r;
+            float *t=tmp + (size_t)y*w;
+
+            for(x=0; x<w; x++)
+                t[x]=0.0f;
+            for(kx=0; kx<N; kx++)
+            {
+                const float c=k->row[kx];
+                for(x=0; x<w; x++)
+                    t[x]+=c*(float)s[x+kx];
+            }
+        }
+
+        for(y=0; y<rows; y++)
+        {
+            for(x=0; x<w; x++)
+                acc[x]=0.0f;
+            for(ky=0; ky<N; ky++)
+            {
+                const float c=k->col[ky];
+                const float *t=tmp + (size_t)(y+ky)*w;
+                for(x=0; x<w; x++)
+                    acc[x]+=c*t[x];
+            }
+
+            conv_store(acc, dst + (size_t)(y0+y)*stride + j, w);
+        }
+    }
+
+    return 0;
+}
+
+
+#define CONV_SPECIALIZE(N) \
+static int conv2d_##N(const conv_kernel_t *k, const unsigned char *src, unsigned char *dst, \
+                      size_t stride, int i, int j, int h, int w) \
+{ return conv2d_body(k, src, dst, stride, i, j, h, w, N); } \
+static int conv_sep_##N(const conv_kernel_t *k, const unsigned char *src, unsigned char *dst, \
+                        size_t stride, int i, int j, int h, int w) \
+{ return conv_sep_body(k, src, dst, stride, i, j, h, w, N); }
+
+CONV_SPECIALIZE(3)
+CONV_SPECIALIZE(5)
+CONV_SPECIALIZE(7)
+
+
+int conv_tile(const conv_kernel_t *k, const unsigned char *src, unsigned char *dst,
+              size_t stride, int i, int j, int h, int w)
+{
+    if(h <= 0 || w <= 0)
+        return 0;
+
+    switch(k->size*2 + k->separable)
+    {
+        case 3*2:   return conv2d_3(k, src, dst, stride, i, j, h, w);
+        case 3*2+1: return conv_sep_3(k, src, dst, stride, i, j, h, w);
+        case 5*2:   return conv2d_5(k, src, dst, stride, i, j, h, w);
+        case 5*2+1: return conv_sep_5(k, src, dst, stride, i, j, h, w);
+        case 7*2:   return conv2d_7(k, src, dst, stride, i, j, h, w);
+        case 7*2+1: return conv_sep_7(k, src, dst, stride, i, j, h, w);
+        default:
+            if(k->separable)
+                return conv_sep_body(k, src, dst, stride, i, j, h, w, k->size);
+            return conv2d_body(k, src, dst, stride, i, j, h, w, k->size);
+    }
+}
+
+
+int conv_kernel_init(conv_kernel_t *k, const double *psf, int size)
+{
+    int y, x, py=0, px=0;
+    double big=0.0, pivot;
+
+    if(size < 1 || size > CONV_MAX_SIZE || (size & 1) == 0)
+    {
+        printf("PSF size %d not supported (odd, at most %d)\n", size, CONV_MAX_SIZE);
+        return -1;
+    }
+
+    k->size=size;
+    for(y=0; y<size*size; y++)
+    {
+        k->tap[y]=(float)psf[y];
+        if(fabs(psf[y]) > big)
+        {
+            big=fabs(psf[y]);
+            py=y/size; px=y%size;
+        }
+    }
+
+    // Rank-1 test: every tap must equal col[y]*row[x] built from the row and
+    // column through the largest tap.
+    k->separable = (size > 1 && big > 0.0);
+    pivot=psf[py*size+px];
+    for(y=0; y<size; y++)
+    {
+        k->col[y]=(float)psf[y*size+px];
+        k->row[y]=(float)(psf[py*size+y]/pivot);
+    }
+    for(y=0; y<size && k->separable; y++)
+        for(x=0; x<size; x++)
+            if(fabs(psf[y*size+x] - psf[y*size+px]*psf[py*size+x]/pivot) > 1e-9*big)
+            {
+                k->separable=0;
+                break;
+            }
+
+    return 0;
+}
+
+
+void conv_psf_sharpen(double *psf, int size, double K)
+{
+    int n=size*size, idx;
+
+    for(idx=0; idx<n; idx++)
+        psf[idx] = -K/(double)(n-1);
+    psf[n/2] = K+1.0;
+}
+
+
+void conv_psf_blur(double *psf, int size)
+{
+    double b[size], sum=0.0;	//size may exceed CONV_MAX_SIZE for the FFT path
+    int y, x;
+
+    // Row of Pascal's triangle, a discrete Gaussian
+    b[0]=1.0;
+    for(y=1; y<size; y++)
+    {
+        b[y]=1.0;
+        for(x=y-1; x>0; x--)
+            b[x]+=b[x-1];
+    }
+    for(y=0; y<size; y++)
+        sum+=b[y];
+
+    for(y=0; y<size; y++)
+        for(x=0; x<size; x++)
+            psf[y*size+x]=(b[y]/sum)*(b[x]/sum);
+}
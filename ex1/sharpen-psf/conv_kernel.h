@@ -0,0 +1,49 @@
+#ifndef CONV_KERNEL_H
+#define CONV_KERNEL_H
+
+#include <stddef.h>
+
+// Square NxN convolution for 8-bit planes
+//
+// conv_kernel_init() checks whether the PSF is separable (rank 1) and
+// conv_tile() dispatches to a body specialized at compile time for the
+// kernel size: 3x3, 5x5 and 7x7 are instantiated with a constant N so the tap
+// loops unroll fully and the column loop vectorizes; other odd sizes up to
+// CONV_MAX_SIZE run the same body with a runtime N.  Separable PSFs run as a
+// horizontal then a vertical 1-D pass over strips of rows.
+//
+// Sums are taken in float, then clamped to [0,255] and truncated like the
+// original double precision loop.
+
+#define CONV_MAX_SIZE 15
+
+typedef struct
+{
+    int size;                                   // odd, 1..CONV_MAX_SIZE
+    int separable;
+    float tap[CONV_MAX_SIZE*CONV_MAX_SIZE];     // row-major
+    float col[CONV_MAX_SIZE];                   // tap[y][x] == col[y]*row[x]
+    float row[CONV_MAX_SIZE];                   // when separable
+} conv_kernel_t;
+
+// Load a size x size row-major PSF.  Returns 0, or -1 for an unsupported size.
+int conv_kernel_init(conv_kernel_t *k, const double *psf, int size);
+
+// Fill psf with the size x size sharpen PSF (centre K+1, the rest sharing -K)
+// or with a normalized binomial blur, which is separable.
+void conv_psf_sharpen(double *psf, int size, double K);
+void conv_psf_blur(double *psf, int size);
+
+// Allocate the calling thread's float scratch for tiles up to w columns wide.
+// Call it on every thread that will run conv_tile() before the first frame,
+// so no tile allocates mid-frame.  Returns 0, or -1 if out of memory.
+int conv_scratch_reserve(const conv_kernel_t *k, int w);
+
+// Convolve rows [i, i+h) and columns [j, j+w) of src into dst.  Both planes
+// have the given stride; pixels within size/2 of the tile must be readable.
+// Returns 0, or -1 with dst untouched when a tile wider than the reserved
+// scratch cannot grow it.
+int conv_tile(const conv_kernel_t *k, const unsigned char *src, unsigned char *dst,
+              size_t stride, int i, int j, int h, int w);
+
+#endif
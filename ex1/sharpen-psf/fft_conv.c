@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "fft_conv.h"
+#include "conv_kernel.h"
+#include "bench_stats.h"
+
+#define CALIBRATE_DIM 256
+
+
+// In-place iterative radix-2 FFT of n complex floats (re,im interleaved).
+// sign is -1 for forward and +1 for inverse (unscaled).
+static void fft1d(float *x, int n, const float *tw, const int *rev, int sign)
+{
+    int i, j, len, half, step, k;
+    float tr, ti, wr, wi, ur, ui;
+
+    for(i=0; i<n; i++)
+    {
+        j=rev[i];
+        if(j > i)
+        {
+            tr=x[2*i]; ti=x[2*i+1];
+            x[2*i]=x[2*j]; x[2*i+1]=x[2*j+1];
+            x[2*j]=tr; x[2*j+1]=ti;
+        }
+    }
+
+    for(len=2; len<=n; len<<=1)
+    {
+        half=len>>1;
+        step=n/len;
+        for(i=0; i<n; i+=len)
+        {
+            for(k=0; k<half; k++)
+            {
+                wr=tw[2*k*step];
+                wi=sign*tw[2*k*step+1];
+                ur=x[2*(i+k)]; ui=x[2*(i+k)+1];
+                tr=x[2*(i+k+half)]*wr - x[2*(i+k+half)+1]*wi;
+                ti=x[2*(i+k+half)]*wi + x[2*(i+k+half)+1]*wr;
+                x[2*(i+k)]=ur+tr; x[2*(i+k)+1]=ui+ti;
+                x[2*(i+k+half)]=ur-tr; x[2*(i+k+half)+1]=ui-ti;
+            }
+        }
+    }
+}
+
+
+// 2-D FFT of an n x n complex image.  Only the first rows rows are nonzero
+// on the forward pass, so the zero rows skip their row transform.
+static void fft2d(const fft_conv_t *f, float *img, float *col, int rows, int sign)
+{
+    int n=f->n, y, x;
+
+    for(y=0; y<rows; y++)
+        fft1d(img + (size_t)2*y*n, n, f->tw, f->rev, sign);
+
+    for(x=0; x<n; x++)
+    {
+        for(y=0; y<n; y++)
+        {
+            col[2*y]=img[(size_t)2*(y*n+x)];
+            col[2*y+1]=img[(size_t)2*(y*n+x)+1];
+        }
+        fft1d(col, n, f->tw, f->rev, sign);
+        for(y=0; y<n; y++)
+        {
+            img[(size_t)2*(y*n+x)]=col[2*y];
+            img[(size_t)2*(y*n+x)+1]=col[2*y+1];
+        }
+    }
+}
+
+
+int fft_conv_init(fft_conv_t *f, const double *psf, int size)
+{
+    int n, best=0, lg, i, y, x;
+    double cost, best_cost=0.0;
+    float *col;
+
+    memset(f, 0, sizeof(*f));
+    if(size < 1 || size > FFT_MAX_SIZE || (size & 1) == 0)
+    {
+        printf("FFT PSF size %d not supported (odd, at most %d)\n", size, FFT_MAX_SIZE);
+        return -1;
+    }
+
+    // FFT work per useful output pixel is n^2 log n / (n-k+1)^2
+    for(n=16, lg=4; n<=1024; n<<=1, lg++)
+    {
+        if(n-size+1 < 1)
+            continue;
+        cost=(double)n*n*lg/((double)(n-size+1)*(n-size+1));
+        if(!best || cost < best_cost)
+        {
+            best=n;
+            best_cost=cost;
+        }
+    }
+
+    n=best;
+    f->size=size;
+    f->n=n;
+    f->block=n-size+1;
+    f->spec=calloc((size_t)2*n*n, sizeof(float));
+    f->tw=malloc(sizeof(float)*n);
+    f->rev=malloc(sizeof(int)*n);
+    col=malloc(sizeof(float)*2*n);
+    if(!f->spec || !f->tw || !f->rev || !col)
+    {
+        printf("Error allocating %d x %d FFT\n", n, n);
+        free(col);
+        fft_conv_free(f);
+        return -1;
+    }
+
+    for(i=0; i<n/2; i++)
+    {
+        f->tw[2*i]=(float)cos(2.0*M_PI*i/n);
+        f->tw[2*i+1]=(float)-sin(2.0*M_PI*i/n);
+    }
+    for(i=0; i<n; i++)
+    {
+        int r=0, b;
+        for(b=1; b<n; b<<=1)
+            r=(r<<1) | ((i & b) ? 1 : 0);
+        f->rev[i]=r;
+    }
+
+    // The direct kernels correlate, so the convolution kernel is the flipped
+    // PSF.  Fold the inverse transform's 1/(n*n) into the spectrum.
+    for(y=0; y<size; y++)
+        for(x=0; x<size; x++)
+            f->spec[(size_t)2*((size-1-y)*n + (size-1-x))]=(float)(psf[y*size+x]/((double)n*n));
+
+    fft2d(f, f->spec, col, size, -1);
+    free(col);
+    return 0;
+}
+
+
+void fft_conv_free(fft_conv_t *f)
+{
+    free(f->spec);
+    free(f->tw);
+    free(f->rev);
+    f->spec=NULL; f->tw=NULL; f->rev=NULL;
+}
+
+
+int fft_conv_planes(const fft_conv_t *f, const unsigned char *a, const unsigned char *b,
+                    unsigned char *da, unsigned char *db, int w, int h)
+{
+    int n=f->n, blk=f->block, r=f->size/2;
+    int by, bx, y, x, rows, cols, Y, X;
+    size_t npix=(size_t)w*h, idx;
+    float *img, *col, *acc, re, im, v;
+
+    img=malloc(sizeof(float)*2*n*n);
+    col=malloc(sizeof(float)*2*n);
+    acc=calloc(2*npix, sizeof(float));
+    if(!img || !col || !acc)
+    {
+        printf("Error allocating FFT buffers for %d x %d\n", w, h);
+        free(img); free(col); free(acc);
+        return -1;
+    }
+
+    for(by=0; by<h; by+=blk)
+    {
+        rows=(h-by < blk) ? h-by : blk;
+
+        for(bx=0; bx<w; bx+=blk)
+        {
+            cols=(w-bx < blk) ? w-bx : blk;
+
+            memset(img, 0, sizeof(float)*2*n*n);
+            for(y=0; y<rows; y++)
+            {
+                const unsigned char *sa=a + (size_t)(by+y)*w + bx;
+                const unsigned char *sb=b ? b + (size_t)(by+y)*w + bx : NULL;
+                float *d=img + (size_t)2*y*n;
+
+                for(x=0; x<cols; x++)
+                {
+                    d[2*x]=sa[x];
+                    d[2*x+1]=sb ? sb[x] : 0.0f;
+                }
+            }
+
+            fft2d(f, img, col, rows, -1);
+
+            for(idx=0; idx<(size_t)n*n; idx++)
+            {
+                re=img[2*idx]*f->spec[2*idx] - img[2*idx+1]*f->spec[2*idx+1];
+                im=img[2*idx]*f->spec[2*idx+1] + img[2*idx+1]*f->spec[2*idx];
+                img[2*idx]=re;
+                img[2*idx+1]=im;
+            }
+
+            fft2d(f, img, col, n, 1);
+
+            // Full linear convolution of the block, offset by the PSF radius
+            for(y=0; y<rows+f->size-1; y++)
+            {
+                Y=by+y-r;
+                if(Y < 0 || Y >= h)
+                    continue;
+                for(x=0; x<cols+f->size-1; x++)
+                {
+                    X=bx+x-r;
+                    if(X < 0 || X >= w)
+                        continue;
+                    acc[2*((size_t)Y*w+X)]+=img[(size_t)2*(y*n+x)];
+                    acc[2*((size_t)Y*w+X)+1]+=img[(size_t)2*(y*n+x)+1];
+                }
+            }
+        }
+    }
+
+    for(y=r; y<h-r; y++)
+    {
+        for(x=r; x<w-r; x++)
+        {
+            idx=(size_t)y*w+x;
+
+            v=acc[2*idx];
+            if(v<0.0f) v=0.0f;
+            if(v>255.0f) v=255.0f;
+            da[idx]=(unsigned char)v;
+
+            if(db)
+            {
+                v=acc[2*idx+1];
+                if(v<0.0f) v=0.0f;
+                if(v>255.0f) v=255.0f;
+                db[idx]=(unsigned char)v;
+            }
+        }
+    }
+
+    free(img); free(col); free(acc);
+    return 0;
+}
+
+
+int fft_conv_prefer(const double *psf, int size)
+{
+    conv_kernel_t k;
+    fft_conv_t f;
+    unsigned char *src, *dst;
+    double start, direct, fft;
+    int idx, r=size/2, dim=CALIBRATE_DIM;
+
+    if(size > CONV_MAX_SIZE)
+        return 1;
+    if(conv_kernel_init(&k, psf, size) < 0 || fft_conv_init(&f, psf, size) < 0)
+        return 0;
+
+    src=malloc((size_t)dim*dim);
+    dst=malloc((size_t)dim*dim);
+    if(!src || !dst)
+    {
+        free(src); free(dst);
+        fft_conv_free(&f);
+        return 0;
+    }
+    for(idx=0; idx<dim*dim; idx++)
+        src[idx]=rand();
+
+    // Two planes each way, the FFT path carries both in one pass
+    start=bench_now_ns();
+    conv_tile(&k, src, dst, dim, r, r, dim-2*r, dim-2*r);
+    conv_tile(&k, src, dst, dim, r, r, dim-2*r, dim-2*r);
+    direct=bench_now_ns()-start;
+
+    // A failed FFT pass times nothing, stay direct
+    start=bench_now_ns();
+    idx=fft_conv_planes(&f, src, src, dst, dst, dim, dim);
+    fft=bench_now_ns()-start;
+
+    free(src); free(dst);
+    fft_conv_free(&f);
+    return idx == 0 && fft < direct;
+}
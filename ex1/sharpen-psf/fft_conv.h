@@ -0,0 +1,42 @@
+#ifndef FFT_CONV_H
+#define FFT_CONV_H
+
+// FFT convolution for large PSFs
+//
+// Overlap-add over square blocks: each block of the input is zero padded to
+// an n x n power-of-two FFT, multiplied by the cached spectrum of the PSF and
+// transformed back, and the n x n result is added into a float accumulator
+// at the block's position.  n is chosen per PSF size to minimize FFT work per
+// output pixel.  Since the PSF is real, two planes are carried at once as
+// the real and imaginary parts of one complex image (R+iG, then B).
+//
+// The float FFT carries a relative error around 1e-6, so an output that
+// lands within that of an integer can truncate one step away from the
+// direct kernel: tolerance is +/-1.
+
+#define FFT_MAX_SIZE 255
+
+typedef struct
+{
+    int size;           // PSF size k (odd)
+    int n;              // FFT size
+    int block;          // input block edge, n - k + 1
+    float *spec;        // n*n complex PSF spectrum, scaled by 1/(n*n)
+    float *tw;          // n/2 complex twiddles
+    int *rev;           // bit-reversal permutation
+} fft_conv_t;
+
+// Build the spectrum of a size x size row-major PSF.  Returns 0 or -1.
+int fft_conv_init(fft_conv_t *f, const double *psf, int size);
+void fft_conv_free(fft_conv_t *f);
+
+// Convolve the interior of up to two w x h planes (b/db may be NULL).  Pixels
+// within size/2 of the edge of da/db are left unchanged.  Returns 0 or -1.
+int fft_conv_planes(const fft_conv_t *f, const unsigned char *a, const unsigned char *b,
+                    unsigned char *da, unsigned char *db, int w, int h);
+
+// Time the direct conv_kernel engine against the FFT path for this PSF on a
+// 256 x 256 patch.  Returns 1 when FFT is faster; always 1 above CONV_MAX_SIZE.
+int fft_conv_prefer(const double *psf, int size);
+
+#endif
@@ -0,0 +1,59 @@
+#include <stdlib.h>
+
+#include "frame_queue.h"
+
+
+int frame_queue_init(frame_queue_t *q, int cap)
+{
+    if(cap < 1 || !(q->slot = calloc(cap, sizeof(void *))))
+        return -1;
+
+    q->cap=cap;
+    q->head=0;
+    q->count=0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+
+void frame_queue_destroy(frame_queue_t *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->slot);
+}
+
+
+void frame_queue_push(frame_queue_t *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->count == q->cap)
+        pthread_cond_wait(&q->not_full, &q->lock);
+
+    q->slot[(q->head + q->count) % q->cap]=item;
+    q->count++;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+void *frame_queue_pop(frame_queue_t *q)
+{
+    void *item;
+
+    pthread_mutex_lock(&q->lock);
+    while(q->count == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+
+    item=q->slot[q->head];
+    q->head=(q->head + 1) % q->cap;
+    q->count--;
+
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
@@ -0,0 +1,26 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <pthread.h>
+
+// Bounded blocking FIFO of pointers connecting pipeline stages.  Push blocks
+// while the queue is full, which is what keeps a fast reader from running
+// ahead of a slow writer.  A NULL item is passed through as end-of-stream.
+
+typedef struct
+{
+    void **slot;
+    int cap;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} frame_queue_t;
+
+int frame_queue_init(frame_queue_t *q, int cap);
+void frame_queue_destroy(frame_queue_t *q);
+void frame_queue_push(frame_queue_t *q, void *item);
+void *frame_queue_pop(frame_queue_t *q);
+
+#endif
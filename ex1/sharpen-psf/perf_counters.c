@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf_counters.h"
+
+
+static const struct
+{
+    unsigned type;
+    unsigned long long config;
+} perf_events[PERF_NEVENTS] =
+{
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+
+static int warned;
+
+
+int perf_counters_open(perf_counters_t *pc)
+{
+    struct perf_event_attr attr;
+    int k, n=0, err=0;
+
+    for(k=0; k<PERF_NEVENTS; k++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size=sizeof(attr);
+        attr.type=perf_events[k].type;
+        attr.config=perf_events[k].config;
+        attr.disabled=1;
+        attr.exclude_kernel=1;
+        attr.exclude_hv=1;
+        attr.read_format=PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // This thread, any CPU
+        pc->fd[k]=syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if(pc->fd[k] < 0)
+            err=errno;
+        else
+            n++;
+    }
+
+    // Every worker opens its own set, one message is enough
+    if(n == 0 && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+        printf("perf counters unavailable: %s (see /proc/sys/kernel/perf_event_paranoid)\n", strerror(err));
+
+    return n;
+}
+
+
+void perf_counters_close(perf_counters_t *pc)
+{
+    int k;
+
+    for(k=0; k<PERF_NEVENTS; k++)
+    {
+        if(pc->fd[k] >= 0)
+            close(pc->fd[k]);
+        pc->fd[k]=-1;
+    }
+}
+
+
+void perf_counters_start(perf_counters_t *pc)
+{
+    int k;
+
+    for(k=0; k<PERF_NEVENTS; k++)
+    {
+        if(pc->fd[k] < 0)
+            continue;
+        ioctl(pc->fd[k], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fd[k], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+
+void perf_counters_stop(perf_counters_t *pc)
+{
+    int k;
+
+    for(k=0; k<PERF_NEVENTS; k++)
+        if(pc->fd[k] >= 0)
+            ioctl(pc->fd[k], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+
+void perf_counters_read(const perf_counters_t *pc, perf_sample_t *s)
+{
+    unsigned long long buf[3];     // value, time_enabled, time_running
+    int k;
+
+    for(k=0; k<PERF_NEVENTS; k++)
+    {
+        s->v[k]=0;
+        s->valid[k]=0;
+        if(pc->fd[k] < 0 || read(pc->fd[k], buf, sizeof(buf)) != sizeof(buf))
+            continue;
+
+        // Multiplexed: extrapolate from the fraction of time on the PMU
+        if(buf[2] && buf[2] < buf[1])
+            buf[0]=(unsigned long long)((double)buf[0]*buf[1]/buf[2]);
+        s->v[k]=buf[0];
+        s->valid[k]=(buf[1] == 0 || buf[2] != 0);
+    }
+}
+
+
+void perf_sample_add(perf_sample_t *acc, const perf_sample_t *s)
+{
+    int k;
+
+    for(k=0; k<PERF_NEVENTS; k++)
+    {
+        acc->v[k]+=s->v[k];
+        acc->valid[k]|=s->valid[k];
+    }
+}
+
+
+char *perf_sample_format(const perf_sample_t *s, double npix, char *buf, size_t len)
+{
+    static const char *label[PERF_NEVENTS]={"cyc/px", NULL, "L1D miss/px", "LLC miss/px", "br miss/px"};
+    size_t used=0;
+    int k;
+
+    if(npix <= 0.0)
+        npix=1.0;
+
+    buf[0]='\0';
+    for(k=0; k<PERF_NEVENTS && used<len; k++)
+    {
+        // Instructions are shown as IPC, which says more than insn/px alone
+        if(k == PERF_INSTRUCTIONS)
+        {
+            if(s->valid[PERF_INSTRUCTIONS] && s->valid[PERF_CYCLES] && s->v[PERF_CYCLES])
+                used+=snprintf(buf+used, len-used, "IPC %.2f  ",
+                               (double)s->v[PERF_INSTRUCTIONS]/s->v[PERF_CYCLES]);
+            else
+                used+=snprintf(buf+used, len-used, "IPC n/a  ");
+        }
+        else if(s->valid[k])
+            used+=snprintf(buf+used, len-used, "%s %.4g  ", label[k], (double)s->v[k]/npix);
+        else
+            used+=snprintf(buf+used, len-used, "%s n/a  ", label[k]);
+    }
+
+    // Drop the trailing separator
+    if(used >= 2 && used < len)
+        buf[used-2]='\0';
+    return buf;
+}
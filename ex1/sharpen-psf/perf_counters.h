@@ -0,0 +1,64 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stddef.h>
+
+// Hardware performance counters through perf_event_open
+//
+// One set of counters follows a single thread (the one that opened it).  Each
+// event is opened on its own rather than as a group, so a PMU that lacks one
+// event (common in VMs) still reports the others; values are scaled by
+// time_enabled/time_running when the kernel multiplexes them.  Only user
+// space is counted, which works at the default perf_event_paranoid of 2.
+//
+// Shared with ex2/q5/edge.cpp, hence the C linkage guards.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NEVENTS
+};
+
+typedef struct
+{
+    int fd[PERF_NEVENTS];       // -1 where the event is unsupported
+} perf_counters_t;
+
+typedef struct
+{
+    unsigned long long v[PERF_NEVENTS];
+    int valid[PERF_NEVENTS];
+} perf_sample_t;
+
+// Open counters for the calling thread, initially disabled.  Returns the
+// number of events available; 0 (with a message printed) when none are.
+int perf_counters_open(perf_counters_t *pc);
+void perf_counters_close(perf_counters_t *pc);
+
+// Zero and enable, or disable.  May be called from any thread.
+void perf_counters_start(perf_counters_t *pc);
+void perf_counters_stop(perf_counters_t *pc);
+
+// Current counts into s (the counters keep running if enabled).
+void perf_counters_read(const perf_counters_t *pc, perf_sample_t *s);
+
+// acc += s, acc zeroed to start.
+void perf_sample_add(perf_sample_t *acc, const perf_sample_t *s);
+
+// "cyc/px 3.21  IPC 2.10  L1D miss/px 0.031  LLC miss/px 0.0004  br miss/px 0.0012"
+// normalized by npix, n/a for missing events.  Returns buf.
+char *perf_sample_format(const perf_sample_t *s, double npix, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+#include "ppm_io.h"
+
+
+// Skip whitespace and '#' comments, then parse one unsigned header field.
+static int ppm_field(const unsigned char *buf, size_t len, size_t *pos, unsigned *val)
+{
+    size_t p=*pos;
+    unsigned v=0;
+    int digits=0;
+
+    while(p < len)
+    {
+        if(buf[p] == '#')
+        {
+            while(p < len && buf[p] != '\n') p++;
+        }
+        else if(isspace(buf[p]))
+            p++;
+        else
+            break;
+    }
+
+    while(p < len && isdigit(buf[p]))
+    {
+        v = v*10 + (buf[p]-'0');
+        p++; digits++;
+    }
+
+    if(digits == 0 || digits > 9)
+        return -1;
+
+    *val=v;
+    *pos=p;
+    return 0;
+}
+
+
+int ppm_parse_header(const unsigned char *buf, size_t len, ppm_image_t *img, size_t *hdr_len)
+{
+    size_t pos=2;
+
+    if(len < 3 || buf[0] != 'P' || (buf[1] != '6' && buf[1] != '5'))
+    {
+        printf("not a binary PPM/PGM file\n");
+        return -1;
+    }
+    img->channels = (buf[1] == '6') ? 3 : 1;
+
+    if(ppm_field(buf, len, &pos, &img->w) < 0 ||
+       ppm_field(buf, len, &pos, &img->h) < 0 ||
+       ppm_field(buf, len, &pos, &img->maxval) < 0 ||
+       pos >= len || !isspace(buf[pos]) || img->maxval == 0)
+    {
+        printf("incorrect dimension format in the file header\n");
+        return -1;
+    }
+
+    // Exactly one whitespace byte separates the header from the raster
+    *hdr_len=pos+1;
+    return 0;
+}
+
+
+int ppm_open(const char *path, ppm_image_t *img)
+{
+    struct stat st;
+    size_t hdr_len, need;
+
+    memset(img, 0, sizeof(*img));
+    img->fd=-1;
+
+    if((img->fd = open(path, O_RDONLY)) < 0)
+    {
+        printf("Error opening %s\n", path);
+        return -1;
+    }
+
+    if(fstat(img->fd, &st) < 0 || st.st_size < 3)
+    {
+        printf("Error reading header data\n");
+        ppm_close(img);
+        return -1;
+    }
+
+    img->map_len=(size_t)st.st_size;
+    img->map=mmap(NULL, img->map_len, PROT_READ, MAP_PRIVATE, img->fd, 0);
+    if(img->map == MAP_FAILED)
+    {
+        img->map=NULL;
+        perror("mmap");
+        ppm_close(img);
+        return -1;
+    }
+    madvise(img->map, img->map_len, MADV_SEQUENTIAL);
+
+    if(ppm_parse_header(img->map, img->map_len, img, &hdr_len) < 0)
+    {
+        printf("bad header in %s\n", path);
+        ppm_close(img);
+        return -1;
+    }
+    img->pixels=img->map+hdr_len;
+
+    need=(size_t)img->w * img->h * img->channels * (img->maxval > 255 ? 2 : 1);
+    if((size_t)(img->map+img->map_len-img->pixels) < need)
+    {
+        printf("%s is truncated: %u x %u needs %zu bytes of pixel data\n", path, img->w, img->h, need);
+        ppm_close(img);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int ppm_stream_open(const char *path, ppm_image_t *img)
+{
+    unsigned char buf[PPM_MAX_HEADER];
+    ssize_t len;
+    size_t hdr_len;
+
+    memset(img, 0, sizeof(*img));
+
+    if((img->fd = open(path, O_RDONLY)) < 0)
+    {
+        printf("Error opening %s\n", path);
+        return -1;
+    }
+
+    if((len = pread(img->fd, buf, sizeof(buf), 0)) < 3 ||
+       ppm_parse_header(buf, (size_t)len, img, &hdr_len) < 0 ||
+       lseek(img->fd, (off_t)hdr_len, SEEK_SET) < 0)
+    {
+        printf("bad header in %s\n", path);
+        ppm_close(img);
+        return -1;
+    }
+
+    posix_fadvise(img->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+
+int ppm_read_full(int fd, void *buf, size_t len)
+{
+    ssize_t rc;
+    size_t done=0;
+
+    while(done < len)
+    {
+        rc=read(fd, (char *)buf+done, len-done);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;
+        done+=rc;
+    }
+    return 0;
+}
+
+
+int ppm_write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t rc;
+    size_t done=0;
+
+    while(done < len)
+    {
+        rc=write(fd, (const char *)buf+done, len-done);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0)
+            return -1;
+        done+=rc;
+    }
+    return 0;
+}
+
+
+int ppm_format_header(char *hdr, size_t size, int channels, const char *comment,
+                      unsigned w, unsigned h, unsigned maxval)
+{
+    int len;
+
+    if(comment)
+        len=snprintf(hdr, size, "P%c\n# %s\n%u %u\n%u\n", channels == 3 ? '6' : '5', comment, w, h, maxval);
+    else
+        len=snprintf(hdr, size, "P%c\n%u %u\n%u\n", channels == 3 ? '6' : '5', w, h, maxval);
+
+    return (len < 0 || len >= (int)size) ? -1 : len;
+}
+
+
+void ppm_close(ppm_image_t *img)
+{
+    if(img->map)
+        munmap(img->map, img->map_len);
+    if(img->fd >= 0)
+        close(img->fd);
+    img->map=NULL;
+    img->fd=-1;
+}
+
+
+#if defined(__SSSE3__)
+
+// Shuffle masks for 3 vectors of interleaved data (16 8-bit or 8 16-bit
+// pixels).  deint[c][v] moves the bytes of channel c found in input vector v
+// to their plane position; inter[v][c] moves plane c bytes to their position
+// in output vector v.  The 16-bit masks also swap big-endian file order to
+// host order, which costs nothing extra in the same shuffle.
+static unsigned char deint[3][3][16] __attribute__((aligned(16)));
+static unsigned char inter[3][3][16] __attribute__((aligned(16)));
+static unsigned char deint16[3][3][16] __attribute__((aligned(16)));
+static unsigned char inter16[3][3][16] __attribute__((aligned(16)));
+static unsigned char swap16[16] __attribute__((aligned(16)));
+static pthread_once_t masks_once=PTHREAD_ONCE_INIT;
+
+static void ppm_build_masks(void)
+{
+    int c, v, p, k, e, src;
+
+    memset(deint, 0x80, sizeof(deint));
+    memset(inter, 0x80, sizeof(inter));
+    memset(deint16, 0x80, sizeof(deint16));
+    memset(inter16, 0x80, sizeof(inter16));
+
+    for(c=0; c<3; c++)
+        for(k=0; k<16; k++)
+            deint[c][(3*k+c)/16][k]=(3*k+c)%16;
+
+    for(v=0; v<3; v++)
+        for(p=0; p<16; p++)
+            inter[v][(16*v+p)%3][p]=(16*v+p)/3;
+
+    // Byte p of a plane vector is byte (1 - p%2) of element 3*(p/2)+c
+    for(c=0; c<3; c++)
+        for(p=0; p<16; p++)
+        {
+            src=2*(3*(p/2)+c) + (1-(p%2));
+            deint16[c][src/16][p]=src%16;
+        }
+
+    for(v=0; v<3; v++)
+        for(p=0; p<16; p++)
+        {
+            e=(16*v+p)/2;
+            inter16[v][e%3][p]=2*(e/3) + (1-(p%2));
+        }
+
+    for(p=0; p<16; p++)
+        swap16[p]=p^1;
+}
+
+#endif
+
+
+void ppm_deinterleave_rgb(const unsigned char *rgb, unsigned char *r, unsigned char *g,
+                          unsigned char *b, size_t n)
+{
+    size_t i=0;
+
+#if defined(__SSSE3__)
+    __m128i m[3][3];
+    int c, v;
+
+    pthread_once(&masks_once, ppm_build_masks);
+    for(c=0; c<3; c++)
+        for(v=0; v<3; v++)
+            m[c][v]=_mm_load_si128((const __m128i *)deint[c][v]);
+
+    for(; i+16<=n; i+=16)
+    {
+        __m128i a=_mm_loadu_si128((const __m128i *)(rgb+3*i));
+        __m128i bb=_mm_loadu_si128((const __m128i *)(rgb+3*i+16));
+        __m128i cc=_mm_loadu_si128((const __m128i *)(rgb+3*i+32));
+
+        _mm_storeu_si128((__m128i *)(r+i), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m[0][0]),
+                         _mm_shuffle_epi8(bb, m[0][1])), _mm_shuffle_epi8(cc, m[0][2])));
+        _mm_storeu_si128((__m128i *)(g+i), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m[1][0]),
+                         _mm_shuffle_epi8(bb, m[1][1])), _mm_shuffle_epi8(cc, m[1][2])));
+        _mm_storeu_si128((__m128i *)(b+i), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m[2][0]),
+                         _mm_shuffle_epi8(bb, m[2][1])), _mm_shuffle_epi8(cc, m[2][2])));
+    }
+#endif
+
+    for(; i<n; i++)
+    {
+        r[i]=rgb[3*i];
+        g[i]=rgb[3*i+1];
+        b[i]=rgb[3*i+2];
+    }
+}
+
+
+void ppm_interleave_rgb(const unsigned char *r, const unsigned char *g, const unsigned char *b,
+                        unsigned char *rgb, size_t n)
+{
+    size_t i=0;
+
+#if defined(__SSSE3__)
+    __m128i m[3][3];
+    int c, v;
+
+    pthread_once(&masks_once, ppm_build_masks);
+    for(v=0; v<3; v++)
+        for(c=0; c<3; c++)
+            m[v][c]=_mm_load_si128((const __m128i *)inter[v][c]);
+
+    for(; i+16<=n; i+=16)
+    {
+        __m128i vr=_mm_loadu_si128((const __m128i *)(r+i));
+        __m128i vg=_mm_loadu_si128((const __m128i *)(g+i));
+        __m128i vb=_mm_loadu_si128((const __m128i *)(b+i));
+
+        for(v=0; v<3; v++)
+            _mm_storeu_si128((__m128i *)(rgb+3*i+16*v), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, m[v][0]),
+                             _mm_shuffle_epi8(vg, m[v][1])), _mm_shuffle_epi8(vb, m[v][2])));
+    }
+#endif
+
+    for(; i<n; i++)
+    {
+        rgb[3*i]=r[i];
+        rgb[3*i+1]=g[i];
+        rgb[3*i+2]=b[i];
+    }
+}
+
+
+void ppm_deinterleave_rgb16(const unsigned char *be, unsigned short *r, unsigned short *g,
+                            unsigned short *b, size_t n)
+{
+    size_t i=0;
+
+#if defined(__SSSE3__)
+    __m128i m[3][3];
+    int c, v;
+
+    pthread_once(&masks_once, ppm_build_masks);
+    for(c=0; c<3; c++)
+        for(v=0; v<3; v++)
+            m[c][v]=_mm_load_si128((const __m128i *)deint16[c][v]);
+
+    for(; i+8<=n; i+=8)
+    {
+        __m128i a=_mm_loadu_si128((const __m128i *)(be+6*i));
+        __m128i bb=_mm_loadu_si128((const __m128i *)(be+6*i+16));
+        __m128i cc=_mm_loadu_si128((const __m128i *)(be+6*i+32));
+
+        _mm_storeu_si128((__m128i *)(r+i), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m[0][0]),
+                         _mm_shuffle_epi8(bb, m[0][1])), _mm_shuffle_epi8(cc, m[0][2])));
+        _mm_storeu_si128((__m128i *)(g+i), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m[1][0]),
+                         _mm_shuffle_epi8(bb, m[1][1])), _mm_shuffle_epi8(cc, m[1][2])));
+        _mm_storeu_si128((__m128i *)(b+i), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m[2][0]),
+                         _mm_shuffle_epi8(bb, m[2][1])), _mm_shuffle_epi8(cc, m[2][2])));
+    }
+#endif
+
+    for(; i<n; i++)
+    {
+        r[i]=(be[6*i]<<8) | be[6*i+1];
+        g[i]=(be[6*i+2]<<8) | be[6*i+3];
+        b[i]=(be[6*i+4]<<8) | be[6*i+5];
+    }
+}
+
+
+void ppm_interleave_rgb16(const unsigned short *r, const unsigned short *g, const unsigned short *b,
+                          unsigned char *be, size_t n)
+{
+    size_t i=0;
+
+#if defined(__SSSE3__)
+    __m128i m[3][3];
+    int c, v;
+
+    pthread_once(&masks_once, ppm_build_masks);
+    for(v=0; v<3; v++)
+        for(c=0; c<3; c++)
+            m[v][c]=_mm_load_si128((const __m128i *)inter16[v][c]);
+
+    for(; i+8<=n; i+=8)
+    {
+        __m128i vr=_mm_loadu_si128((const __m128i *)(r+i));
+        __m128i vg=_mm_loadu_si128((const __m128i *)(g+i));
+        __m128i vb=_mm_loadu_si128((const __m128i *)(b+i));
+
+        for(v=0; v<3; v++)
+            _mm_storeu_si128((__m128i *)(be+6*i+16*v), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, m[v][0]),
+                             _mm_shuffle_epi8(vg, m[v][1])), _mm_shuffle_epi8(vb, m[v][2])));
+    }
+#endif
+
+    for(; i<n; i++)
+    {
+        be[6*i]=r[i]>>8; be[6*i+1]=r[i];
+        be[6*i+2]=g[i]>>8; be[6*i+3]=g[i];
+        be[6*i+4]=b[i]>>8; be[6*i+5]=b[i];
+    }
+}
+
+
+void ppm_swap16(const void *src, void *dst, size_t n)
+{
+    const unsigned char *s=(const unsigned char *)src;
+    unsigned char *d=(unsigned char *)dst;
+    unsigned char t;
+    size_t i=0;
+
+#if defined(__SSSE3__)
+    __m128i m;
+
+    pthread_once(&masks_once, ppm_build_masks);
+    m=_mm_load_si128((const __m128i *)swap16);
+
+    for(; i+8<=n; i+=8)
+        _mm_storeu_si128((__m128i *)(d+2*i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s+2*i)), m));
+#endif
+
+    for(; i<n; i++)
+    {
+        t=s[2*i];
+        d[2*i]=s[2*i+1];
+        d[2*i+1]=t;
+    }
+}
+
+
+int ppm_write16(const char *path, const char *comment, int channels, unsigned w, unsigned h,
+                unsigned maxval, unsigned short *const planes[3])
+{
+    char hdr[PPM_MAX_HEADER];
+    int fd, len;
+    size_t total, npix=(size_t)w*h;
+    unsigned char *map;
+
+    if((len = ppm_format_header(hdr, sizeof(hdr), channels, comment, w, h, maxval)) < 0)
+        return -1;
+
+    total=(size_t)len + npix*channels*2;
+
+    if((fd = open(path, (O_RDWR | O_CREAT | O_TRUNC), 0666)) < 0)
+    {
+        printf("Error opening %s\n", path);
+        return -1;
+    }
+
+    if(ftruncate(fd, (off_t)total) < 0 ||
+       (map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        perror("ppm_write16");
+        close(fd);
+        return -1;
+    }
+
+    memcpy(map, hdr, len);
+    if(channels == 3)
+        ppm_interleave_rgb16(planes[0], planes[1], planes[2], map+len, npix);
+    else
+        ppm_swap16(planes[0], map+len, npix);
+
+    munmap(map, total);
+    close(fd);
+    return 0;
+}
+
+
+// P6 from three planes (channels 3) or P5 from r alone (channels 1)
+static int ppm_write_planes(const char *path, const char *comment, int channels, unsigned w, unsigned h,
+                            const unsigned char *r, const unsigned char *g, const unsigned char *b)
+{
+    char hdr[PPM_MAX_HEADER];
+    int fd, len;
+    size_t total;
+    unsigned char *map;
+
+    if((len = ppm_format_header(hdr, sizeof(hdr), channels, comment, w, h, 255)) < 0)
+        return -1;
+
+    total=(size_t)len + (size_t)w*h*channels;
+
+    if((fd = open(path, (O_RDWR | O_CREAT | O_TRUNC), 0666)) < 0)
+    {
+        printf("Error opening %s\n", path);
+        return -1;
+    }
+
+    if(ftruncate(fd, (off_t)total) < 0)
+    {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    map=mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+
+    memcpy(map, hdr, len);
+    if(channels == 3)
+        ppm_interleave_rgb(r, g, b, map+len, (size_t)w*h);
+    else
+        memcpy(map+len, r, (size_t)w*h);
+
+    munmap(map, total);
+    close(fd);
+    return 0;
+}
+
+
+int ppm_write_rgb(const char *path, const char *comment, unsigned w, unsigned h,
+                  const unsigned char *r, const unsigned char *g, const unsigned char *b)
+{
+    return ppm_write_planes(path, comment, 3, w, h, r, g, b);
+}
+
+
+int ppm_write_gray(const char *path, const char *comment, unsigned w, unsigned h,
+                   const unsigned char *y)
+{
+    return ppm_write_planes(path, comment, 1, w, h, y, NULL, NULL);
+}
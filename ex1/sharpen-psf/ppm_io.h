@@ -0,0 +1,73 @@
+#ifndef PPM_IO_H
+#define PPM_IO_H
+
+#include <stddef.h>
+
+// Memory-mapped PPM/PGM I/O
+//
+// ppm_open() maps the whole input file read-only and parses the header in
+// place, so pixel data is never copied through read().  The planar helpers
+// split or merge interleaved RGB with SSSE3 byte shuffles (16 pixels per
+// iteration) and fall back to scalar code otherwise.
+
+typedef struct
+{
+    int fd;
+    unsigned char *map;              // whole file
+    size_t map_len;
+    const unsigned char *pixels;     // first byte after the header
+    unsigned w, h, maxval;
+    int channels;                    // 3 for P6, 1 for P5
+} ppm_image_t;
+
+#define PPM_MAX_HEADER 512
+
+// Parse a P6/P5 header at the start of buf.  *hdr_len is set to the offset of
+// the first pixel byte.  Returns 0 on success, -1 on error.
+int ppm_parse_header(const unsigned char *buf, size_t len, ppm_image_t *img, size_t *hdr_len);
+
+// Map and parse path.  Returns 0 on success, -1 with a message printed on error.
+int ppm_open(const char *path, ppm_image_t *img);
+void ppm_close(ppm_image_t *img);
+
+// Open path for a single sequential pass: only the header is parsed and
+// img->fd is left positioned at the first pixel byte.  map/pixels stay NULL.
+int ppm_stream_open(const char *path, ppm_image_t *img);
+
+// read()/write() exactly len bytes, retrying short transfers.  0 or -1.
+int ppm_read_full(int fd, void *buf, size_t len);
+int ppm_write_full(int fd, const void *buf, size_t len);
+
+// Format a P6 (channels 3) or P5 header.  Returns its length or -1.
+int ppm_format_header(char *hdr, size_t size, int channels, const char *comment,
+                      unsigned w, unsigned h, unsigned maxval);
+
+// Split n interleaved RGB pixels into three planes, and the reverse.
+void ppm_deinterleave_rgb(const unsigned char *rgb, unsigned char *r, unsigned char *g,
+                          unsigned char *b, size_t n);
+void ppm_interleave_rgb(const unsigned char *r, const unsigned char *g, const unsigned char *b,
+                        unsigned char *rgb, size_t n);
+
+// 16-bit (maxval > 255) variants.  File data is big-endian, planes are in
+// host order; the byte swap is folded into the shuffles.  ppm_swap16() swaps
+// n 16-bit values and works in either direction (src may equal dst).
+void ppm_deinterleave_rgb16(const unsigned char *be, unsigned short *r, unsigned short *g,
+                            unsigned short *b, size_t n);
+void ppm_interleave_rgb16(const unsigned short *r, const unsigned short *g, const unsigned short *b,
+                          unsigned char *be, size_t n);
+void ppm_swap16(const void *src, void *dst, size_t n);
+
+// Write a 16-bit P6 (channels 3, three planes) or P5 (channels 1, planes[0]).
+int ppm_write16(const char *path, const char *comment, int channels, unsigned w, unsigned h,
+                unsigned maxval, unsigned short *const planes[3]);
+
+// Write a P6 file from three planes through a single mmap of the output.
+// comment may be NULL.  Returns 0 on success, -1 on error.
+int ppm_write_rgb(const char *path, const char *comment, unsigned w, unsigned h,
+                  const unsigned char *r, const unsigned char *g, const unsigned char *b);
+
+// Same for an 8-bit P5 from one plane.
+int ppm_write_gray(const char *path, const char *comment, unsigned w, unsigned h,
+                   const unsigned char *y);
+
+#endif
@@ -0,0 +1,293 @@
+#include <math.h>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include "psf_kernel.h"
+
+#define MAX_SHIFT 14
+
+
+// Largest shift where the sum of the positive (negative) taps times maxpix
+// still fits in a signed lane of the given limit, down to shift 0.
+static int psf3x3_quantize_lanes(const double psf[9], psf3x3_q_t *q, double maxpix, double limit)
+{
+    int k, shift;
+    double pos, neg;
+
+    for(shift=MAX_SHIFT; shift>=0; shift--)
+    {
+        pos=0.0; neg=0.0;
+        for(k=0; k<9; k++)
+        {
+            double t=nearbyint(psf[k]*(double)(1<<shift));
+            if(t>0.0) pos+=t; else neg+=t;
+        }
+        if(pos*maxpix <= limit && neg*maxpix >= -limit-1.0 && pos <= 32767.0 && neg >= -32768.0)
+            break;
+    }
+
+    // Even integer taps overflow the lanes
+    if(shift < 0)
+    {
+        q->shift=0;
+        q->exact=0;
+        return -1;
+    }
+
+    q->shift=shift;
+    q->exact=1;
+    for(k=0; k<9; k++)
+    {
+        double scaled=psf[k]*(double)(1<<shift);
+        q->tap[k]=(short)nearbyint(scaled);
+        if((double)q->tap[k] != scaled)
+            q->exact=0;
+    }
+
+    return q->exact ? 0 : 1;
+}
+
+
+int psf3x3_quantize(const double psf[9], psf3x3_q_t *q)
+{
+    return psf3x3_quantize_lanes(psf, q, 255.0, 32767.0);
+}
+
+
+int psf3x3_quantize16(const double psf[9], unsigned maxval, psf3x3_q_t *q)
+{
+    return psf3x3_quantize_lanes(psf, q, (double)maxval, 2147483647.0);
+}
+
+
+unsigned psf3x3_error_bound(const double psf[9], const psf3x3_q_t *q, unsigned maxval)
+{
+    double err=0.0;
+    int k;
+
+    if(q->exact)
+        return 0;
+
+    for(k=0; k<9; k++)
+        err+=fabs((double)q->tap[k]/(double)(1<<q->shift) - psf[k]);
+
+    return (unsigned)floor(err*(double)maxval) + 1;
+}
+
+
+static inline unsigned char psf3x3_pixel(const unsigned char *a, const unsigned char *r,
+                                         const unsigned char *b, const short *t, int shift)
+{
+    int sum;
+
+    sum  = t[0]*a[-1] + t[1]*a[0] + t[2]*a[1];
+    sum += t[3]*r[-1] + t[4]*r[0] + t[5]*r[1];
+    sum += t[6]*b[-1] + t[7]*b[0] + t[8]*b[1];
+    sum >>= shift;
+
+    if(sum<0) sum=0;
+    if(sum>255) sum=255;
+    return (unsigned char)sum;
+}
+
+
+#if defined(__AVX2__)
+
+// 32 pixels per iteration, two sets of 16 16-bit lanes
+void psf3x3_row(const unsigned char *above, const unsigned char *row,
+                const unsigned char *below, unsigned char *out, int n,
+                const psf3x3_q_t *q)
+{
+    const unsigned char *src[9]={above-1, above, above+1, row-1, row, row+1, below-1, below, below+1};
+    __m256i tap[9];
+    __m256i zero=_mm256_setzero_si256();
+    __m128i shift=_mm_cvtsi32_si128(q->shift);
+    int x=0, k;
+
+    for(k=0; k<9; k++)
+        tap[k]=_mm256_set1_epi16(q->tap[k]);
+
+    for(; x+32<=n; x+=32)
+    {
+        __m256i lo=zero, hi=zero;
+
+        for(k=0; k<9; k++)
+        {
+            __m256i v=_mm256_loadu_si256((const __m256i *)(src[k]+x));
+            lo=_mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(v, zero), tap[k]));
+            hi=_mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(v, zero), tap[k]));
+        }
+        lo=_mm256_sra_epi16(lo, shift);
+        hi=_mm256_sra_epi16(hi, shift);
+
+        // packus clamps to [0,255] and undoes the in-lane unpack ordering
+        _mm256_storeu_si256((__m256i *)(out+x), _mm256_packus_epi16(lo, hi));
+    }
+
+    for(; x<n; x++)
+        out[x]=psf3x3_pixel(above+x, row+x, below+x, q->tap, q->shift);
+}
+
+const char *psf3x3_isa(void) { return "AVX2"; }
+
+#elif defined(__SSE2__)
+
+// 16 pixels per iteration, two sets of 8 16-bit lanes
+void psf3x3_row(const unsigned char *above, const unsigned char *row,
+                const unsigned char *below, unsigned char *out, int n,
+                const psf3x3_q_t *q)
+{
+    const unsigned char *src[9]={above-1, above, above+1, row-1, row, row+1, below-1, below, below+1};
+    __m128i tap[9];
+    __m128i zero=_mm_setzero_si128();
+    __m128i shift=_mm_cvtsi32_si128(q->shift);
+    int x=0, k;
+
+    for(k=0; k<9; k++)
+        tap[k]=_mm_set1_epi16(q->tap[k]);
+
+    for(; x+16<=n; x+=16)
+    {
+        __m128i lo=zero, hi=zero;
+
+        for(k=0; k<9; k++)
+        {
+            __m128i v=_mm_loadu_si128((const __m128i *)(src[k]+x));
+            lo=_mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), tap[k]));
+            hi=_mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), tap[k]));
+        }
+        lo=_mm_sra_epi16(lo, shift);
+        hi=_mm_sra_epi16(hi, shift);
+
+        _mm_storeu_si128((__m128i *)(out+x), _mm_packus_epi16(lo, hi));
+    }
+
+    for(; x<n; x++)
+        out[x]=psf3x3_pixel(above+x, row+x, below+x, q->tap, q->shift);
+}
+
+const char *psf3x3_isa(void) { return "SSE2"; }
+
+#else
+
+void psf3x3_row(const unsigned char *above, const unsigned char *row,
+                const unsigned char *below, unsigned char *out, int n,
+                const psf3x3_q_t *q)
+{
+    int x;
+
+    for(x=0; x<n; x++)
+        out[x]=psf3x3_pixel(above+x, row+x, below+x, q->tap, q->shift);
+}
+
+const char *psf3x3_isa(void) { return "scalar"; }
+
+#endif
+
+
+static inline unsigned short psf3x3_pixel16(const unsigned short *a, const unsigned short *r,
+                                            const unsigned short *b, const short *t, int shift,
+                                            int maxval)
+{
+    int sum;
+
+    sum  = t[0]*a[-1] + t[1]*a[0] + t[2]*a[1];
+    sum += t[3]*r[-1] + t[4]*r[0] + t[5]*r[1];
+    sum += t[6]*b[-1] + t[7]*b[0] + t[8]*b[1];
+    sum >>= shift;
+
+    if(sum<0) sum=0;
+    if(sum>maxval) sum=maxval;
+    return (unsigned short)sum;
+}
+
+
+#if defined(__AVX2__)
+
+// 16 pixels per iteration, two sets of 8 32-bit lanes
+void psf3x3_row16(const unsigned short *above, const unsigned short *row,
+                  const unsigned short *below, unsigned short *out, int n,
+                  const psf3x3_q_t *q, unsigned maxval)
+{
+    const unsigned short *src[9]={above-1, above, above+1, row-1, row, row+1, below-1, below, below+1};
+    __m256i tap[9];
+    __m256i vmax=_mm256_set1_epi16((short)maxval);
+    __m128i shift=_mm_cvtsi32_si128(q->shift);
+    int x=0, k;
+
+    for(k=0; k<9; k++)
+        tap[k]=_mm256_set1_epi32(q->tap[k]);
+
+    for(; x+16<=n; x+=16)
+    {
+        __m256i lo=_mm256_setzero_si256(), hi=_mm256_setzero_si256(), v;
+
+        for(k=0; k<9; k++)
+        {
+            v=_mm256_loadu_si256((const __m256i *)(src[k]+x));
+            lo=_mm256_add_epi32(lo, _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)), tap[k]));
+            hi=_mm256_add_epi32(hi, _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)), tap[k]));
+        }
+        lo=_mm256_sra_epi32(lo, shift);
+        hi=_mm256_sra_epi32(hi, shift);
+
+        // packus clamps at 0 but interleaves 64-bit halves per lane, permute restores order
+        v=_mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+        _mm256_storeu_si256((__m256i *)(out+x), _mm256_min_epu16(v, vmax));
+    }
+
+    for(; x<n; x++)
+        out[x]=psf3x3_pixel16(above+x, row+x, below+x, q->tap, q->shift, maxval);
+}
+
+#elif defined(__SSE4_1__)
+
+// 8 pixels per iteration, two sets of 4 32-bit lanes
+void psf3x3_row16(const unsigned short *above, const unsigned short *row,
+                  const unsigned short *below, unsigned short *out, int n,
+                  const psf3x3_q_t *q, unsigned maxval)
+{
+    const unsigned short *src[9]={above-1, above, above+1, row-1, row, row+1, below-1, below, below+1};
+    __m128i tap[9];
+    __m128i vmax=_mm_set1_epi16((short)maxval);
+    __m128i shift=_mm_cvtsi32_si128(q->shift);
+    int x=0, k;
+
+    for(k=0; k<9; k++)
+        tap[k]=_mm_set1_epi32(q->tap[k]);
+
+    for(; x+8<=n; x+=8)
+    {
+        __m128i lo=_mm_setzero_si128(), hi=_mm_setzero_si128(), v;
+
+        for(k=0; k<9; k++)
+        {
+            v=_mm_loadu_si128((const __m128i *)(src[k]+x));
+            lo=_mm_add_epi32(lo, _mm_mullo_epi32(_mm_cvtepu16_epi32(v), tap[k]));
+            hi=_mm_add_epi32(hi, _mm_mullo_epi32(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8)), tap[k]));
+        }
+        lo=_mm_sra_epi32(lo, shift);
+        hi=_mm_sra_epi32(hi, shift);
+
+        _mm_storeu_si128((__m128i *)(out+x), _mm_min_epu16(_mm_packus_epi32(lo, hi), vmax));
+    }
+
+    for(; x<n; x++)
+        out[x]=psf3x3_pixel16(above+x, row+x, below+x, q->tap, q->shift, maxval);
+}
+
+#else
+
+void psf3x3_row16(const unsigned short *above, const unsigned short *row,
+                  const unsigned short *below, unsigned short *out, int n,
+                  const psf3x3_q_t *q, unsigned maxval)
+{
+    int x;
+
+    for(x=0; x<n; x++)
+        out[x]=psf3x3_pixel16(above+x, row+x, below+x, q->tap, q->shift, maxval);
+}
+
+#endif
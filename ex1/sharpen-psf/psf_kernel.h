@@ -0,0 +1,54 @@
+#ifndef PSF_KERNEL_H
+#define PSF_KERNEL_H
+
+// Fixed-point 3x3 PSF convolution
+//
+// The double precision PSF is quantized once to 16-bit taps scaled by 2^shift.
+// The shift is the largest one for which no partial sum of taps * 255 can
+// leave the int16 range, so every pixel can be computed in 16-bit lanes
+// without saturation.  When every tap is exactly representable at that shift
+// (true for the sharpen PSF with K a multiple of 0.5) the output is
+// bit-identical to the double precision loop: clamp to [0,255] then truncate.
+// Otherwise each tap carries a rounding error of up to 2^-(shift+1), which is
+// no small bound: with one large tap the shift is low and small taps can
+// round to 0 (the -K/80 PSF quantizes to {0,0,0,0,112,0,0,0,0} at shift 3 and
+// loses its sharpening entirely).  The 8-bit callers run such a PSF through
+// conv_kernel instead; psf3x3_error_bound() gives the real worst case.
+
+typedef struct
+{
+    short tap[9];
+    int shift;
+    int exact;
+} psf3x3_q_t;
+
+// Quantize psf[9] (row-major) into q.  Returns 0 when the fixed-point kernel is
+// exact, 1 when it is not, and -1 when the PSF does not fit the lanes even at
+// shift 0 (taps too large); q is then unusable.
+int psf3x3_quantize(const double psf[9], psf3x3_q_t *q);
+
+// Same for 16-bit samples up to maxval, computed in 32-bit lanes.  The taps
+// keep 16 bits but the shift is chosen against maxval and the int32 range.
+int psf3x3_quantize16(const double psf[9], unsigned maxval, psf3x3_q_t *q);
+
+// Worst-case output difference in levels between q and the double precision
+// psf for samples up to maxval: 0 when exact, else floor(maxval * sum of the
+// taps' quantization errors) + 1 for the differing truncation.
+unsigned psf3x3_error_bound(const double psf[9], const psf3x3_q_t *q, unsigned maxval);
+
+// Convolve one output row of n pixels.  above, row and below point at the
+// first output column in the previous, current and next input rows; column
+// -1 and column n must be readable in all three.
+void psf3x3_row(const unsigned char *above, const unsigned char *row,
+                const unsigned char *below, unsigned char *out, int n,
+                const psf3x3_q_t *q);
+
+// 16-bit row, output clamped to [0,maxval].  q from psf3x3_quantize16().
+void psf3x3_row16(const unsigned short *above, const unsigned short *row,
+                  const unsigned short *below, unsigned short *out, int n,
+                  const psf3x3_q_t *q, unsigned maxval);
+
+// Name of the instruction set psf3x3_row() was compiled for.
+const char *psf3x3_isa(void);
+
+#endif
@@ -1,8 +1,19 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <glob.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "psf_kernel.h"
+#include "ppm_io.h"
+#include "conv_kernel.h"
+#include "frame_queue.h"
+#include "fft_conv.h"
 
 
 typedef double FLOAT;
@@ -11,11 +22,11 @@ typedef unsigned int UINT32;
 typedef unsigned long long int UINT64;
 typedef unsigned char UINT8;
 
-#define MAX_DIM 3000		//Maximum pixels in either dimension supported
+#define MAX_DIM 3000		//Larger images are sharpened with sharpen_stream()
+#define BATCH_FRAMES 6		//Frames in flight between the batch pipeline stages
 
 // PPM Edge Enhancement Code
 //
-UINT8 header[22];	//Now used only for the dimensions and depth
 UINT8 *R;
 UINT8 *G;
 UINT8 *B;
@@ -26,172 +37,620 @@ UINT8 *convB;
 #define K 4.0
 
 FLOAT PSF[9] = {-K/8.0, -K/8.0, -K/8.0, -K/8.0, K+1.0, -K/8.0, -K/8.0, -K/8.0, -K/8.0};
+psf3x3_q_t psfq;	//PSF quantized for the fixed-point kernel
+
+// -k/-n/-f select a different PSF, run by the size-specialized conv_kernel
+// engine or, past the measured crossover, by FFT overlap-add
+double *psfN;
+conv_kernel_t kern;
+fft_conv_t fft;
+int use_conv=0, use_fft=0;
+
+
+// Convolve the interior of three planes (or r alone for grayscale, g and b
+// NULL) with the selected PSF.  The border of the output planes is left as
+// the caller set it.  Returns 0, or -1 if the conv_kernel path failed.
+int sharpen_planes(unsigned w, unsigned h, const UINT8 *r, const UINT8 *g, const UINT8 *b,
+                    UINT8 *cr, UINT8 *cg, UINT8 *cb)
+{
+    int i, m;
+
+    if(use_fft)
+    {
+        // R and G share one complex pass, B rides alone
+        if(fft_conv_planes(&fft, r, g, cr, cg, w, h) < 0)
+            return -1;
+        if(b && fft_conv_planes(&fft, b, NULL, cb, NULL, w, h) < 0)
+            return -1;
+        return 0;
+    }
+
+    if(use_conv)
+    {
+        m=kern.size/2;
+        if(conv_tile(&kern, r, cr, w, m, m, h-2*m, w-2*m) < 0)
+            return -1;
+        if(!g)
+            return 0;
+        if(conv_tile(&kern, g, cg, w, m, m, h-2*m, w-2*m) < 0 ||
+           conv_tile(&kern, b, cb, w, m, m, h-2*m, w-2*m) < 0)
+            return -1;
+        return 0;
+    }
+
+    // Skip first and last row and column, no neighbors to convolve with
+    for(i=1; i<((h)-1); i++)
+    {
+        psf3x3_row(&r[((i-1)*w)+1], &r[(i*w)+1], &r[((i+1)*w)+1], &cr[(i*w)+1], w-2, &psfq);
+        if(!g)
+            continue;
+        psf3x3_row(&g[((i-1)*w)+1], &g[(i*w)+1], &g[((i+1)*w)+1], &cg[(i*w)+1], w-2, &psfq);
+        psf3x3_row(&b[((i-1)*w)+1], &b[(i*w)+1], &b[((i+1)*w)+1], &cb[(i*w)+1], w-2, &psfq);
+    }
+
+    return 0;
+}
+
+
+// Read a measured PSF: its size followed by size*size row-major values,
+// whitespace separated.  Returns a malloc'd array or NULL.
+double *load_psf(const char *path, int *size)
+{
+    FILE *fp;
+    double *psf=NULL;
+    int idx, n;
+
+    if((fp = fopen(path, "r")) == NULL)
+    {
+        printf("Error opening PSF %s\n", path);
+        return NULL;
+    }
+
+    if(fscanf(fp, "%d", &n) != 1 || n < 1 || n > FFT_MAX_SIZE || (n & 1) == 0)
+    {
+        printf("PSF %s: size must be odd and at most %d\n", path, FFT_MAX_SIZE);
+        fclose(fp);
+        return NULL;
+    }
+
+    psf=malloc(sizeof(double)*n*n);
+    for(idx=0; psf && idx<n*n; idx++)
+    {
+        if(fscanf(fp, "%lf", &psf[idx]) != 1)
+        {
+            printf("PSF %s: expected %d values, found %d\n", path, n*n, idx);
+            free(psf);
+            psf=NULL;
+        }
+    }
+
+    fclose(fp);
+    *size=n;
+    return psf;
+}
+
+
+// Streaming sharpen: only a three-row ring per channel is resident, so peak
+// memory is O(width) and the input and output are each a single sequential
+// pass.  Used for -s and for any image larger than MAX_DIM.
+int sharpen_stream(ppm_image_t *in, const char *outname)
+{
+    unsigned w=in->w, h=in->h, i;
+    int fdout, rc=-1;
+    size_t rowbytes=(size_t)w*3;
+    UINT8 *ring, *out[3];
+    UINT8 *rgb;
+    char hdr[PPM_MAX_HEADER];
+    int len;
+
+    // ring[c][slot] plane rows, one interleaved row and three output rows
+    ring=malloc(rowbytes*3 + rowbytes + rowbytes);
+    if(!ring)
+    {
+        printf("Error allocating row buffers for width %u\n", w);
+        return -1;
+    }
+    rgb=ring+rowbytes*3;
+    out[0]=rgb+rowbytes; out[1]=out[0]+w; out[2]=out[1]+w;
+#define RING(c, r) (ring + ((size_t)(c)*3 + ((r)%3))*w)
+
+    if((fdout = open(outname, (O_WRONLY | O_CREAT | O_TRUNC), 0666)) < 0)
+    {
+        printf("Error opening %s\n", outname);
+        free(ring);
+        return -1;
+    }
+    posix_fadvise(fdout, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    len=ppm_format_header(hdr, sizeof(hdr), 3, "brightened image using PSF", w, h, 255);
+    if(len < 0 || ppm_write_full(fdout, hdr, len) < 0)
+        goto done;
+
+    // First row has no neighbour above and passes through unchanged
+    if(ppm_read_full(in->fd, rgb, rowbytes) < 0 || ppm_write_full(fdout, rgb, rowbytes) < 0)
+        goto done;
+    ppm_deinterleave_rgb(rgb, RING(0, 0), RING(1, 0), RING(2, 0), w);
+
+    if(ppm_read_full(in->fd, rgb, rowbytes) < 0)
+        goto done;
+    ppm_deinterleave_rgb(rgb, RING(0, 1), RING(1, 1), RING(2, 1), w);
+
+    for(i=1; i<h-1; i++)
+    {
+        int c;
+
+        if(ppm_read_full(in->fd, rgb, rowbytes) < 0)
+            goto done;
+        ppm_deinterleave_rgb(rgb, RING(0, i+1), RING(1, i+1), RING(2, i+1), w);
+
+        for(c=0; c<3; c++)
+        {
+            // First and last column pass through unchanged
+            out[c][0]=RING(c, i)[0];
+            out[c][w-1]=RING(c, i)[w-1];
+            psf3x3_row(RING(c, i-1)+1, RING(c, i)+1, RING(c, i+1)+1, out[c]+1, w-2, &psfq);
+        }
+
+        ppm_interleave_rgb(out[0], out[1], out[2], rgb, w);
+        if(ppm_write_full(fdout, rgb, rowbytes) < 0)
+            goto done;
+    }
+
+    // Last row passes through unchanged
+    ppm_interleave_rgb(RING(0, h-1), RING(1, h-1), RING(2, h-1), rgb, w);
+    if(ppm_write_full(fdout, rgb, rowbytes) < 0)
+        goto done;
+#undef RING
+
+    rc=0;
+
+done:
+    if(rc < 0)
+        printf("Error streaming %s, input truncated or output write failed\n", outname);
+    close(fdout);
+    free(ring);
+    return rc;
+}
+
+
+// High bit depth sharpen for 16-bit P6 and P5 (maxval 256..65535).  Samples
+// are byte-swapped to host order while splitting planes and convolved in
+// 32-bit lanes, so no dynamic range is lost to a downconversion.
+int sharpen_deep(const char *inname, const char *outname)
+{
+    ppm_image_t in;
+    psf3x3_q_t q16;
+    unsigned short *plane[3], *conv[3];
+    unsigned w, h, i;
+    size_t npix;
+    int c, nch, rc=-1;
+
+    if(ppm_open(inname, &in) < 0)
+        return -1;
+
+    w=in.w; h=in.h; nch=in.channels;
+    npix=(size_t)w*h;
+
+    if((c = psf3x3_quantize16(PSF, in.maxval, &q16)) < 0)
+    {
+        printf("PSF does not fit the fixed-point kernel for %u-level input\n", in.maxval);
+        ppm_close(&in);
+        return -1;
+    }
+    if(c > 0)
+        printf("PSF not exact in Q%d fixed point, output may differ by up to %u of %u\n",
+               q16.shift, psf3x3_error_bound(PSF, &q16, in.maxval), in.maxval);
+
+    for(c=0; c<3; c++)
+    {
+        plane[c]=(c < nch) ? malloc(npix*sizeof(unsigned short)) : NULL;
+        conv[c]=(c < nch) ? malloc(npix*sizeof(unsigned short)) : NULL;
+        if(c < nch && (!plane[c] || !conv[c]))
+        {
+            printf("Error allocating 16-bit planes for %u x %u\n", w, h);
+            goto done;
+        }
+    }
+
+    if(nch == 3)
+        ppm_deinterleave_rgb16(in.pixels, plane[0], plane[1], plane[2], npix);
+    else
+        ppm_swap16(in.pixels, plane[0], npix);
+
+    for(c=0; c<nch; c++)
+    {
+        // Border pixels pass through unchanged
+        memcpy(conv[c], plane[c], npix*sizeof(unsigned short));
+        for(i=1; i<h-1; i++)
+            psf3x3_row16(&plane[c][((i-1)*w)+1], &plane[c][(i*w)+1], &plane[c][((i+1)*w)+1],
+                         &conv[c][(i*w)+1], w-2, &q16, in.maxval);
+    }
+
+    rc=ppm_write16(outname, "brightened image using PSF", nch, w, h, in.maxval, conv);
+    if(rc < 0)
+        printf("Error writing %s\n", outname);
+
+done:
+    ppm_close(&in);
+    for(c=0; c<3; c++)
+    {
+        free(plane[c]);
+        free(conv[c]);
+    }
+    return rc;
+}
+
+
+// Batch pipeline: a reader, a convolver and a writer thread connected by
+// bounded queues, so frame N+1 is read while frame N is convolved and frame
+// N-1 is written.  Frame buffers circulate through a free list and are only
+// reallocated when a larger frame arrives.
+typedef struct
+{
+    char in[PATH_MAX];
+    char out[PATH_MAX];
+    unsigned w, h;
+    size_t cap;
+    UINT8 *planes;		//R, G, B, convR, convG, convB, each cap bytes
+    int ok;
+} batchFrameType;
+
+typedef struct
+{
+    char **names;
+    size_t count;
+    const char *outdir;
+    frame_queue_t free_q, conv_q, write_q;
+    unsigned done, failed;
+} batchType;
+
+#define PLANE(f, n) ((f)->planes + (size_t)(n)*(f)->cap)
+
+
+void *batch_reader(void *arg)
+{
+    batchType *bt=(batchType *)arg;
+    batchFrameType *f;
+    ppm_image_t in;
+    const char *base;
+    size_t idx, npix;
+
+    for(idx=0; idx<bt->count; idx++)
+    {
+        f=frame_queue_pop(&bt->free_q);
+        f->ok=0;
+        snprintf(f->in, sizeof(f->in), "%s", bt->names[idx]);
+        base=strrchr(f->in, '/');
+        snprintf(f->out, sizeof(f->out), "%s/%s", bt->outdir, base ? base+1 : f->in);
+
+        if(ppm_open(f->in, &in) == 0)
+        {
+            npix=(size_t)in.w*in.h;
+            if(in.channels != 3 || in.maxval > 255 || in.w < (unsigned)kern.size || in.h < (unsigned)kern.size)
+                printf("skipping %s: need an 8-bit PPM of at least %d x %d\n", f->in, kern.size, kern.size);
+            else if(npix > f->cap && !(f->planes = realloc(f->planes, 6*npix)))
+            {
+                printf("Error allocating planes for %s\n", f->in);
+                f->cap=0;
+            }
+            else
+            {
+                if(npix > f->cap) f->cap=npix;
+                f->w=in.w;
+                f->h=in.h;
+                ppm_deinterleave_rgb(in.pixels, PLANE(f, 0), PLANE(f, 1), PLANE(f, 2), npix);
+                f->ok=1;
+            }
+            ppm_close(&in);
+        }
+
+        frame_queue_push(&bt->conv_q, f);
+    }
+
+    frame_queue_push(&bt->conv_q, NULL);
+    return (void *)0;
+}
+
+
+void *batch_convolver(void *arg)
+{
+    batchType *bt=(batchType *)arg;
+    batchFrameType *f;
+    size_t npix;
+
+    while((f = frame_queue_pop(&bt->conv_q)) != NULL)
+    {
+        if(f->ok)
+        {
+            // Border pixels pass through unchanged
+            npix=(size_t)f->w*f->h;
+            memcpy(PLANE(f, 3), PLANE(f, 0), npix);
+            memcpy(PLANE(f, 4), PLANE(f, 1), npix);
+            memcpy(PLANE(f, 5), PLANE(f, 2), npix);
+            if(sharpen_planes(f->w, f->h, PLANE(f, 0), PLANE(f, 1), PLANE(f, 2),
+                              PLANE(f, 3), PLANE(f, 4), PLANE(f, 5)) < 0)
+                f->ok=0;
+        }
+        frame_queue_push(&bt->write_q, f);
+    }
+
+    frame_queue_push(&bt->write_q, NULL);
+    return (void *)0;
+}
+
+
+void *batch_writer(void *arg)
+{
+    batchType *bt=(batchType *)arg;
+    batchFrameType *f;
+
+    while((f = frame_queue_pop(&bt->write_q)) != NULL)
+    {
+        if(f->ok && ppm_write_rgb(f->out, "brightened image using PSF", f->w, f->h,
+                                  PLANE(f, 3), PLANE(f, 4), PLANE(f, 5)) == 0)
+            bt->done++;
+        else
+            bt->failed++;
+
+        frame_queue_push(&bt->free_q, f);
+    }
+
+    return (void *)0;
+}
+
+
+int name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+// Expand a directory (every *.ppm in it) or a glob pattern, sorted by name.
+int batch_inputs(const char *src, glob_t *g)
+{
+    char pattern[PATH_MAX];
+    struct stat st;
+
+    if(stat(src, &st) == 0 && S_ISDIR(st.st_mode))
+        snprintf(pattern, sizeof(pattern), "%s/*.ppm", src);
+    else
+        snprintf(pattern, sizeof(pattern), "%s", src);
+
+    if(glob(pattern, 0, NULL, g) != 0 || g->gl_pathc == 0)
+    {
+        printf("no input frames match %s\n", pattern);
+        return -1;
+    }
+
+    qsort(g->gl_pathv, g->gl_pathc, sizeof(char *), name_cmp);
+    return 0;
+}
+
+
+int sharpen_batch(const char *src, const char *outdir)
+{
+    batchType bt;
+    batchFrameType *frames;
+    pthread_t reader, convolver, writer;
+    glob_t g;
+    int idx;
+
+    if(batch_inputs(src, &g) < 0)
+        return -1;
+
+    memset(&bt, 0, sizeof(bt));
+    bt.names=g.gl_pathv;
+    bt.count=g.gl_pathc;
+    bt.outdir=outdir;
+
+    frames=calloc(BATCH_FRAMES, sizeof(batchFrameType));
+    if(!frames || frame_queue_init(&bt.free_q, BATCH_FRAMES) < 0 ||
+       frame_queue_init(&bt.conv_q, BATCH_FRAMES+1) < 0 || frame_queue_init(&bt.write_q, BATCH_FRAMES+1) < 0)
+    {
+        printf("Error allocating batch pipeline\n");
+        return -1;
+    }
+    for(idx=0; idx<BATCH_FRAMES; idx++)
+        frame_queue_push(&bt.free_q, &frames[idx]);
+
+    pthread_create(&reader, (void *)0, batch_reader, (void *)&bt);
+    pthread_create(&convolver, (void *)0, batch_convolver, (void *)&bt);
+    pthread_create(&writer, (void *)0, batch_writer, (void *)&bt);
+
+    pthread_join(reader, (void **)0);
+    pthread_join(convolver, (void **)0);
+    pthread_join(writer, (void **)0);
+
+    printf("%u of %zu frames written to %s", bt.done, bt.count, outdir);
+    if(bt.failed)
+        printf(", %u failed", bt.failed);
+    printf("\n");
+
+    for(idx=0; idx<BATCH_FRAMES; idx++)
+        free(frames[idx].planes);
+    free(frames);
+    frame_queue_destroy(&bt.free_q);
+    frame_queue_destroy(&bt.conv_q);
+    frame_queue_destroy(&bt.write_q);
+    globfree(&g);
+
+    return bt.failed ? -1 : 0;
+}
 
 
 int main(int argc, char *argv[])
 {
-    int fdin, fdout, i, j, rc;
+    int i, opt, stream=0, batch=0, fixed, rc=-1;
+    int size=3, blur=0;
+    const char *psf_file=NULL;
+    unsigned w, h;
+    ppm_image_t in;
     UINT64 microsecs=0, millisecs=0;
-    FLOAT temp;
     
-    if(argc < 3)
+    while((opt = getopt(argc, argv, "sbk:n:f:")) != -1)
+    {
+        switch(opt)
+        {
+            case 's': stream=1; break;
+            case 'b': batch=1; break;
+            case 'k': blur=(optarg[0] == 'b'); break;
+            case 'n': size=atoi(optarg); break;
+            case 'f': psf_file=optarg; break;
+            default: argc=0;
+        }
+    }
+
+    if(argc-optind < 2)
     {
-       printf("Usage: sharpen input_file.ppm output_file.ppm\n");
+       printf("Usage: sharpen [-s] [-k sharpen|blur] [-n size] [-f psf.txt] input_file.ppm|pgm output_file\n");
+       printf("       sharpen -b [-k sharpen|blur] [-n size] [-f psf.txt] input_dir|'pattern*.ppm' output_dir\n");
+       printf("       -b  pipelined batch over a frame sequence\n");
+       printf("       -s  stream rows with O(width) memory (automatic above %i pixels)\n", MAX_DIM);
+       printf("       -k  PSF type, -n  PSF size (odd, default 3)\n");
+       printf("       -f  measured PSF file: size, then size*size values\n");
        exit(-1);
     }
-    else
+
+    fixed=(size == 3 && !blur && !psf_file);
+    if(fixed && (i = psf3x3_quantize(PSF, &psfq)) != 0)
+    {
+        // Rounded taps have no useful error bound (see psf_kernel.h), so run it in float
+        if(i < 0)
+            printf("PSF does not fit 16-bit fixed point, using the float kernel\n");
+        else
+            printf("PSF not exact in Q%d fixed point (error up to %u levels), using the float kernel\n",
+                   psfq.shift, psf3x3_error_bound(PSF, &psfq, 255));
+        fixed=0;
+    }
+
+    if(!fixed)
     {
-        if((fdin = open(argv[1], O_RDONLY, 0644)) < 0)
+        if(psf_file)
+        {
+            if((psfN = load_psf(psf_file, &size)) == NULL)
+                return -1;
+        }
+        else
         {
-            printf("Error opening %s\n", argv[1]);
+            if(size < 1 || size > FFT_MAX_SIZE || (size & 1) == 0)
+            {
+                printf("PSF size %d not supported (odd, at most %d)\n", size, FFT_MAX_SIZE);
+                return -1;
+            }
+            psfN=malloc(sizeof(double)*size*size);
+            if(blur)
+                conv_psf_blur(psfN, size);
+            else if(size == 3)
+                memcpy(psfN, PSF, sizeof(PSF));
+            else
+                conv_psf_sharpen(psfN, size, K);
         }
-        //else
-        //    printf("File opened successfully\n");
 
-        if((fdout = open(argv[2], (O_RDWR | O_CREAT), 0666)) < 0)
+        // Direct cost grows with k^2, FFT with log n: time both on this PSF
+        if(size > 3 && fft_conv_prefer(psfN, size))
         {
-            printf("Error opening %s\n", argv[1]);
+            if(fft_conv_init(&fft, psfN, size) < 0)
+                return -1;
+            use_fft=1;
         }
-        //else
-        //    printf("Output file=%s opened successfully\n", "sharpen.ppm");
+        else if(conv_kernel_init(&kern, psfN, size) < 0)
+            return -1;
+        use_conv=1;
+
+        printf("%dx%d %s PSF, %s\n", size, size, psf_file ? psf_file : (blur ? "blur" : "sharpen"),
+               use_fft ? "FFT overlap-add" : (kern.separable ? "separable" : "direct"));
     }
+    kern.size=size;	//Border width for the size checks
 
+    if(batch)
+        return sharpen_batch(argv[optind], argv[optind+1]);
 
-    //printf("Reading header\n");
+    //Only the header is needed to choose between streaming and in-memory
+    if(ppm_stream_open(argv[optind], &in) < 0)
+        return -1;
 
-	//Find the second \n character which will indicate the start of the width value
-	int num_n = 0;
-	while(num_n < 2){
-		if(read(fdin, (void *)header, 1) < 1){
-			printf("Error reading header data\n");
-			return -1;
-		}
-		
-		if(header[0] == '\n')
-			num_n++;
-	}
+    w = in.w;
+    h = in.h;
 	
-	//At this point we can read the width followed by the height (we'll read until the 2nd '\n')
-	num_n = 0;
-	i = 0;
-	while(num_n < 2){
-		if(i == sizeof(header)){
-			printf("incorrect format of ppm file dimensions");
-			return -1;
-		}
-		
-		if(read(fdin, (void *)&header[i], 1) < 1){
-			printf("Error reading header data\n");
+	if(in.maxval > 255 && in.maxval <= 65535 && w >= 3 && h >= 3){
+		ppm_close(&in);
+		if(use_conv || stream){
+			printf("16-bit input supports only the in-memory 3x3 sharpen PSF\n");
 			return -1;
 		}
-		
-		if(header[i++] == '\n')
-			num_n++;
+		return sharpen_deep(argv[optind], argv[optind+1]);
 	}
-	
-	//Here we have the width/height values separated by \n and ending in a \n. We'll change the ending \n to a \0.
-	header[i-1] = '\0';
-	
-	//Then parse out the width and height, perform a sanity check, then allocate buffers we'll use later.
-	unsigned w, h, d;
-	if(sscanf(header, "%u %u\n%u", &w, &h, &d) != 3){
-		printf("incorrect dimension format in the file header\n");
+
+	if(w < size || h < size || in.maxval > 255){
+		printf("unsupported image: %u x %u, depth %u (need 8-bit PPM/PGM or 16-bit PPM/PGM, at least %d x %d)\n", w, h, in.maxval, size, size);
+		ppm_close(&in);
 		return -1;
 	}
-	
-	if(w > MAX_DIM || h > MAX_DIM || d > 255){
-		printf("dimensions too large: %u x %u (must be less than %i x %i), or depth > 1 byte\n", w,h, MAX_DIM, MAX_DIM);
-		return -1;
+
+	if(stream || w > MAX_DIM || h > MAX_DIM){
+		if(use_conv || in.channels != 3){
+			printf("streaming supports only the 3x3 sharpen PSF on 8-bit PPM\n");
+			ppm_close(&in);
+			return -1;
+		}
+		i = sharpen_stream(&in, argv[optind+1]);
+		ppm_close(&in);
+		return i;
 	}
+	ppm_close(&in);
+
+    //Map the input file, the header is parsed in place (comments allowed)
+    if(ppm_open(argv[optind], &in) < 0)
+        return -1;
 	
 	//Allocate the buffers we'll use
 	R = malloc(w * h);
-	G = malloc(w * h);
-	B = malloc(w * h);
 	convR = malloc(w * h);
-	convG = malloc(w * h);
-	convB = malloc(w * h);
-
-
-    //printf("header = %s\n", header); 
+	if(in.channels == 3){
+		G = malloc(w * h);
+		B = malloc(w * h);
+		convG = malloc(w * h);
+		convB = malloc(w * h);
+	}
 
-    // Read RGB data
-    for(i=0; i<h*w; i++)
+    if(!R || !convR || (in.channels == 3 && (!G || !B || !convG || !convB)))
+        printf("Error allocating %u x %u image planes\n", w, h);
+    // The whole interior is one conv_kernel tile, conv_scratch reports a failure
+    else if(!use_conv || use_fft || conv_scratch_reserve(&kern, w-2*(size/2)) == 0)
     {
-        rc=read(fdin, (void *)&R[i], 1); convR[i]=R[i];
-        rc=read(fdin, (void *)&G[i], 1); convG[i]=G[i];
-        rc=read(fdin, (void *)&B[i], 1); convB[i]=B[i];
-    }
-
-    // Skip first and last row, no neighbors to convolve with
-    for(i=1; i<((h)-1); i++)
-    {
-
-        // Skip first and last column, no neighbors to convolve with
-        for(j=1; j<((w)-1); j++)
+        // Split RGB data into planes, the border pixels pass through unchanged
+        if(in.channels == 3)
         {
-            temp=0;
-            temp += (PSF[0] * (FLOAT)R[((i-1)*w)+j-1]);
-            temp += (PSF[1] * (FLOAT)R[((i-1)*w)+j]);
-            temp += (PSF[2] * (FLOAT)R[((i-1)*w)+j+1]);
-            temp += (PSF[3] * (FLOAT)R[((i)*w)+j-1]);
-            temp += (PSF[4] * (FLOAT)R[((i)*w)+j]);
-            temp += (PSF[5] * (FLOAT)R[((i)*w)+j+1]);
-            temp += (PSF[6] * (FLOAT)R[((i+1)*w)+j-1]);
-            temp += (PSF[7] * (FLOAT)R[((i+1)*w)+j]);
-            temp += (PSF[8] * (FLOAT)R[((i+1)*w)+j+1]);
-	    if(temp<0.0) temp=0.0;
-	    if(temp>255.0) temp=255.0;
-	    convR[(i*w)+j]=(UINT8)temp;
-
-            temp=0;
-            temp += (PSF[0] * (FLOAT)G[((i-1)*w)+j-1]);
-            temp += (PSF[1] * (FLOAT)G[((i-1)*w)+j]);
-            temp += (PSF[2] * (FLOAT)G[((i-1)*w)+j+1]);
-            temp += (PSF[3] * (FLOAT)G[((i)*w)+j-1]);
-            temp += (PSF[4] * (FLOAT)G[((i)*w)+j]);
-            temp += (PSF[5] * (FLOAT)G[((i)*w)+j+1]);
-            temp += (PSF[6] * (FLOAT)G[((i+1)*w)+j-1]);
-            temp += (PSF[7] * (FLOAT)G[((i+1)*w)+j]);
-            temp += (PSF[8] * (FLOAT)G[((i+1)*w)+j+1]);
-	    if(temp<0.0) temp=0.0;
-	    if(temp>255.0) temp=255.0;
-	    convG[(i*w)+j]=(UINT8)temp;
-
-            temp=0;
-            temp += (PSF[0] * (FLOAT)B[((i-1)*w)+j-1]);
-            temp += (PSF[1] * (FLOAT)B[((i-1)*w)+j]);
-            temp += (PSF[2] * (FLOAT)B[((i-1)*w)+j+1]);
-            temp += (PSF[3] * (FLOAT)B[((i)*w)+j-1]);
-            temp += (PSF[4] * (FLOAT)B[((i)*w)+j]);
-            temp += (PSF[5] * (FLOAT)B[((i)*w)+j+1]);
-            temp += (PSF[6] * (FLOAT)B[((i+1)*w)+j-1]);
-            temp += (PSF[7] * (FLOAT)B[((i+1)*w)+j]);
-            temp += (PSF[8] * (FLOAT)B[((i+1)*w)+j+1]);
-	    if(temp<0.0) temp=0.0;
-	    if(temp>255.0) temp=255.0;
-	    convB[(i*w)+j]=(UINT8)temp;
+            ppm_deinterleave_rgb(in.pixels, R, G, B, (size_t)w * h);
+            memcpy(convG, G, w * h);
+            memcpy(convB, B, w * h);
         }
-    }
+        else
+            memcpy(R, in.pixels, (size_t)w * h);
+        memcpy(convR, R, w * h);
 
-	UINT8 hdr[64];
-	int len = snprintf(hdr, sizeof(hdr), "P6\n# brightened image using PSF\n%u %u\n255\n", w, h); 
-    rc=write(fdout, (void *)hdr, len);
-
-    // Write RGB data
-    for(i=0; i<h*w; i++)
-    {
-        rc=write(fdout, (void *)&convR[i], 1);
-        rc=write(fdout, (void *)&convG[i], 1);
-        rc=write(fdout, (void *)&convB[i], 1);
+        if(sharpen_planes(w, h, R, G, B, convR, convG, convB) < 0)
+            printf("Convolution failed, not writing %s\n", argv[optind+1]);
+        else
+        {
+            if(in.channels == 3)
+                i = ppm_write_rgb(argv[optind+1], "brightened image using PSF", w, h, convR, convG, convB);
+            else
+                i = ppm_write_gray(argv[optind+1], "brightened image using PSF", w, h, convR);
+            if(i < 0)
+                printf("Error writing %s\n", argv[optind+1]);
+            else
+                rc = 0;
+        }
     }
-
-
-    close(fdin);
-    close(fdout);
+    ppm_close(&in);
 	
 	//Free the memory we allocated for the image data.
 	free(R); free(G); free(B);
 	free(convR); free(convG); free(convB);
- 
+	free(psfN);
+	if(use_fft)
+		fft_conv_free(&fft);
+
+    return rc;
 }
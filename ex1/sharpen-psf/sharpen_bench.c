@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tile_pool.h"
+#include "sharpen_tiles.h"
+#include "bench_stats.h"
+
+
+// Sharpen benchmark driver
+//
+// Sweeps image size x kernel x thread count x tile shape over synthetic
+// images, times every frame through the tile pool and appends one CSV row
+// per configuration with min, median and p99 frame time and the median
+// throughput.  One untimed warm-up frame precedes each configuration.
+
+#define RUNS (20)
+#define MAX_LIST (32)
+
+#define K 4.0
+
+double PSF[9] = {-K/8.0, -K/8.0, -K/8.0, -K/8.0, K+1.0, -K/8.0, -K/8.0, -K/8.0, -K/8.0};
+
+typedef struct
+{
+    int a, b;
+} pairType;
+
+
+void usage(void)
+{
+    printf("Usage: sharpen_bench [-o results.csv] [-r runs] [-t threads,...] [-T rowsxcols,...]\n");
+    printf("                     [-s widthxheight,...] [-k psf3|sharpenN|blurN,...]\n");
+    printf("defaults: -r %d -t 1,2,4,<cores> -T 32x256,64x512,128x1024\n", RUNS);
+    printf("          -s 400x300,1920x1080,4000x3000 -k psf3,sharpen5,blur5,sharpen7,blur7\n");
+    exit(-1);
+}
+
+
+// Parse "a,b,c" into ints
+int parse_ints(char *arg, int *out)
+{
+    int n=0;
+    char *tok, *save;
+
+    for(tok=strtok_r(arg, ",", &save); tok && n<MAX_LIST; tok=strtok_r(NULL, ",", &save))
+        if((out[n] = atoi(tok)) > 0)
+            n++;
+    return n;
+}
+
+
+// Parse "AxB,CxD" into pairs
+int parse_pairs(char *arg, pairType *out)
+{
+    int n=0;
+    char *tok, *save;
+
+    for(tok=strtok_r(arg, ",", &save); tok && n<MAX_LIST; tok=strtok_r(NULL, ",", &save))
+        if(sscanf(tok, "%dx%d", &out[n].a, &out[n].b) == 2 && out[n].a > 0 && out[n].b > 0)
+            n++;
+    return n;
+}
+
+
+// Parse "psf3,sharpen5,blur7" into (blur, size) pairs
+int parse_kernels(char *arg, pairType *out)
+{
+    int n=0;
+    char *tok, *save;
+
+    for(tok=strtok_r(arg, ",", &save); tok && n<MAX_LIST; tok=strtok_r(NULL, ",", &save))
+    {
+        if(strcmp(tok, "psf3") == 0)
+            { out[n].a=0; out[n].b=3; n++; }
+        else if(sscanf(tok, "sharpen%d", &out[n].b) == 1)
+            { out[n].a=0; n++; }
+        else if(sscanf(tok, "blur%d", &out[n].b) == 1)
+            { out[n].a=1; n++; }
+        else
+            printf("unknown kernel %s ignored\n", tok);
+    }
+    return n;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *csvname="sharpen_bench.csv";
+    int nruns=RUNS, opt;
+    int threads[MAX_LIST], nthreads_list=0;
+    pairType tiles_list[MAX_LIST], sizes[MAX_LIST], kernels[MAX_LIST];
+    int ntiles_list=0, nsizes=0, nkernels=0;
+    int si, ki, ti, hi, r, ntiles;
+    long cores=sysconf(_SC_NPROCESSORS_ONLN);
+    imagePlanesType img;
+    sharpenKernelType kern;
+    tile_pool_t pool;
+    tile_t *tiles;
+    double *samples, start;
+    bench_stats_t st;
+    char kname[64];
+    size_t npix, idx;
+    FILE *csv;
+
+    while((opt = getopt(argc, argv, "o:r:t:T:s:k:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'o': csvname=optarg; break;
+            case 'r': nruns=atoi(optarg); break;
+            case 't': nthreads_list=parse_ints(optarg, threads); break;
+            case 'T': ntiles_list=parse_pairs(optarg, tiles_list); break;
+            case 's': nsizes=parse_pairs(optarg, sizes); break;
+            case 'k': nkernels=parse_kernels(optarg, kernels); break;
+            default: usage();
+        }
+    }
+
+    if(nruns < 1)
+        usage();
+
+    if(nthreads_list == 0)
+    {
+        threads[nthreads_list++]=1;
+        if(cores >= 2) threads[nthreads_list++]=2;
+        if(cores >= 4) threads[nthreads_list++]=4;
+        if(cores > 4) threads[nthreads_list++]=(int)cores;
+    }
+    if(ntiles_list == 0)
+    {
+        tiles_list[0].a=32; tiles_list[0].b=256;
+        tiles_list[1].a=64; tiles_list[1].b=512;
+        tiles_list[2].a=128; tiles_list[2].b=1024;
+        ntiles_list=3;
+    }
+    if(nsizes == 0)
+    {
+        sizes[0].a=400; sizes[0].b=300;         // 120 kpixel
+        sizes[1].a=1920; sizes[1].b=1080;
+        sizes[2].a=4000; sizes[2].b=3000;       // 12 Mpixel
+        nsizes=3;
+    }
+    if(nkernels == 0)
+    {
+        kernels[0].a=0; kernels[0].b=3;
+        kernels[1].a=0; kernels[1].b=5;
+        kernels[2].a=1; kernels[2].b=5;
+        kernels[3].a=0; kernels[3].b=7;
+        kernels[4].a=1; kernels[4].b=7;
+        nkernels=5;
+    }
+
+    if(!(csv = fopen(csvname, "w")) || !(samples = calloc(nruns, sizeof(double))))
+    {
+        printf("Error opening %s\n", csvname);
+        exit(-1);
+    }
+    fprintf(csv, "kernel,width,height,threads,tile_h,tile_w,runs,min_ms,median_ms,p99_ms,max_ms,mpix_per_s\n");
+    printf("%-22s %11s %3s %9s %9s %9s %9s %9s\n", "kernel", "size", "thr", "tile", "min ms", "med ms", "p99 ms", "Mpix/s");
+
+    for(si=0; si<nsizes; si++)
+    {
+        if(sharpen_planes_alloc(&img, sizes[si].a, sizes[si].b) < 0)
+            continue;
+
+        // Deterministic noise, the kernels have no data-dependent branches
+        npix=(size_t)img.w*img.h;
+        srand(5763);
+        for(idx=0; idx<npix; idx++)
+        {
+            img.R[idx]=rand(); img.G[idx]=rand(); img.B[idx]=rand();
+        }
+        memcpy(img.convR, img.R, npix);
+        memcpy(img.convG, img.G, npix);
+        memcpy(img.convB, img.B, npix);
+
+        for(ki=0; ki<nkernels; ki++)
+        {
+            if(sharpen_kernel_setup(&kern, kernels[ki].a, kernels[ki].b, K, PSF) < 0)
+                continue;
+            img.kern=&kern;
+            sharpen_kernel_name(&kern, kname, sizeof(kname));
+
+            for(ti=0; ti<nthreads_list; ti++)
+            {
+                if(tile_pool_create(&pool, threads[ti], NULL, NULL, 0) < 0)
+                    exit(-1);
+                if(sharpen_pool_reserve(&pool, &img, img.w) < 0)
+                    exit(-1);
+
+                for(hi=0; hi<ntiles_list; hi++)
+                {
+                    ntiles=tile_grid(img.h, img.w, kern.size/2, tiles_list[hi].a, tiles_list[hi].b, &tiles);
+                    if(ntiles < 0)
+                        continue;
+
+                    tile_pool_run(&pool, tiles, ntiles, sharpen_tile_rgb, &img);
+
+                    for(r=0; r<nruns; r++)
+                    {
+                        start=bench_now_ns();
+                        tile_pool_run(&pool, tiles, ntiles, sharpen_tile_rgb, &img);
+                        samples[r]=(bench_now_ns()-start)/1e6;
+                    }
+                    free(tiles);
+
+                    bench_summarize(samples, nruns, &st);
+                    printf("%-22s %5ux%-5u %3d %4dx%-4d %9.3f %9.3f %9.3f %9.1f\n", kname, img.w, img.h,
+                           threads[ti], tiles_list[hi].a, tiles_list[hi].b, st.min, st.median, st.p99,
+                           (double)npix/(st.median*1e3));
+                    fprintf(csv, "%s,%u,%u,%d,%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%.2f\n", kname, img.w, img.h,
+                            threads[ti], tiles_list[hi].a, tiles_list[hi].b, nruns, st.min, st.median,
+                            st.p99, st.max, (double)npix/(st.median*1e3));
+                    fflush(csv);
+                }
+
+                tile_pool_destroy(&pool);
+            }
+        }
+
+        sharpen_planes_free(&img);
+    }
+
+    fclose(csv);
+    free(samples);
+    printf("results written to %s\n", csvname);
+    return 0;
+}
@@ -1,19 +1,21 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <sched.h>
+#include <errno.h>
 
+#include "psf_kernel.h"
+#include "ppm_io.h"
+#include "tile_pool.h"
+#include "sharpen_tiles.h"
+#include "bench_stats.h"
+#include "perf_counters.h"
+#include "tune_cache.h"
 
-// 120K Pixel resolution
-#define IMG_HEIGHT (372)
-#define IMG_WIDTH (580)
-
-// 12 Mega Pixel resolution
-//#define IMG_HEIGHT (3000)
-//#define IMG_WIDTH (4000)
 
 // Long benchmark test
 //#define RUNS (1000)
@@ -21,235 +23,424 @@
 // Short benchmark test
 #define RUNS (30)
 
-//#define NUM_ROW_THREADS (6)
-//#define NUM_COL_THREADS (8)
-
-#define NUM_ROW_THREADS (3)
-#define NUM_COL_THREADS (4)
+// Defaults for -t/-H/-W.  A 64 x 512 tile of three channels, input plus
+// output, is about 200 KB and stays resident in a typical L2.
+#define NUM_THREADS (4)
+#define TILE_H (64)
+#define TILE_W (512)
 
-#define IMG_H_SLICE (IMG_HEIGHT/NUM_ROW_THREADS)
-#define IMG_W_SLICE (IMG_WIDTH/NUM_COL_THREADS)
+// -A candidates.  Thread counts above the online CPUs are skipped and the
+// CPU count itself is always tried; a tile width of 0 is the full row.
+static const int tune_threads[]={1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64};
+static const int tune_tile_h[]={16, 32, 64, 128, 256};
+static const int tune_tile_w[]={128, 256, 512, 1024, 0};
+#define TUNE_RUNS (7)
+#define NELEM(a) ((int)(sizeof(a)/sizeof((a)[0])))
 
 
 typedef double FLOAT;
 
-pthread_t threads[NUM_ROW_THREADS*NUM_COL_THREADS];
-
-typedef struct _threadArgs
-{
-    int thread_idx;
-    int i;
-    int j;
-    int h;
-    int w;
-} threadArgsType;
-
-threadArgsType threadarg[NUM_ROW_THREADS*NUM_COL_THREADS];
+// Applied to the workers with -p, the coordinating thread runs one above
 pthread_attr_t fifo_sched_attr;
 pthread_attr_t orig_sched_attr;
 struct sched_param fifo_param;
 
+#define MAX_CPUS (256)
+
 typedef unsigned int UINT32;
 typedef unsigned long long int UINT64;
 typedef unsigned char UINT8;
 
 // PPM Edge Enhancement Code
-UINT8 header[22];
-UINT8 R[IMG_HEIGHT][IMG_WIDTH];
-UINT8 G[IMG_HEIGHT][IMG_WIDTH];
-UINT8 B[IMG_HEIGHT][IMG_WIDTH];
-UINT8 convR[IMG_HEIGHT][IMG_WIDTH];
-UINT8 convG[IMG_HEIGHT][IMG_WIDTH];
-UINT8 convB[IMG_HEIGHT][IMG_WIDTH];
-
 #define K 4.0
 
 FLOAT PSF[9] = {-K/8.0, -K/8.0, -K/8.0, -K/8.0, K+1.0, -K/8.0, -K/8.0, -K/8.0, -K/8.0};
 //FLOAT PSF[9] = {-K/80.0, -K/80.0, -K/80.0, -K/80.0, K+10.0, -K/80.0, -K/80.0, -K/80.0, -K/80.0};
 
+// Fixed-point 3x3 by default, -k/-n select an NxN PSF for conv_kernel
+sharpenKernelType kern;
+
+// -P: per-worker hardware counters.  Every worker opens its own set before the
+// first frame, so no tile runs uncounted; the main thread resets and reads
+// them around frames while the workers wait at the pool barrier.
+typedef struct
+{
+    perf_counters_t pc;
+    perf_sample_t total;
+    UINT64 frame_pix, total_pix;
+} workerPerfType;
+
+workerPerfType *worker_perf;
+int nworker_perf;
+__thread workerPerfType *my_perf;
+
 
-void *sharpen_thread(void *threadptr)
+// tile_pool_each() callback: claim this worker's slot and open its counters
+void sharpen_perf_open(const tile_t *tile, void *ctx)
 {
-    threadArgsType thargs=*((threadArgsType *)threadptr);
-    int i=thargs.i;
-    int j=thargs.j;
-    FLOAT temp=0;
+    my_perf=&worker_perf[__atomic_fetch_add(&nworker_perf, 1, __ATOMIC_RELAXED)];
+    perf_counters_open(&my_perf->pc);
+}
+
+
+void sharpen_tile_perf(const tile_t *tile, void *ctx)
+{
+    sharpen_tile_rgb(tile, ctx);
+    my_perf->frame_pix+=(UINT64)tile->h*tile->w;
+}
+
+
+void usage(void)
+{
+    printf("Usage: sharpen_grid [-t threads] [-H tile_rows] [-W tile_cols] [-r runs] [-k sharpen|blur] [-n size]\n");
+    printf("                    [-p fifo_priority] [-c cpu_list] [-P] [-A] [-C cache_file] input_file.ppm output_file.ppm\n");
+    printf("       -p  run workers SCHED_FIFO at this priority (needs CAP_SYS_NICE)\n");
+    printf("       -c  pin worker i to the i-th CPU of a list like 0,2-3 (round robin)\n");
+    printf("       -P  hardware counters per frame and per worker, normalized per pixel\n");
+    printf("       -A  benchmark thread counts and tile shapes, save the best to the cache\n");
+    printf("       -C  tuning cache (default %s), used when -t/-H/-W are not given\n", TUNE_CACHE_FILE);
+    exit(-1);
+}
 
-    //printf("i=%d, j=%d, h=%d, w=%d\n", thargs.i, thargs.j, thargs.h, thargs.w);
 
-    for(i=thargs.i; i<(thargs.i+thargs.h); i++)
+// Parse "0,2-3,6" into cpus[], returns the count or -1 on a bad list
+int parse_cpu_list(const char *arg, int *cpus, int max)
+{
+    int n=0, lo, hi, len;
+
+    while(*arg)
     {
-        for(j=thargs.j; j<(thargs.j+thargs.w); j++)
+        if(sscanf(arg, "%d%n", &lo, &len) != 1 || lo < 0)
+            return -1;
+        arg+=len;
+        hi=lo;
+        if(*arg == '-')
         {
-            temp=0;
-            temp += (PSF[0] * (FLOAT)R[(i-1)][j-1]);
-            temp += (PSF[1] * (FLOAT)R[(i-1)][j]);
-            temp += (PSF[2] * (FLOAT)R[(i-1)][j+1]);
-            temp += (PSF[3] * (FLOAT)R[(i)][j-1]);
-            temp += (PSF[4] * (FLOAT)R[(i)][j]);
-            temp += (PSF[5] * (FLOAT)R[(i)][j+1]);
-            temp += (PSF[6] * (FLOAT)R[(i+1)][j-1]);
-            temp += (PSF[7] * (FLOAT)R[(i+1)][j]);
-            temp += (PSF[8] * (FLOAT)R[(i+1)][j+1]);
-	    if(temp<0.0) temp=0.0;
-	    if(temp>255.0) temp=255.0;
-	    convR[i][j]=(UINT8)temp;
-
-            temp=0;
-            temp += (PSF[0] * (FLOAT)G[(i-1)][j-1]);
-            temp += (PSF[1] * (FLOAT)G[(i-1)][j]);
-            temp += (PSF[2] * (FLOAT)G[(i-1)][j+1]);
-            temp += (PSF[3] * (FLOAT)G[(i)][j-1]);
-            temp += (PSF[4] * (FLOAT)G[(i)][j]);
-            temp += (PSF[5] * (FLOAT)G[(i)][j+1]);
-            temp += (PSF[6] * (FLOAT)G[(i+1)][j-1]);
-            temp += (PSF[7] * (FLOAT)G[(i+1)][j]);
-            temp += (PSF[8] * (FLOAT)G[(i+1)][j+1]);
-	    if(temp<0.0) temp=0.0;
-	    if(temp>255.0) temp=255.0;
-	    convG[i][j]=(UINT8)temp;
-
-            temp=0;
-            temp += (PSF[0] * (FLOAT)B[(i-1)][j-1]);
-            temp += (PSF[1] * (FLOAT)B[(i-1)][j]);
-            temp += (PSF[2] * (FLOAT)B[(i-1)][j+1]);
-            temp += (PSF[3] * (FLOAT)B[(i)][j-1]);
-            temp += (PSF[4] * (FLOAT)B[(i)][j]);
-            temp += (PSF[5] * (FLOAT)B[(i)][j+1]);
-            temp += (PSF[6] * (FLOAT)B[(i+1)][j-1]);
-            temp += (PSF[7] * (FLOAT)B[(i+1)][j]);
-            temp += (PSF[8] * (FLOAT)B[(i+1)][j+1]);
-	    if(temp<0.0) temp=0.0;
-	    if(temp>255.0) temp=255.0;
-	    convB[i][j]=(UINT8)temp;
+            if(sscanf(arg+1, "%d%n", &hi, &len) != 1 || hi < lo)
+                return -1;
+            arg+=len+1;
         }
-
+        for(; lo<=hi && n<max; lo++)
+            cpus[n++]=lo;
+        if(*arg == ',')
+            arg++;
+        else if(*arg)
+            return -1;
     }
-
-    pthread_exit((void **)0);
+    return n;
 }
 
 
-int main(int argc, char *argv[])
+// Set up fifo_sched_attr for the workers and raise the calling thread one
+// level above them so frame release is never delayed by a worker.
+int setup_fifo(int prio)
 {
-    int fdin, fdout, bytesRead=0, bytesLeft, i, j, idx, jdx, rc;
-    UINT64 microsecs=0, millisecs=0;
-    unsigned int thread_idx;
-    FLOAT temp;
-    int runs=0;
-    
-    if(argc < 3)
+    int rc, min=sched_get_priority_min(SCHED_FIFO), max=sched_get_priority_max(SCHED_FIFO);
+
+    if(prio < min || prio > max-1)
     {
-       printf("Usage: sharpen input_file.ppm output_file.ppm\n");
-       exit(-1);
+        printf("FIFO priority must be in %d..%d\n", min, max-1);
+        return -1;
     }
-    else
+
+    pthread_attr_init(&orig_sched_attr);
+    pthread_attr_init(&fifo_sched_attr);
+    pthread_attr_setinheritsched(&fifo_sched_attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&fifo_sched_attr, SCHED_FIFO);
+    fifo_param.sched_priority=prio;
+    pthread_attr_setschedparam(&fifo_sched_attr, &fifo_param);
+
+    fifo_param.sched_priority=prio+1;
+    if((rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &fifo_param)) != 0)
+    {
+        printf("cannot set SCHED_FIFO priority %d: %s\n", prio+1, strerror(rc));
+        return -1;
+    }
+    fifo_param.sched_priority=prio;
+
+    return 0;
+}
+
+
+// Time every candidate grid on this image and kernel, best median throughput
+// wins.  Each candidate gets one untimed warm-up frame.
+int autotune(imagePlanesType *img, int margin, const pthread_attr_t *attr, int *cpus, int ncpus,
+             tune_entry_t *best)
+{
+    tile_pool_t pool;
+    tile_t *tiles;
+    double frame_ms[TUNE_RUNS], start, mpix;
+    bench_stats_t st;
+    int online=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    int ti, hi, wi, r, nthreads, tile_h, tile_w, ntiles;
+
+    best->mpix_per_s=0.0;
+
+    for(ti=0; ti<=NELEM(tune_threads); ti++)
     {
-        if((fdin = open(argv[1], O_RDONLY, 0644)) < 0)
+        // The list up to the CPU count, then the CPU count itself
+        if(ti < NELEM(tune_threads))
         {
-            printf("Error opening %s\n", argv[1]);
+            if((nthreads = tune_threads[ti]) >= online)
+                continue;
         }
-        //else
-        //    printf("File opened successfully\n");
+        else
+            nthreads=online;
 
-        if((fdout = open(argv[2], (O_RDWR | O_CREAT), 0666)) < 0)
+        if(tile_pool_create(&pool, nthreads, attr, cpus, ncpus) < 0)
+            return -1;
+        if(sharpen_pool_reserve(&pool, img, img->w) < 0)
         {
-            printf("Error opening %s\n", argv[1]);
+            tile_pool_destroy(&pool);
+            return -1;
         }
-        //else
-        //    printf("Output file=%s opened successfully\n", "sharpen.ppm");
-    }
-
-    bytesLeft=21;
-
-    //printf("Reading header\n");
 
-    do
-    {
-        //printf("bytesRead=%d, bytesLeft=%d\n", bytesRead, bytesLeft);
-        bytesRead=read(fdin, (void *)header, bytesLeft);
-        bytesLeft -= bytesRead;
+        for(hi=0; hi<NELEM(tune_tile_h); hi++)
+        {
+            // Taller than the image is the same grid as the whole image
+            tile_h=tune_tile_h[hi];
+            if(hi > 0 && tune_tile_h[hi-1] >= (int)img->h)
+                break;
+
+            for(wi=0; wi<NELEM(tune_tile_w); wi++)
+            {
+                tile_w=tune_tile_w[wi] ? tune_tile_w[wi] : (int)img->w;
+                if(tune_tile_w[wi] && tile_w >= (int)img->w)
+                    continue;
+
+                if((ntiles = tile_grid(img->h, img->w, margin, tile_h, tile_w, &tiles)) < 0)
+                {
+                    tile_pool_destroy(&pool);
+                    return -1;
+                }
+
+                tile_pool_run(&pool, tiles, ntiles, sharpen_tile_rgb, img);
+                for(r=0; r<TUNE_RUNS; r++)
+                {
+                    start=bench_now_ns();
+                    tile_pool_run(&pool, tiles, ntiles, sharpen_tile_rgb, img);
+                    frame_ms[r]=(bench_now_ns()-start)/1e6;
+                }
+                free(tiles);
+
+                bench_summarize(frame_ms, TUNE_RUNS, &st);
+                mpix=(double)img->w*img->h/(st.median*1e3);
+                printf("tune: %2d workers, %4d x %-5d tiles, median %.3f ms, %.1f Mpixel/s\n",
+                       nthreads, tile_h, tile_w, st.median, mpix);
+
+                if(mpix > best->mpix_per_s)
+                {
+                    best->threads=nthreads;
+                    best->tile_h=tile_h;
+                    best->tile_w=tile_w;
+                    best->mpix_per_s=mpix;
+                }
+            }
+        }
 
-    } while(bytesLeft > 0);
+        tile_pool_destroy(&pool);
+    }
 
-    header[21]='\0';
+    return 0;
+}
 
-    //printf("header = %s\n", header); 
 
-    // Read RGB data
-    for(i=0; i<IMG_HEIGHT; i++)
+int main(int argc, char *argv[])
+{
+    ppm_image_t in;
+    imagePlanesType img;
+    tile_pool_t pool;
+    tile_t *tiles;
+    int ntiles, opt;
+    int nthreads=NUM_THREADS, tile_h=TILE_H, tile_w=TILE_W, nruns=RUNS;
+    int runs=0;
+    int size=3, blur=0;
+    int prio=-1, cpus[MAX_CPUS], ncpus=0;
+    int profile=0, w;
+    perf_sample_t frame_perf, s;
+    UINT64 frame_pix;
+    char perf_line[160];
+    tile_fn_t tile_fn=sharpen_tile_rgb;
+    int tune=0, explicit_grid=0;
+    const char *cache=TUNE_CACHE_FILE;
+    tune_entry_t tuned;
+    size_t npix;
+    double *frame_ms, start;
+    bench_stats_t st;
+    char kname[64];
+
+    while((opt = getopt(argc, argv, "t:H:W:r:k:n:p:c:PAC:")) != -1)
     {
-        for(j=0; j<IMG_WIDTH; j++)
+        switch(opt)
         {
-            rc=read(fdin, (void *)&R[i][j], 1); convR[i][j]=R[i][j];
-            rc=read(fdin, (void *)&G[i][j], 1); convG[i][j]=G[i][j];
-            rc=read(fdin, (void *)&B[i][j], 1); convB[i][j]=B[i][j];
+            case 't': nthreads=atoi(optarg); explicit_grid=1; break;
+            case 'H': tile_h=atoi(optarg); explicit_grid=1; break;
+            case 'W': tile_w=atoi(optarg); explicit_grid=1; break;
+            case 'r': nruns=atoi(optarg); break;
+            case 'k': blur=(optarg[0] == 'b'); break;
+            case 'n': size=atoi(optarg); break;
+            case 'p': prio=atoi(optarg); break;
+            case 'P': profile=1; break;
+            case 'A': tune=1; break;
+            case 'C': cache=optarg; break;
+            case 'c':
+                if((ncpus = parse_cpu_list(optarg, cpus, MAX_CPUS)) < 0)
+                    usage();
+                break;
+            default: usage();
         }
     }
-    printf("source file %s read\n", argv[1]);
-    close(fdin);
 
+    if(argc-optind < 2 || nthreads < 1 || tile_h < 1 || tile_w < 1)
+        usage();
 
-    for(runs=0; runs < RUNS; runs++)
-    {
+    //Map the input file, the header is parsed in place (comments allowed)
+    if(ppm_open(argv[optind], &in) < 0)
+        exit(-1);
 
-    for(thread_idx=0; thread_idx<(NUM_ROW_THREADS*NUM_COL_THREADS); thread_idx++)
+    if(in.channels != 3 || in.w < size || in.h < size || in.maxval > 255)
     {
+        printf("%s must be an 8-bit PPM of at least %d x %d\n", argv[optind], size, size);
+        ppm_close(&in);
+        exit(-1);
+    }
 
-        if(thread_idx == 0) {idx=1; jdx=1;}
-        if(thread_idx == 1) {idx=1; jdx=(thread_idx*(IMG_W_SLICE-1));}
-        if(thread_idx == 2) {idx=1; jdx=(thread_idx*(IMG_W_SLICE-1));}
-        if(thread_idx == 3) {idx=1; jdx=(thread_idx*(IMG_W_SLICE-1));}
+    if(sharpen_planes_alloc(&img, in.w, in.h) < 0)
+        exit(-1);
+    npix=(size_t)img.w*img.h;
 
-        if(thread_idx == 4) {idx=IMG_H_SLICE; jdx=(thread_idx*(IMG_W_SLICE-1));}
-        if(thread_idx == 5) {idx=IMG_H_SLICE; jdx=(thread_idx*(IMG_W_SLICE-1));}
-        if(thread_idx == 6) {idx=IMG_H_SLICE; jdx=(thread_idx*(IMG_W_SLICE-1));}
-        if(thread_idx == 7) {idx=IMG_H_SLICE; jdx=(thread_idx*(IMG_W_SLICE-1));}
+    // Split RGB data into planes, the border pixels pass through unchanged
+    ppm_deinterleave_rgb(in.pixels, img.R, img.G, img.B, npix);
+    memcpy(img.convR, img.R, npix);
+    memcpy(img.convG, img.G, npix);
+    memcpy(img.convB, img.B, npix);
+    printf("source file %s read\n", argv[optind]);
+    ppm_close(&in);
 
-        if(thread_idx == 8) {idx=(2*(IMG_H_SLICE-1)); jdx=(thread_idx*(IMG_W_SLICE-1));}
-        if(thread_idx == 9) {idx=(2*(IMG_H_SLICE-1)); jdx=(thread_idx*(IMG_W_SLICE-1));}
-        if(thread_idx == 10) {idx=(2*(IMG_H_SLICE-1)); jdx=(thread_idx*(IMG_W_SLICE-1));}
-        if(thread_idx == 11) {idx=(2*(IMG_H_SLICE-1)); jdx=(thread_idx*(IMG_W_SLICE-1));}
 
-        //printf("idx=%d, jdx=%d\n", idx, jdx);
+    if(sharpen_kernel_setup(&kern, blur, size, K, PSF) < 0)
+        exit(-1);
+    img.kern=&kern;
+    printf("using %s PSF kernel\n", sharpen_kernel_name(&kern, kname, sizeof(kname)));
 
-        threadarg[thread_idx].i=idx;      
-        threadarg[thread_idx].h=IMG_H_SLICE-1;        
-        threadarg[thread_idx].j=jdx;        
-        threadarg[thread_idx].w=IMG_W_SLICE-1;
+    if(prio >= 0 && setup_fifo(prio) < 0)
+        exit(-1);
 
-        //printf("create thread_idx=%d\n", thread_idx);    
-        pthread_create(&threads[thread_idx], (void *)0, sharpen_thread, (void *)&threadarg[thread_idx]);
+    // Tuning is keyed on this machine, the image size and the kernel
+    tune_machine_key(&tuned);
+    tuned.w=img.w;
+    tuned.h=img.h;
+    snprintf(tuned.kernel, sizeof(tuned.kernel), "%s", kname);
 
+    if(tune)
+    {
+        if(autotune(&img, size/2, (prio >= 0) ? &fifo_sched_attr : NULL, cpus, ncpus, &tuned) < 0)
+            exit(-1);
+        printf("best: %d workers, %d x %d tiles, %.1f Mpixel/s", tuned.threads, tuned.tile_h, tuned.tile_w, tuned.mpix_per_s);
+        if(tune_cache_store(cache, &tuned) == 0)
+            printf(", saved to %s", cache);
+        printf("\n");
     }
 
-    for(thread_idx=0; thread_idx<(NUM_ROW_THREADS*NUM_COL_THREADS); thread_idx++)
+    if(tune || (!explicit_grid && tune_cache_load(cache, &tuned) == 0))
     {
-            //printf("join thread_idx=%d\n", thread_idx);    
-            if((pthread_join(threads[thread_idx], (void **)0)) < 0)
-                perror("pthread_join");
+        nthreads=tuned.threads;
+        tile_h=tuned.tile_h;
+        tile_w=tuned.tile_w;
+        if(!tune)
+            printf("tuned grid from %s\n", cache);
     }
 
-    printf("frame %d completed\n", runs);
+    if((ntiles = tile_grid(img.h, img.w, size/2, tile_h, tile_w, &tiles)) < 0)
+    {
+        printf("Error building %d x %d tile grid\n", tile_h, tile_w);
+        exit(-1);
+    }
+    printf("%u x %u image, %d tiles of %d x %d, %d workers\n", img.w, img.h, ntiles, tile_h, tile_w, nthreads);
+
+    if(tile_pool_create(&pool, nthreads, (prio >= 0) ? &fifo_sched_attr : NULL, cpus, ncpus) < 0)
+        exit(-1);
+    printf("workers %s, %s\n", (prio >= 0) ? "SCHED_FIFO" : "SCHED_OTHER", ncpus ? "pinned" : "unpinned");
+
+    if(sharpen_pool_reserve(&pool, &img, tile_w) < 0)
+        exit(-1);
+
 
+    if(profile)
+    {
+        worker_perf=calloc(nthreads, sizeof(workerPerfType));
+        tile_pool_each(&pool, tiles, sharpen_perf_open, NULL);
+        tile_fn=sharpen_tile_perf;
     }
 
-    printf("starting sink file %s write\n", argv[2]);
-    rc=write(fdout, (void *)header, 21);
+    frame_ms=calloc(nruns > 0 ? nruns : 1, sizeof(double));
 
-    // Write RGB data
-    for(i=0; i<IMG_HEIGHT; i++)
+    for(runs=0; runs < nruns; runs++)
     {
-        for(j=0; j<IMG_WIDTH; j+=1)
+        for(w=0; w<nworker_perf; w++)
         {
-            rc=write(fdout, (void *)&convR[i][j], 1);
-            rc=write(fdout, (void *)&convG[i][j], 1);
-            rc=write(fdout, (void *)&convB[i][j], 1);
+            worker_perf[w].frame_pix=0;
+            perf_counters_start(&worker_perf[w].pc);
         }
+
+        start=bench_now_ns();
+        tile_pool_run(&pool, tiles, ntiles, tile_fn, &img);
+        frame_ms[runs]=(bench_now_ns()-start)/1e6;
+
+        printf("frame %d completed in %.3f ms\n", runs, frame_ms[runs]);
+
+        if(profile)
+        {
+            memset(&frame_perf, 0, sizeof(frame_perf));
+            frame_pix=0;
+            for(w=0; w<nworker_perf; w++)
+            {
+                perf_counters_stop(&worker_perf[w].pc);
+                perf_counters_read(&worker_perf[w].pc, &s);
+                perf_sample_add(&frame_perf, &s);
+                perf_sample_add(&worker_perf[w].total, &s);
+                worker_perf[w].total_pix+=worker_perf[w].frame_pix;
+                frame_pix+=worker_perf[w].frame_pix;
+            }
+            printf("frame %d perf: %s\n", runs, perf_sample_format(&frame_perf, frame_pix, perf_line, sizeof(perf_line)));
+        }
+    }
+
+    // Low IPC with high LLC miss/px points at memory bandwidth, low IPC with
+    // few misses at dependency chains or port pressure in the kernel itself
+    for(w=0; w<nworker_perf; w++)
+    {
+        printf("worker %d perf: %llu px, %s\n", w, worker_perf[w].total_pix,
+               perf_sample_format(&worker_perf[w].total, worker_perf[w].total_pix, perf_line, sizeof(perf_line)));
+        perf_counters_close(&worker_perf[w].pc);
     }
+    free(worker_perf);
+
+    bench_summarize(frame_ms, nruns, &st);
+    if(nruns > 0)
+    {
+        printf("%d frames: min %.3f ms, median %.3f ms, p99 %.3f ms, max %.3f ms, %.1f Mpixel/s\n",
+               nruns, st.min, st.median, st.p99, st.max, (double)npix/(st.median*1e3));
+        printf("frame jitter: max-min %.3f ms, p99-median %.3f ms, stddev %.3f ms\n",
+               st.max-st.min, st.p99-st.median, st.stddev);
+    }
+    free(frame_ms);
+
+    tile_pool_destroy(&pool);
+    free(tiles);
+
+    if(img.failed)
+    {
+        printf("Tiles were dropped, not writing %s\n", argv[optind+1]);
+        exit(-1);
+    }
+
+    printf("starting sink file %s write\n", argv[optind+1]);
+    if(ppm_write_rgb(argv[optind+1], "sharpened image using PSF", img.w, img.h, img.convR, img.convG, img.convB) < 0)
+        printf("Error writing %s\n", argv[optind+1]);
+    else
+        printf("sink file %s written\n", argv[optind+1]);
 
+    sharpen_planes_free(&img);
 
-    printf("sink file %s written\n", argv[2]);
-    close(fdout);
- 
 }
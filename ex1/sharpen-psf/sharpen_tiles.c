@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "sharpen_tiles.h"
+
+
+int sharpen_kernel_setup(sharpenKernelType *k, int blur, int size, double K, const double psf3[9])
+{
+    double psf[CONV_MAX_SIZE*CONV_MAX_SIZE];
+
+    k->size=size;
+    k->blur=blur;
+    k->fixed=(size == 3 && !blur);
+
+    if(k->fixed)
+    {
+        int r=psf3x3_quantize(psf3, &k->psfq);
+
+        if(r == 0)
+            return 0;
+
+        // Rounded taps have no useful error bound (see psf_kernel.h), so run it in float
+        if(r < 0)
+            printf("PSF does not fit 16-bit fixed point, using the float kernel\n");
+        else
+            printf("PSF not exact in Q%d fixed point (error up to %u levels), using the float kernel\n",
+                   k->psfq.shift, psf3x3_error_bound(psf3, &k->psfq, 255));
+        k->fixed=0;
+        return conv_kernel_init(&k->conv, psf3, 3);
+    }
+
+    if(size < 1 || size > CONV_MAX_SIZE)
+    {
+        printf("PSF size %d not supported (odd, at most %d)\n", size, CONV_MAX_SIZE);
+        return -1;
+    }
+
+    if(blur)
+        conv_psf_blur(psf, size);
+    else
+        conv_psf_sharpen(psf, size, K);
+
+    return conv_kernel_init(&k->conv, psf, size);
+}
+
+
+const char *sharpen_kernel_name(const sharpenKernelType *k, char *buf, int len)
+{
+    if(k->fixed)
+        snprintf(buf, len, "psf3-fixed-%s", psf3x3_isa());
+    else
+        snprintf(buf, len, "%s%d-%s", k->blur ? "blur" : "sharpen", k->size,
+                 k->conv.separable ? "sep" : "direct");
+    return buf;
+}
+
+
+int sharpen_planes_alloc(imagePlanesType *img, unsigned w, unsigned h)
+{
+    size_t npix=(size_t)w*h;
+
+    img->w=w;
+    img->h=h;
+    img->failed=0;
+    img->R=malloc(npix); img->G=malloc(npix); img->B=malloc(npix);
+    img->convR=malloc(npix); img->convG=malloc(npix); img->convB=malloc(npix);
+    if(!img->R || !img->G || !img->B || !img->convR || !img->convG || !img->convB)
+    {
+        printf("Error allocating %u x %u image planes\n", w, h);
+        sharpen_planes_free(img);
+        return -1;
+    }
+    return 0;
+}
+
+
+void sharpen_planes_free(imagePlanesType *img)
+{
+    free(img->R); free(img->G); free(img->B);
+    free(img->convR); free(img->convG); free(img->convB);
+    img->R=img->G=img->B=img->convR=img->convG=img->convB=NULL;
+}
+
+
+static void sharpen_tile_reserve(const tile_t *tile, void *ctx)
+{
+    imagePlanesType *img=(imagePlanesType *)ctx;
+
+    if(!img->kern->fixed && conv_scratch_reserve(&img->kern->conv, tile->w) < 0)
+        img->failed=1;
+}
+
+
+int sharpen_pool_reserve(tile_pool_t *pool, imagePlanesType *img, int tile_w)
+{
+    tile_t widest={0, 0, 1, ((unsigned)tile_w < img->w) ? tile_w : (int)img->w};
+
+    img->failed=0;
+    tile_pool_each(pool, &widest, sharpen_tile_reserve, img);
+    return img->failed ? -1 : 0;
+}
+
+
+void sharpen_tile_rgb(const tile_t *tile, void *ctx)
+{
+    imagePlanesType *img=(imagePlanesType *)ctx;
+    const sharpenKernelType *k=img->kern;
+    unsigned w=img->w;
+    int i;
+    size_t at;
+
+    if(!k->fixed)
+    {
+        if(conv_tile(&k->conv, img->R, img->convR, w, tile->i, tile->j, tile->h, tile->w) < 0 ||
+           conv_tile(&k->conv, img->G, img->convG, w, tile->i, tile->j, tile->h, tile->w) < 0 ||
+           conv_tile(&k->conv, img->B, img->convB, w, tile->i, tile->j, tile->h, tile->w) < 0)
+            img->failed=1;
+        return;
+    }
+
+    for(i=tile->i; i<(tile->i+tile->h); i++)
+    {
+        at=((size_t)i*w)+tile->j;
+        psf3x3_row(&img->R[at-w], &img->R[at], &img->R[at+w], &img->convR[at], tile->w, &k->psfq);
+        psf3x3_row(&img->G[at-w], &img->G[at], &img->G[at+w], &img->convG[at], tile->w, &k->psfq);
+        psf3x3_row(&img->B[at-w], &img->B[at], &img->B[at+w], &img->convB[at], tile->w, &k->psfq);
+    }
+}
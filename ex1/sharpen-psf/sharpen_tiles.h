@@ -0,0 +1,47 @@
+#ifndef SHARPEN_TILES_H
+#define SHARPEN_TILES_H
+
+#include "psf_kernel.h"
+#include "conv_kernel.h"
+#include "tile_pool.h"
+
+// Tile callbacks shared by sharpen_grid and sharpen_bench
+
+typedef struct
+{
+    int size;
+    int blur;
+    int fixed;              // 3x3 sharpen through the fixed-point kernel
+    psf3x3_q_t psfq;
+    conv_kernel_t conv;
+} sharpenKernelType;
+
+typedef struct
+{
+    unsigned w, h;
+    unsigned char *R, *G, *B;
+    unsigned char *convR, *convG, *convB;
+    const sharpenKernelType *kern;
+    int failed;             // set when a tile could not be convolved
+} imagePlanesType;
+
+// Select the 3x3 fixed-point kernel for psf3 (size 3, !blur) or an NxN
+// sharpen/blur PSF for the conv_kernel engine.  Returns 0 or -1.
+int sharpen_kernel_setup(sharpenKernelType *k, int blur, int size, double K, const double psf3[9]);
+
+// Human readable kernel name, e.g. "psf3-fixed" or "blur5-sep"
+const char *sharpen_kernel_name(const sharpenKernelType *k, char *buf, int len);
+
+// Allocate the six planes of a w x h image, 0 or -1.  Free with sharpen_planes_free().
+int sharpen_planes_alloc(imagePlanesType *img, unsigned w, unsigned h);
+void sharpen_planes_free(imagePlanesType *img);
+
+// Allocate every worker's conv_kernel scratch for tiles up to tile_w columns
+// before the first frame.  Returns 0, or -1 if a worker is out of memory.
+int sharpen_pool_reserve(tile_pool_t *pool, imagePlanesType *img, int tile_w);
+
+// tile_fn_t for imagePlanesType: convolve R, G and B over one tile.  A tile
+// that cannot be convolved sets img->failed.
+void sharpen_tile_rgb(const tile_t *tile, void *ctx);
+
+#endif
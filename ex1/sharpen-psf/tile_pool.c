@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "tile_pool.h"
+
+
+// Claim the next tile from range r, or -1 when it is drained.
+static int tile_claim(tile_range_t *r)
+{
+    int t;
+
+    if(__atomic_load_n(&r->next, __ATOMIC_RELAXED) >= r->end)
+        return -1;
+
+    t=__atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+    return (t < r->end) ? t : -1;
+}
+
+
+static void *tile_worker(void *threadptr)
+{
+    tile_worker_t *self=(tile_worker_t *)threadptr;
+    tile_pool_t *pool=self->pool;
+    int k, t, victim, rc;
+    cpu_set_t cpuset;
+
+    // Pin before the first frame so no tile runs on the wrong core
+    if(self->cpu >= 0)
+    {
+        CPU_ZERO(&cpuset);
+        CPU_SET(self->cpu, &cpuset);
+        if((rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset)) != 0)
+            printf("worker %d: cannot pin to CPU %d: %s\n", self->idx, self->cpu, strerror(rc));
+    }
+
+    // Until tile_pool_create() has every worker; go home if it failed
+    pthread_mutex_lock(&pool->gate_lock);
+    while(!pool->open)
+        pthread_cond_wait(&pool->gate, &pool->gate_lock);
+    rc=pool->open;
+    pthread_mutex_unlock(&pool->gate_lock);
+    if(rc < 0)
+        return (void *)0;
+
+    while(1)
+    {
+        pthread_barrier_wait(&pool->start);
+        if(pool->quit)
+            break;
+
+        if(pool->each)
+            pool->fn(pool->each, pool->ctx);
+
+        // Own range first, then steal round-robin from the others
+        for(k=0; k<pool->nthreads; k++)
+        {
+            victim=(self->idx+k) % pool->nthreads;
+            while((t = tile_claim(&pool->ranges[victim])) >= 0)
+                pool->fn(&pool->tiles[t], pool->ctx);
+        }
+
+        pthread_barrier_wait(&pool->done);
+    }
+
+    return (void *)0;
+}
+
+
+// Let the started workers run (1), or send them home before the barriers (-1)
+static void tile_pool_open(tile_pool_t *pool, int open)
+{
+    pthread_mutex_lock(&pool->gate_lock);
+    pool->open=open;
+    pthread_cond_broadcast(&pool->gate);
+    pthread_mutex_unlock(&pool->gate_lock);
+}
+
+
+static void tile_pool_free(tile_pool_t *pool)
+{
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    pthread_cond_destroy(&pool->gate);
+    pthread_mutex_destroy(&pool->gate_lock);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->ranges);
+}
+
+
+int tile_pool_create(tile_pool_t *pool, int nthreads, const pthread_attr_t *attr,
+                     const int *cpus, int ncpus)
+{
+    int idx, rc, started;
+
+    if(nthreads < 1)
+        return -1;
+
+    pool->nthreads=nthreads;
+    pool->quit=0;
+    pool->open=0;
+    pool->each=NULL;
+    pool->threads=calloc(nthreads, sizeof(pthread_t));
+    pool->workers=calloc(nthreads, sizeof(tile_worker_t));
+    if(posix_memalign((void **)&pool->ranges, 64, nthreads*sizeof(tile_range_t)) != 0)
+        pool->ranges=NULL;
+    if(!pool->threads || !pool->workers || !pool->ranges)
+    {
+        printf("Error allocating worker pool\n");
+        free(pool->threads);
+        free(pool->workers);
+        free(pool->ranges);
+        return -1;
+    }
+
+    // Workers plus the thread calling tile_pool_run()
+    pthread_barrier_init(&pool->start, NULL, nthreads+1);
+    pthread_barrier_init(&pool->done, NULL, nthreads+1);
+    pthread_mutex_init(&pool->gate_lock, NULL);
+    pthread_cond_init(&pool->gate, NULL);
+
+    for(idx=0; idx<nthreads; idx++)
+    {
+        pool->ranges[idx].next=0;
+        pool->ranges[idx].end=0;
+        pool->workers[idx].pool=pool;
+        pool->workers[idx].idx=idx;
+        pool->workers[idx].cpu=(ncpus > 0) ? cpus[idx % ncpus] : -1;
+
+        if((rc = pthread_create(&pool->threads[idx], attr, tile_worker, (void *)&pool->workers[idx])) != 0)
+        {
+            errno=rc;
+            perror("pthread_create");
+            if(rc == EPERM)
+                printf("real-time workers need root or CAP_SYS_NICE\n");
+
+            // The barriers would wait for workers that never started
+            tile_pool_open(pool, -1);
+            for(started=0; started<idx; started++)
+                pthread_join(pool->threads[started], (void **)0);
+            tile_pool_free(pool);
+            return -1;
+        }
+    }
+
+    tile_pool_open(pool, 1);
+    return 0;
+}
+
+
+void tile_pool_run(tile_pool_t *pool, const tile_t *tiles, int ntiles, tile_fn_t fn, void *ctx)
+{
+    int idx;
+
+    pool->tiles=tiles;
+    pool->each=NULL;
+    pool->fn=fn;
+    pool->ctx=ctx;
+
+    // Contiguous ranges keep neighbouring tiles on the same worker
+    for(idx=0; idx<pool->nthreads; idx++)
+    {
+        pool->ranges[idx].next=(int)((long)ntiles*idx/pool->nthreads);
+        pool->ranges[idx].end=(int)((long)ntiles*(idx+1)/pool->nthreads);
+    }
+
+    // The barriers order these writes before, and all tile output after
+    pthread_barrier_wait(&pool->start);
+    pthread_barrier_wait(&pool->done);
+}
+
+
+void tile_pool_each(tile_pool_t *pool, const tile_t *tile, tile_fn_t fn, void *ctx)
+{
+    int idx;
+
+    pool->tiles=NULL;
+    pool->each=tile;
+    pool->fn=fn;
+    pool->ctx=ctx;
+
+    // Empty ranges, nothing to claim or steal
+    for(idx=0; idx<pool->nthreads; idx++)
+    {
+        pool->ranges[idx].next=0;
+        pool->ranges[idx].end=0;
+    }
+
+    pthread_barrier_wait(&pool->start);
+    pthread_barrier_wait(&pool->done);
+}
+
+
+void tile_pool_destroy(tile_pool_t *pool)
+{
+    int idx;
+
+    pool->quit=1;
+    pthread_barrier_wait(&pool->start);
+
+    for(idx=0; idx<pool->nthreads; idx++)
+    {
+        if(pthread_join(pool->threads[idx], (void **)0) != 0)
+            perror("pthread_join");
+    }
+
+    tile_pool_free(pool);
+}
+
+
+int tile_grid(int h, int w, int margin, int tile_h, int tile_w, tile_t **tiles)
+{
+    int i, j, n=0;
+    int rows=h-2*margin, cols=w-2*margin;
+
+    if(rows < 1 || cols < 1 || tile_h < 1 || tile_w < 1)
+        return -1;
+
+    *tiles=malloc(sizeof(tile_t) * ((rows+tile_h-1)/tile_h) * ((cols+tile_w-1)/tile_w));
+    if(!*tiles)
+        return -1;
+
+    for(i=margin; i<h-margin; i+=tile_h)
+    {
+        for(j=margin; j<w-margin; j+=tile_w)
+        {
+            (*tiles)[n].i=i;
+            (*tiles)[n].j=j;
+            (*tiles)[n].h=(i+tile_h <= h-margin) ? tile_h : (h-margin-i);
+            (*tiles)[n].w=(j+tile_w <= w-margin) ? tile_w : (w-margin-j);
+            n++;
+        }
+    }
+
+    return n;
+}
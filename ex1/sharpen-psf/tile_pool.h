@@ -0,0 +1,84 @@
+#ifndef TILE_POOL_H
+#define TILE_POOL_H
+
+#include <pthread.h>
+
+// Persistent worker pool for tiled image kernels
+//
+// Workers are created once and parked on a barrier between frames.  Each
+// frame the tile list is split into one contiguous range per worker; a worker
+// drains its own range first and then steals tiles from the other ranges, so
+// uneven tiles or a preempted worker do not stall the frame.  Claiming a tile
+// is a single atomic increment on the range's cursor.
+
+typedef struct
+{
+    int i;      // first row
+    int j;      // first column
+    int h;      // rows
+    int w;      // columns
+} tile_t;
+
+typedef void (*tile_fn_t)(const tile_t *tile, void *ctx);
+
+// One cache line per range so workers do not false-share cursors
+typedef struct __attribute__((aligned(64)))
+{
+    int next;   // claimed with __atomic_fetch_add
+    int end;
+} tile_range_t;
+
+typedef struct tile_pool tile_pool_t;
+
+typedef struct
+{
+    tile_pool_t *pool;
+    int idx;
+    int cpu;    // -1 to leave unpinned
+} tile_worker_t;
+
+struct tile_pool
+{
+    int nthreads;
+    pthread_t *threads;
+    tile_worker_t *workers;
+    tile_range_t *ranges;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    int quit;
+
+    // Start-up gate: workers wait here until every thread exists, so a failed
+    // tile_pool_create() can send them home before they reach the barriers
+    pthread_mutex_t gate_lock;
+    pthread_cond_t gate;
+    int open;               // 0 closed, 1 run, -1 create failed
+
+    // Current frame, valid between the two barriers
+    const tile_t *tiles;
+    const tile_t *each;     // tile_pool_each(): run once per worker instead
+    tile_fn_t fn;
+    void *ctx;
+};
+
+// Start nthreads workers.  attr, if not NULL, is used for every worker (e.g.
+// SCHED_FIFO with explicit scheduling).  If ncpus > 0 worker idx is pinned to
+// cpus[idx % ncpus].  Returns 0 on success, -1 on error.
+int tile_pool_create(tile_pool_t *pool, int nthreads, const pthread_attr_t *attr,
+                     const int *cpus, int ncpus);
+
+// Run fn over every tile and return once all tiles of the frame are done.
+void tile_pool_run(tile_pool_t *pool, const tile_t *tiles, int ntiles, tile_fn_t fn, void *ctx);
+
+// Run fn(tile, ctx) exactly once on every worker and return when all are
+// done.  For per-thread set-up before the first frame, e.g. allocating
+// scratch sized for the largest tile.
+void tile_pool_each(tile_pool_t *pool, const tile_t *tile, tile_fn_t fn, void *ctx);
+
+void tile_pool_destroy(tile_pool_t *pool);
+
+// Cover rows [margin,h-margin) and columns [margin,w-margin) with tiles of at
+// most tile_h x tile_w.  Returns the tile count and a malloc'd array in
+// *tiles, or -1 on error.
+int tile_grid(int h, int w, int margin, int tile_h, int tile_w, tile_t **tiles);
+
+#endif
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "tune_cache.h"
+
+#define TUNE_LINE (512)
+
+
+void tune_machine_key(tune_entry_t *e)
+{
+    char line[TUNE_LINE], model[TUNE_KEY_LEN]="unknown", *val;
+    FILE *fp;
+    int k;
+
+    // x86 reports "model name", most ARM boards "Model" or "Hardware"
+    if((fp = fopen("/proc/cpuinfo", "r")) != NULL)
+    {
+        while(fgets(line, sizeof(line), fp))
+        {
+            if(strncmp(line, "model name", 10) && strncmp(line, "Model", 5) && strncmp(line, "Hardware", 8))
+                continue;
+            if((val = strchr(line, ':')) == NULL)
+                continue;
+            for(val++; isspace((unsigned char)*val); val++);
+            snprintf(model, sizeof(model), "%s", val);
+            break;
+        }
+        fclose(fp);
+    }
+
+    snprintf(e->machine, sizeof(e->machine), "%ldx%s", sysconf(_SC_NPROCESSORS_ONLN), model);
+    for(k=0; e->machine[k]; k++)
+    {
+        if(e->machine[k] == '\n')
+            e->machine[k]='\0';
+        else if(isspace((unsigned char)e->machine[k]))
+            e->machine[k]='_';
+    }
+}
+
+
+// Parse one cache line into e, 0 on success
+static int tune_parse(const char *line, tune_entry_t *e)
+{
+    return (sscanf(line, "%127s %u %u %127s %d %d %d %lf", e->machine, &e->w, &e->h, e->kernel,
+                   &e->threads, &e->tile_h, &e->tile_w, &e->mpix_per_s) == 8 &&
+            e->threads > 0 && e->tile_h > 0 && e->tile_w > 0) ? 0 : -1;
+}
+
+
+static int tune_same(const tune_entry_t *a, const tune_entry_t *b)
+{
+    return !strcmp(a->machine, b->machine) && a->w == b->w && a->h == b->h && !strcmp(a->kernel, b->kernel);
+}
+
+
+int tune_cache_load(const char *path, tune_entry_t *e)
+{
+    char line[TUNE_LINE];
+    tune_entry_t t;
+    FILE *fp;
+    int rc=-1;
+
+    if((fp = fopen(path, "r")) == NULL)
+        return -1;
+
+    while(fgets(line, sizeof(line), fp))
+    {
+        if(tune_parse(line, &t) == 0 && tune_same(&t, e))
+        {
+            *e=t;
+            rc=0;
+        }
+    }
+
+    fclose(fp);
+    return rc;
+}
+
+
+int tune_cache_store(const char *path, const tune_entry_t *e)
+{
+    char line[TUNE_LINE], tmp[TUNE_LINE];
+    tune_entry_t t;
+    FILE *in, *out;
+
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+    if((out = fopen(tmp, "w")) == NULL)
+    {
+        printf("Error opening %s\n", tmp);
+        return -1;
+    }
+
+    // Keep every other entry, drop stale ones for this key
+    if((in = fopen(path, "r")) != NULL)
+    {
+        while(fgets(line, sizeof(line), in))
+            if(tune_parse(line, &t) == 0 && !tune_same(&t, e))
+                fputs(line, out);
+        fclose(in);
+    }
+
+    fprintf(out, "%s %u %u %s %d %d %d %.1f\n", e->machine, e->w, e->h, e->kernel,
+            e->threads, e->tile_h, e->tile_w, e->mpix_per_s);
+
+    if(fclose(out) != 0 || rename(tmp, path) != 0)
+    {
+        printf("Error writing %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef TUNE_CACHE_H
+#define TUNE_CACHE_H
+
+// Persisted sharpen_grid tuning results
+//
+// One line per machine, image size and kernel:
+//   <machine> <width> <height> <kernel> <threads> <tile_h> <tile_w> <mpix_per_s>
+// where machine is "<online cpus>x<cpu model>" with blanks replaced, so a
+// cache file shared between 4-core and 12-core boards keeps both entries.
+
+#define TUNE_CACHE_FILE "sharpen_grid.tune"
+#define TUNE_KEY_LEN (128)
+
+typedef struct
+{
+    char machine[TUNE_KEY_LEN];
+    unsigned w, h;
+    char kernel[TUNE_KEY_LEN];
+    int threads, tile_h, tile_w;
+    double mpix_per_s;
+} tune_entry_t;
+
+// Fill e->machine for the running system.
+void tune_machine_key(tune_entry_t *e);
+
+// Look up the entry matching e's machine, w, h and kernel and fill in the
+// rest.  Returns 0 when found, -1 otherwise (a missing file is not an error).
+int tune_cache_load(const char *path, tune_entry_t *e);
+
+// Replace or append e's entry, rewriting the file through a rename so a
+// concurrent reader never sees it half written.  Returns 0 or -1.
+int tune_cache_store(const char *path, const tune_entry_t *e);
+
+#endif
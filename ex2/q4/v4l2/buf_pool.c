@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "buf_pool.h"
+
+
+// Anonymous mapping of len (a huge page multiple) aligned to a huge page, so
+// khugepaged or the fault path can back it with 2 MB pages
+static void *map_aligned(size_t len)
+{
+    unsigned char *raw, *base;
+    size_t head;
+
+    raw = mmap(NULL, len + BUF_POOL_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return MAP_FAILED;
+
+    base = (unsigned char *)(((uintptr_t)raw + BUF_POOL_HUGE_PAGE - 1) & ~(uintptr_t)(BUF_POOL_HUGE_PAGE - 1));
+    head = base - raw;
+    if (head)
+        munmap(raw, head);
+    munmap(base + len, BUF_POOL_HUGE_PAGE - head);
+    return base;
+}
+
+
+int buf_pool_create(buf_pool_t *p, size_t block_size, unsigned int count)
+{
+    size_t len;
+
+    memset(p, 0, sizeof(*p));
+    p->block = (block_size + BUF_POOL_ALIGN - 1) & ~(size_t)(BUF_POOL_ALIGN - 1);
+    p->count = count;
+    len = p->block*count;
+    p->map_len = (len + BUF_POOL_HUGE_PAGE - 1) & ~(BUF_POOL_HUGE_PAGE - 1);
+    if (p->map_len == 0)
+        p->map_len = BUF_POOL_HUGE_PAGE;
+
+    p->backing = BUF_POOL_HUGETLB;
+    p->base = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+
+    if (p->base == MAP_FAILED)
+    {
+        p->backing = BUF_POOL_THP;
+        p->base = map_aligned(p->map_len);
+        if (p->base == MAP_FAILED)
+        {
+            p->base = NULL;
+            return -1;
+        }
+        if (madvise(p->base, p->map_len, MADV_HUGEPAGE) == -1)
+            p->backing = BUF_POOL_PAGES;
+    }
+
+    // Fault every page in now; for THP this is also when the 2 MB pages
+    // are allocated
+    memset(p->base, 0, p->map_len);
+
+    p->locked = (mlock(p->base, p->map_len) == 0);
+    return 0;
+}
+
+
+void buf_pool_destroy(buf_pool_t *p)
+{
+    if (!p->base)
+        return;
+
+    if (p->locked)
+        munlock(p->base, p->map_len);
+    munmap(p->base, p->map_len);
+    p->base = NULL;
+}
+
+
+const char *buf_pool_describe(const buf_pool_t *p)
+{
+    static const char *names[2][3] =
+    {
+        { "hugetlb pages, unlocked", "transparent huge pages, unlocked", "4 KB pages, unlocked" },
+        { "hugetlb pages, locked", "transparent huge pages, locked", "4 KB pages, locked" }
+    };
+
+    return names[p->locked != 0][p->backing];
+}
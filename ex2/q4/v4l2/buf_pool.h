@@ -0,0 +1,44 @@
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+
+// Pinned frame buffer pool
+//
+// count equal blocks carved out of one mapping, so a camera's USERPTR
+// buffers, the processing scratch buffers or the dump writer's slots sit in a
+// handful of TLB entries instead of hundreds.  The mapping is 2 MB hugetlbfs
+// pages when the system has some reserved (vm.nr_hugepages), else 2 MB
+// aligned memory advised for transparent huge pages, else plain pages.  It is
+// faulted in and mlock()ed at creation, so the first frames of a stream pay
+// for no page faults and the pages cannot be reclaimed mid-run; a failed
+// mlock (RLIMIT_MEMLOCK) only costs the locking.
+
+#define BUF_POOL_HUGE_PAGE (2UL << 20)
+#define BUF_POOL_ALIGN     (4096)       // block alignment, USERPTR wants pages
+
+enum buf_pool_backing { BUF_POOL_HUGETLB, BUF_POOL_THP, BUF_POOL_PAGES };
+
+typedef struct
+{
+    unsigned char *base;
+    size_t map_len;
+    size_t block;               // block_size rounded up to BUF_POOL_ALIGN
+    unsigned int count;
+    enum buf_pool_backing backing;
+    int locked;
+} buf_pool_t;
+
+// count blocks of at least block_size bytes.  0 or -1.
+int buf_pool_create(buf_pool_t *p, size_t block_size, unsigned int count);
+void buf_pool_destroy(buf_pool_t *p);
+
+static inline void *buf_pool_block(const buf_pool_t *p, unsigned int i)
+{
+    return p->base + (size_t)i*p->block;
+}
+
+// "hugetlb, locked" and the like, for start-up messages
+const char *buf_pool_describe(const buf_pool_t *p);
+
+#endif
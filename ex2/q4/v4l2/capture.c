@@ -28,10 +28,26 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <poll.h>
 
 #include <linux/videodev2.h>
 
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "frame_ring.h"
+#include "yuv_convert.h"
+#include "luma_view.h"
+#include "dump_writer.h"
+#include "frame_store.h"
+#include "latency_hist.h"
+#include "frame_share.h"
+#include "buf_pool.h"
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 //#define COLOR_CONVERT
@@ -40,9 +56,6 @@
 #define HRES_STR "320"
 #define VRES_STR "240"
 
-// Format is used by a number of functions, so made as a file global
-static struct v4l2_format fmt;
-
 enum io_method 
 {
         IO_METHOD_READ,
@@ -56,16 +69,151 @@ struct buffer
         size_t  length;
 };
 
-static char            *dev_name;
+// A dequeued driver buffer on its way through the processing workers.  buf is
+// kept exactly as DQBUF returned it so it can be handed straight back to QBUF.
+struct camera;
+
+struct frame
+{
+        struct camera     *cam;
+        struct v4l2_buffer buf;
+        const void        *start;
+        int                size;
+        unsigned int       tag;         // frame number, used for the dump name
+        uint64_t           t_glass;     // driver capture time, CLOCK_MONOTONIC ns
+        uint64_t           t_dqbuf;     // when DQBUF returned it
+        unsigned int       refs;        // processing + share clients; requeued at 0
+        unsigned int       clients;     // share clients still reading it
+        unsigned int       dup_of;      // -e: tag of the stored frame it repeats
+};
+
+// One capture device: its own descriptor, negotiated format and buffer set.
+// Every -d adds one; all of them share the workers and the dump writer.
+struct camera
+{
+        int                 index;
+        char               *dev_name;
+        int                 fd;
+        struct v4l2_format  fmt;
+        struct buffer      *buffers;
+        unsigned int        n_buffers;
+        buf_pool_t          pool;       // USERPTR buffer memory
+        struct frame       *frames;     // one per buffer, filled by dequeue_frame()
+        unsigned int        framecnt;
+        unsigned int        remaining;  // frames still to capture
+        unsigned int        outstanding;// frames with the workers
+        unsigned int        last_seq;   // v4l2 sequence of the previous frame
+        unsigned long       seq_lost;   // frames the driver skipped (sequence gaps)
+        int                 glass_ok;   // driver timestamps are CLOCK_MONOTONIC
+        int                 cropped;    // the driver took the -R crop
+        unsigned int        dedup_ref;  // tag of the last stored frame
+        unsigned char       dedup_sig[LUMA_SIG_SIZE];   // and its signature
+        unsigned long       dedup_skipped;
+        int                *dmabuf;     // -E: exported buffer fds
+        unsigned int        shared;     // buffers share clients are holding
+};
+
+#define MAX_WORKERS 16
+#define MAX_CAMERAS 8
+
+static struct camera    cameras[MAX_CAMERAS];
+static int              n_cameras;
 //static enum io_method   io = IO_METHOD_USERPTR;
 //static enum io_method   io = IO_METHOD_READ;
 static enum io_method   io = IO_METHOD_MMAP;
-static int              fd = -1;
-struct buffer          *buffers;
-static unsigned int     n_buffers;
+static int              req_buffers;    // -n, 0 for the method's default
+static int              bench;          // -B: compare I/O methods and buffer counts
 static int              out_buf;
 static int              force_format=1;
+
+// Format negotiation (with force_format): -P picks the pixel format, by
+// default the cheapest native one the processing can use, -G the frame size,
+// -I the frame rate, and -R a sensor region the driver crops to, so pixels
+// nothing consumes never leave the camera
+static unsigned int     want_format;            // fourcc, 0 for auto
+static unsigned int     want_width = HRES, want_height = VRES;
+static int              want_size;              // -G given
+static unsigned int     want_fps;               // 0 keeps the driver's rate
+static struct v4l2_rect roi;                    // width 0 for the whole sensor
 static int              frame_count = 30;
+static int              n_workers = 2;
+
+// COLOR_CONVERT: -y selects the YUV matrix and range, -b BGR order (stored
+// frames only) and -s splits each frame's rows across that many threads
+static yuv_coef_t       yuv_coef;
+static int              convert_threads = 1;
+
+// Grayscale output (GREY, or YUYV without COLOR_CONVERT): the plain Y plane,
+// or -l's Sobel or threshold computed straight from the capture buffer
+enum luma_op { LUMA_DUMP, LUMA_SOBEL, LUMA_THRESHOLD };
+static enum luma_op     luma_op = LUMA_DUMP;
+static int              luma_thresh = 128;
+
+// Dumps go through the background writer unless -q 0
+#define DUMP_BATCH 8
+static int              dump_slots = 8;
+static int              dump_pool;
+static int              dump_drop;
+
+// -S appends every dump to one indexed file instead of a file per frame
+#define STORE_PREALLOC (256ULL << 20)
+static char            *store_path;
+static frame_store_t    store;
+
+// -e skips dumping frames whose luma signature is within dedup_thresh of the
+// last stored frame's; each skipped frame leaves only a reference, a size 0
+// record with -S or a line in dedup.log
+static int              dedup_thresh = -1;
+static FILE            *dedup_log;
+
+// -t traces every frame on CLOCK_MONOTONIC from the driver's capture stamp
+// (glass) through DQBUF and processing to the dump landing on disk, into
+// latency histograms; -C also writes one CSV row per frame
+enum trace_stage
+{
+    TRACE_GLASS_DQBUF,
+    TRACE_DQBUF_START,
+    TRACE_PROCESS,
+    TRACE_GLASS_PROCESSED,
+    TRACE_GLASS_DISK,
+    TRACE_STAGES
+};
+static const char      *trace_names[TRACE_STAGES] =
+        { "glass->dqbuf", "dqbuf->process", "process", "glass->processed", "glass->disk" };
+static int              trace;
+static FILE            *trace_csv;
+static lat_hist_t       trace_hist[TRACE_STAGES];
+
+// Capture/processing pipeline: the capture thread only dequeues and requeues,
+// work_ring carries filled frames to the workers (work_sem counts them) and
+// done_ring brings them back, with done_efd waking the capture thread's epoll
+static frame_ring_t     work_ring, done_ring;
+static sem_t            work_sem;
+static int              done_efd = -1;
+static pthread_t        workers[MAX_WORKERS];
+static buf_pool_t       scratch_pool;   // bigbuffer and one per worker
+
+// -E shares every MMAP buffer as a dmabuf with local processes over a Unix
+// socket (frame_share.h).  Clients together may pin at most half of a
+// camera's buffers; past that frames are not announced, so a stalled client
+// loses frames instead of starving the driver.
+#define MAX_SHARE_CLIENTS 8
+struct share_client
+{
+        int                 fd;         // -1 when the slot is free
+        uint32_t            holds[MAX_CAMERAS];         // buffer bitmaps
+};
+static char            *share_path;
+static int              share_fd = -1;
+static struct share_client share_clients[MAX_SHARE_CLIENTS];
+
+// epoll data: the source kind in the high word, camera or client index below
+#define EV_DONE   (0ULL << 32)
+#define EV_CAMERA (1ULL << 32)
+#define EV_LISTEN (2ULL << 32)
+#define EV_CLIENT (3ULL << 32)
+#define EV_KIND(u) ((u) & ~0xffffffffULL)
+#define EV_INDEX(u) ((unsigned int)(u))
 
 static void errno_exit(const char *s)
 {
@@ -73,6 +221,30 @@ static void errno_exit(const char *s)
         exit(EXIT_FAILURE);
 }
 
+static uint64_t mono_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+
+static void trace_record(enum trace_stage stage, uint64_t from, uint64_t to)
+{
+    if (trace && to >= from)
+        lat_hist_record(&trace_hist[stage], to - from);
+}
+
+
+// Dump writer hook: stamp is the frame's glass time
+static void trace_disk(uint64_t stamp, int ok)
+{
+    if (ok)
+        trace_record(TRACE_GLASS_DISK, stamp, mono_ns());
+}
+
+
 static int xioctl(int fh, int request, void *arg)
 {
         int r;
@@ -86,22 +258,24 @@ static int xioctl(int fh, int request, void *arg)
         return r;
 }
 
-char ppm_header[]="P6\n#9999999999 sec 9999999999 msec \n"HRES_STR" "VRES_STR"\n255\n";
-char ppm_dumpname[]="test00000000.ppm";
-
-static void dump_ppm(const void *p, int size, unsigned int tag, struct timespec *time)
+// Queue name = header + frame on the background writer, or write it here
+// when that is off
+static void dump_file(const struct frame *f, const char *name, const char *header, int hlen, const void *p, int size)
 {
-    int written, i, total, dumpfd;
-   
-    snprintf(&ppm_dumpname[4], 9, "%08d", tag);
-    strncat(&ppm_dumpname[12], ".ppm", 5);
-    dumpfd = open(ppm_dumpname, O_WRONLY | O_NONBLOCK | O_CREAT, 00666);
+    int written, total, dumpfd;
+
+    if (dump_slots > 0)
+    {
+        if (dump_writer_submit(name, header, hlen, p, size, f->t_glass) == 0)
+            printf("queued %d bytes\n", size);
+        else
+            printf("dropped %s\n", name);
+        return;
+    }
+
+    dumpfd = open(name, O_WRONLY | O_NONBLOCK | O_CREAT, 00666);
 
-    snprintf(&ppm_header[4], 11, "%010d", (int)time->tv_sec);
-    strncat(&ppm_header[14], " sec ", 5);
-    snprintf(&ppm_header[19], 11, "%010d", (int)((time->tv_nsec)/1000000));
-    strncat(&ppm_header[29], " msec \n"HRES_STR" "VRES_STR"\n255\n", 19);
-    written=write(dumpfd, ppm_header, sizeof(ppm_header)-1);
+    written=write(dumpfd, header, hlen);
 
     total=0;
 
@@ -114,58 +288,159 @@ static void dump_ppm(const void *p, int size, unsigned int tag, struct timespec
     printf("wrote %d bytes\n", total);
 
     close(dumpfd);
-    
+    trace_disk(f->t_glass, 1);
 }
 
 
-char pgm_header[]="P5\n#9999999999 sec 9999999999 msec \n"HRES_STR" "VRES_STR"\n255\n";
-char pgm_dumpname[]="test00000000.pgm";
+// Append to the -S container, with the driver's sequence and timestamp
+static void store_frame(const struct frame *f, unsigned int pixelformat, int channels, const void *p, int size)
+{
+    frame_record_t rec;
+    const struct v4l2_pix_format *pix = &f->cam->fmt.fmt.pix;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.pixelformat = pixelformat;
+    rec.width = pix->width;
+    rec.height = pix->height;
+    rec.bytesperline = (pixelformat == V4L2_PIX_FMT_GREY && p == f->start) ?
+                       pix->bytesperline : pix->width * channels;
+    rec.sequence = f->buf.sequence;
+    rec.flags = f->buf.flags;
+    rec.ts_sec = f->buf.timestamp.tv_sec;
+    rec.ts_usec = f->buf.timestamp.tv_usec;
+    rec.tag = f->tag;
+    rec.camera = f->cam->index;
+
+    switch (frame_store_append(&store, &rec, p, size, f->t_glass))
+    {
+        case 0:
+            if (dump_slots <= 0)
+                trace_disk(f->t_glass, 1);
+            printf("stored %d bytes\n", size);
+            break;
+        case 1:
+            printf("dropped frame %u\n", f->tag);
+            break;
+        default:
+            printf("ERROR - cannot store frame %u\n", f->tag);
+            break;
+    }
+}
 
-static void dump_pgm(const void *p, int size, unsigned int tag, struct timespec *time)
+
+// Decide on the capture thread, in capture order, whether f repeats the last
+// stored frame; comparing against the stored frame rather than the previous
+// one means a slow drift still gets a frame stored once it adds up
+static void dedup_frame(struct camera *cam, struct frame *f)
 {
-    int written, i, total, dumpfd;
-   
-    snprintf(&pgm_dumpname[4], 9, "%08d", tag);
-    strncat(&pgm_dumpname[12], ".pgm", 5);
-    dumpfd = open(pgm_dumpname, O_WRONLY | O_NONBLOCK | O_CREAT, 00666);
+    const struct v4l2_pix_format *pix = &cam->fmt.fmt.pix;
+    unsigned char sig[LUMA_SIG_SIZE];
+    luma_view_t view;
+
+    f->dup_of = 0;
+    if (dedup_thresh < 0)
+        return;
+
+    if (pix->pixelformat == V4L2_PIX_FMT_GREY)
+        luma_view_grey(&view, f->start, pix->bytesperline, pix->width, pix->height);
+    else if (pix->pixelformat == V4L2_PIX_FMT_YUYV)
+        luma_view_yuyv(&view, f->start, pix->bytesperline, pix->width, pix->height);
+    else
+        return;
+
+    luma_signature(&view, sig);
+    if (cam->dedup_ref && luma_sig_distance(sig, cam->dedup_sig) <= dedup_thresh)
+    {
+        f->dup_of = cam->dedup_ref;
+        cam->dedup_skipped++;
+        return;
+    }
 
-    snprintf(&pgm_header[4], 11, "%010d", (int)time->tv_sec);
-    strncat(&pgm_header[14], " sec ", 5);
-    snprintf(&pgm_header[19], 11, "%010d", (int)((time->tv_nsec)/1000000));
-    strncat(&pgm_header[29], " msec \n"HRES_STR" "VRES_STR"\n255\n", 19);
-    written=write(dumpfd, pgm_header, sizeof(pgm_header)-1);
+    memcpy(cam->dedup_sig, sig, sizeof(sig));
+    cam->dedup_ref = f->tag;
+}
 
-    total=0;
 
-    do
+static void dedup_record(const struct frame *f)
+{
+    frame_record_t rec;
+    const struct v4l2_pix_format *pix = &f->cam->fmt.fmt.pix;
+
+    printf("same as frame %u, not dumped\n", f->dup_of);
+
+    if (!store_path)
     {
-        written=write(dumpfd, p, size);
-        total+=written;
-    } while(total < size);
+        fprintf(dedup_log, "%d %u %u %lld.%06lld %u\n", f->cam->index, f->tag, f->buf.sequence,
+                (long long)f->buf.timestamp.tv_sec, (long long)f->buf.timestamp.tv_usec, f->dup_of);
+        return;
+    }
 
-    printf("wrote %d bytes\n", total);
+    memset(&rec, 0, sizeof(rec));
+    rec.pixelformat = pix->pixelformat;
+    rec.width = pix->width;
+    rec.height = pix->height;
+    rec.sequence = f->buf.sequence;
+    rec.flags = f->buf.flags;
+    rec.ts_sec = f->buf.timestamp.tv_sec;
+    rec.ts_usec = f->buf.timestamp.tv_usec;
+    rec.tag = f->tag;
+    rec.camera = f->cam->index;
+    rec.ref = f->dup_of;
+    if (frame_store_append(&store, &rec, NULL, 0, f->t_glass) == -1)
+        printf("ERROR - cannot store reference for frame %u\n", f->tag);
+}
 
-    close(dumpfd);
-    
+
+// test00000001.pgm, or cam1-test00000001.pgm when capturing from several cameras
+static void dump_name(char *name, size_t len, const struct frame *f, const char *ext)
+{
+    if (n_cameras > 1)
+        snprintf(name, len, "cam%d-test%08d.%s", f->cam->index, f->tag, ext);
+    else
+        snprintf(name, len, "test%08d.%s", f->tag, ext);
 }
 
 
-void yuv2rgb_float(float y, float u, float v, 
-                   unsigned char *r, unsigned char *g, unsigned char *b)
+// Header and name are built on the stack since workers dump concurrently.
+// fourcc is the byte order of p, RGB24 or (-b conversions) BGR24; only the
+// store can record BGR24, -b requires -S.
+static void dump_ppm(const void *p, int size, unsigned int fourcc, const struct frame *f, struct timespec *time)
 {
-    float r_temp, g_temp, b_temp;
+    const struct v4l2_pix_format *pix = &f->cam->fmt.fmt.pix;
+    int hlen;
+    char ppm_header[96], ppm_dumpname[48];
+
+    if (store_path)
+    {
+        store_frame(f, fourcc, 3, p, size);
+        return;
+    }
+   
+    dump_name(ppm_dumpname, sizeof(ppm_dumpname), f, "ppm");
+    hlen = snprintf(ppm_header, sizeof(ppm_header), "P6\n#%010d sec %010d msec \n%d %d\n255\n",
+                    (int)time->tv_sec, (int)((time->tv_nsec)/1000000), pix->width, pix->height);
+
+    dump_file(f, ppm_dumpname, ppm_header, hlen, p, size);
+}
 
-    // R = 1.164(Y-16) + 1.1596(V-128)
-    r_temp = 1.164*(y-16.0) + 1.1596*(v-128.0);  
-    *r = r_temp > 255.0 ? 255 : (r_temp < 0.0 ? 0 : (unsigned char)r_temp);
 
-    // G = 1.164(Y-16) - 0.813*(V-128) - 0.391*(U-128)
-    g_temp = 1.164*(y-16.0) - 0.813*(v-128.0) - 0.391*(u-128.0);
-    *g = g_temp > 255.0 ? 255 : (g_temp < 0.0 ? 0 : (unsigned char)g_temp);
+static void dump_pgm(const void *p, int size, const struct frame *f, struct timespec *time)
+{
+    const struct v4l2_pix_format *pix = &f->cam->fmt.fmt.pix;
+    int hlen;
+    char pgm_header[96], pgm_dumpname[48];
+
+    if (store_path)
+    {
+        store_frame(f, V4L2_PIX_FMT_GREY, 1, p, size);
+        return;
+    }
+   
+    dump_name(pgm_dumpname, sizeof(pgm_dumpname), f, "pgm");
+    hlen = snprintf(pgm_header, sizeof(pgm_header), "P5\n#%010d sec %010d msec \n%d %d\n255\n",
+                    (int)time->tv_sec, (int)((time->tv_nsec)/1000000), pix->width, pix->height);
 
-    // B = 1.164*(Y-16) + 2.018*(U-128)
-    b_temp = 1.164*(y-16.0) + 2.018*(u-128.0);
-    *b = b_temp > 255.0 ? 255 : (b_temp < 0.0 ? 0 : (unsigned char)b_temp);
+    dump_file(f, pgm_dumpname, pgm_header, hlen, p, size);
 }
 
 
@@ -183,6 +458,9 @@ void yuv2rgb_float(float y, float u, float v,
 //      YUV422, which we assume here, where there are 2 bytes for each pixel, with two Y samples for one U & V,
 //              or as the name implies, 4Y and 2 UV pairs
 //      YUV420, where for every 4 Ys, there is a single UV pair, 1.5 bytes for each pixel or 36 bytes for 24 pixels
+//
+// yuyv_to_rgb() (yuv_convert.c) is the vectorized form used by process_image(), and is bit-identical
+// to this with the default BT.601 limited range coefficients.
 
 void yuv2rgb(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b)
 {
@@ -212,21 +490,71 @@ void yuv2rgb(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned c
 
 
 
-unsigned int framecnt=0;
-unsigned char bigbuffer[(1280*960)];
+unsigned char *bigbuffer;      // width*height*3 of the largest camera, for processing on the capture thread
+
+// Grayscale paths read luma through a view of the capture buffer, so GREY
+// dumps as-is and YUYV is only packed (SIMD deinterleave) for the plain dump.
+static void process_luma(const struct frame *f, unsigned char *bigbuffer, struct timespec *frame_time)
+{
+    const struct v4l2_pix_format *pix = &f->cam->fmt.fmt.pix;
+    const void *p = f->start;
+    int size = f->size;
+    int w = pix->width, h = pix->height;
+    luma_view_t view;
+
+    if (pix->pixelformat == V4L2_PIX_FMT_GREY)
+        luma_view_grey(&view, p, pix->bytesperline, w, h);
+    else
+        luma_view_yuyv(&view, p, pix->bytesperline, w, h);
+
+    switch (luma_op)
+    {
+        case LUMA_SOBEL:
+            printf("Dump Sobel of luma size %d\n", w*h);
+            luma_sobel(&view, bigbuffer, w);
+            break;
+
+        case LUMA_THRESHOLD:
+            printf("Dump luma > %d size %d\n", luma_thresh, w*h);
+            luma_threshold(&view, luma_thresh, bigbuffer, w);
+            break;
+
+        default:
+            if (view.step == 1)
+            {
+                printf("Dump graymap as-is size %d\n", size);
+                dump_pgm(p, size, f, frame_time);
+                return;
+            }
+            // Pixels are YU and YV alternating, so YUYV which is 4 bytes
+            // We want Y, so YY which is 2 bytes
+            //
+            printf("Dump YUYV converted to YY size %d\n", size);
+            luma_extract(&view, bigbuffer, w);
+            break;
+    }
+
+    dump_pgm(bigbuffer, w*h, f, frame_time);
+}
 
-static void process_image(const void *p, int size)
+
+// Convert and dump one frame.  f->tag numbers the dump, bigbuffer is the
+// caller's scratch space (every worker has its own).
+static void process_image(const struct frame *f, unsigned char *bigbuffer)
 {
-    int i, newi, newsize=0;
+    const struct v4l2_pix_format *pix = &f->cam->fmt.fmt.pix;
+    const void *p = f->start;
+    int size = f->size;
+    unsigned int tag = f->tag;
     struct timespec frame_time;
-    int y_temp, y2_temp, u_temp, v_temp;
-    unsigned char *pptr = (unsigned char *)p;
+    uint64_t t_start = mono_ns(), t_end;
 
     // record when process was called
     clock_gettime(CLOCK_REALTIME, &frame_time);    
 
-    framecnt++;
-    printf("frame %d: ", framecnt);
+    if (n_cameras > 1)
+        printf("%s ", f->cam->dev_name);
+    printf("frame %d: ", tag);
 
     // This just dumps the frame to a file now, but you could replace with whatever image
     // processing you wish.
@@ -234,13 +562,17 @@ static void process_image(const void *p, int size)
 
 	
 
-    if(fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_GREY)
+    if (f->dup_of)
     {
-        printf("Dump graymap as-is size %d\n", size);
-        dump_pgm(p, size, framecnt, &frame_time);
+        dedup_record(f);
     }
 
-    else if(fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV)
+    else if(pix->pixelformat == V4L2_PIX_FMT_GREY)
+    {
+        process_luma(f, bigbuffer, &frame_time);
+    }
+
+    else if(pix->pixelformat == V4L2_PIX_FMT_YUYV)
     {
 
 #if defined(COLOR_CONVERT)
@@ -249,58 +581,364 @@ static void process_image(const void *p, int size)
         // Pixels are YU and YV alternating, so YUYV which is 4 bytes
         // We want RGB, so RGBRGB which is 6 bytes
         //
-        for(i=0, newi=0; i<size; i=i+4, newi=newi+6)
-        {
-            y_temp=(int)pptr[i]; u_temp=(int)pptr[i+1]; y2_temp=(int)pptr[i+2]; v_temp=(int)pptr[i+3];			
-            yuv2rgb_float(y_temp, u_temp, v_temp, &bigbuffer[newi], &bigbuffer[newi+1], &bigbuffer[newi+2]);
-			yuv2rgb_float(y2_temp, u_temp, v_temp, &bigbuffer[newi+3], &bigbuffer[newi+4], &bigbuffer[newi+5]);
-        }
+        yuyv_to_rgb(p, pix->bytesperline, bigbuffer, pix->width, pix->height,
+                    &yuv_coef, convert_threads);
 
-        dump_ppm(bigbuffer, ((size*6)/4), framecnt, &frame_time);
+        dump_ppm(bigbuffer, pix->width * pix->height * 3,
+                 yuv_coef.bgr ? V4L2_PIX_FMT_BGR24 : V4L2_PIX_FMT_RGB24, f, &frame_time);
 #else
-        printf("Dump YUYV converted to YY size %d\n", size);
-       
-        // Pixels are YU and YV alternating, so YUYV which is 4 bytes
-        // We want Y, so YY which is 2 bytes
-        //
-        for(i=0, newi=0; i<size; i=i+4, newi=newi+2)
-        {
-            // Y1=first byte and Y2=third byte
-            bigbuffer[newi]=pptr[i];
-            bigbuffer[newi+1]=pptr[i+2];
-        }
-
-        dump_pgm(bigbuffer, (size/2), framecnt, &frame_time);
+        process_luma(f, bigbuffer, &frame_time);
 #endif
 
     }
 
-    else if(fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_RGB24)
+    else if(pix->pixelformat == V4L2_PIX_FMT_RGB24)
     {
         printf("Dump RGB as-is size %d\n", size);
-        dump_ppm(p, size, framecnt, &frame_time);
+        dump_ppm(p, size, pix->pixelformat, f, &frame_time);
     }
     else
     {
         printf("ERROR - unknown dump format\n");
     }
 
+    t_end = mono_ns();
+    trace_record(TRACE_DQBUF_START, f->t_dqbuf, t_start);
+    trace_record(TRACE_PROCESS, t_start, t_end);
+    trace_record(TRACE_GLASS_PROCESSED, f->t_glass, t_end);
+    if (trace_csv)
+        fprintf(trace_csv, "%d,%u,%u,%llu,%llu,%llu,%llu\n", f->cam->index, f->tag, f->buf.sequence,
+                (unsigned long long)f->t_glass, (unsigned long long)f->t_dqbuf,
+                (unsigned long long)t_start, (unsigned long long)t_end);
+
     fflush(stderr);
     //fprintf(stderr, ".");
     fflush(stdout);
 }
 
 
-static int read_frame(void)
+// Stamp a frame just dequeued and count the frames the driver skipped.  The
+// driver's timestamp is only comparable when it is CLOCK_MONOTONIC (UVC and
+// vivid are); otherwise glass falls back to the DQBUF time.
+static void frame_stamp(struct camera *cam, struct frame *f)
+{
+    unsigned int gap;
+
+    f->t_dqbuf = mono_ns();
+
+    cam->glass_ok = (f->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    if (cam->glass_ok)
+        f->t_glass = (uint64_t)f->buf.timestamp.tv_sec*1000000000ULL + f->buf.timestamp.tv_usec*1000ULL;
+    else
+        f->t_glass = f->t_dqbuf;
+    trace_record(TRACE_GLASS_DQBUF, f->t_glass, f->t_dqbuf);
+
+    // Sequence counts every frame the sensor produced, dequeued or not
+    gap = f->buf.sequence - cam->last_seq - 1;
+    if (f->tag > 1 && gap < (1U << 31))
+        cam->seq_lost += gap;
+    cam->last_seq = f->buf.sequence;
+}
+
+
+// DQBUF one filled buffer (MMAP or USERPTR).  NULL when none is ready yet.
+static struct frame *dequeue_frame(struct camera *cam)
 {
     struct v4l2_buffer buf;
     unsigned int i;
 
+    CLEAR(buf);
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = (io == IO_METHOD_MMAP) ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+
+    if (-1 == xioctl(cam->fd, VIDIOC_DQBUF, &buf))
+    {
+        switch (errno)
+        {
+            case EAGAIN:
+                return NULL;
+
+            case EIO:
+                /* Could ignore EIO, but drivers should only set for serious errors, although some set for
+                   non-fatal errors too.
+                 */
+                if (io == IO_METHOD_MMAP)
+                    return NULL;
+
+                /* fall through */
+
+            default:
+                printf("%s failure\n", (io == IO_METHOD_MMAP) ? "mmap" : "userptr");
+                errno_exit("VIDIOC_DQBUF");
+        }
+    }
+
+    if (io == IO_METHOD_MMAP)
+    {
+        i = buf.index;
+        assert(i < cam->n_buffers);
+    }
+    else
+    {
+        for (i = 0; i < cam->n_buffers; ++i)
+                if (buf.m.userptr == (unsigned long)cam->buffers[i].start
+                    && buf.length == cam->buffers[i].length)
+                        break;
+
+        assert(i < cam->n_buffers);
+    }
+
+    cam->frames[i].cam = cam;
+    cam->frames[i].buf = buf;
+    cam->frames[i].start = cam->buffers[i].start;
+    cam->frames[i].size = buf.bytesused;
+    cam->frames[i].tag = ++cam->framecnt;
+    cam->frames[i].refs = 1;
+    cam->frames[i].clients = 0;
+    frame_stamp(cam, &cam->frames[i]);
+    return &cam->frames[i];
+}
+
+
+static void requeue_frame(struct frame *f)
+{
+    if (-1 == xioctl(f->cam->fd, VIDIOC_QBUF, &f->buf))
+            errno_exit("VIDIOC_QBUF");
+}
+
+
+// Drop one reference, processing's or a share client's; the last one hands
+// the buffer back to the driver while the camera still has frames to capture
+static void frame_put(struct frame *f)
+{
+    if (--f->refs == 0 && f->cam->remaining > 0)
+        requeue_frame(f);
+}
+
+
+// Announce a dequeued frame to every share client, each holding a reference
+static void share_frame(struct frame *f)
+{
+    struct camera *cam = f->cam;
+    frame_share_msg_t m;
+    int i;
+
+    if (share_fd == -1 || cam->shared >= cam->n_buffers/2)
+        return;
+
+    memset(&m, 0, sizeof(m));
+    m.type = SHARE_FRAME;
+    m.camera = cam->index;
+    m.index = f->buf.index;
+    m.bytesused = f->buf.bytesused;
+    m.sequence = f->buf.sequence;
+    m.ts_sec = f->buf.timestamp.tv_sec;
+    m.ts_usec = f->buf.timestamp.tv_usec;
+
+    // A client whose socket is full just misses this frame
+    for (i = 0; i < MAX_SHARE_CLIENTS; i++)
+    {
+        if (share_clients[i].fd == -1 || frame_share_send(share_clients[i].fd, &m, NULL, 0) == -1)
+            continue;
+        share_clients[i].holds[cam->index] |= 1u << f->buf.index;
+        f->clients++;
+        f->refs++;
+    }
+
+    if (f->clients)
+        cam->shared++;
+}
+
+
+static void share_release(struct share_client *c, unsigned int camera, unsigned int index)
+{
+    struct frame *f;
+
+    if (camera >= (unsigned int)n_cameras || index >= cameras[camera].n_buffers ||
+        !(c->holds[camera] & (1u << index)))
+    {
+        fprintf(stderr, "share: bogus release of camera %u buffer %u\n", camera, index);
+        return;
+    }
+
+    c->holds[camera] &= ~(1u << index);
+    f = &cameras[camera].frames[index];
+    if (--f->clients == 0)
+        cameras[camera].shared--;
+    frame_put(f);
+}
+
+
+// A client that hangs up (or dies) implicitly releases everything it held
+static void share_drop(struct share_client *c)
+{
+    unsigned int i;
+    int cam;
+
+    for (cam = 0; cam < n_cameras; cam++)
+        for (i = 0; i < cameras[cam].n_buffers; i++)
+            if (c->holds[cam] & (1u << i))
+                share_release(c, cam, i);
+
+    close(c->fd);
+    c->fd = -1;
+}
+
+
+// New client: one HELLO per camera with its format and dmabuf fds
+static void share_accept(int epfd)
+{
+    struct epoll_event ev;
+    struct share_client *c = NULL;
+    frame_share_msg_t m;
+    struct v4l2_pix_format *pix;
+    int fd, i;
+
+    while ((fd = frame_share_accept(share_fd)) != -1)
+    {
+        for (i = 0; i < MAX_SHARE_CLIENTS; i++)
+            if (share_clients[i].fd == -1)
+                break;
+
+        if (i == MAX_SHARE_CLIENTS)
+        {
+            fprintf(stderr, "share: more than %d clients, refused\n", MAX_SHARE_CLIENTS);
+            close(fd);
+            continue;
+        }
+
+        c = &share_clients[i];
+        c->fd = fd;
+        memset(c->holds, 0, sizeof(c->holds));
+
+        for (i = 0; i < n_cameras; i++)
+        {
+            pix = &cameras[i].fmt.fmt.pix;
+            memset(&m, 0, sizeof(m));
+            m.type = SHARE_HELLO;
+            m.camera = i;
+            m.n_cameras = n_cameras;
+            m.n_buffers = cameras[i].n_buffers;
+            m.length = cameras[i].buffers[0].length;
+            m.width = pix->width;
+            m.height = pix->height;
+            m.bytesperline = pix->bytesperline;
+            m.pixelformat = pix->pixelformat;
+            if (frame_share_send(fd, &m, cameras[i].dmabuf, cameras[i].n_buffers) == -1)
+                break;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_CLIENT | (c - share_clients);
+        if (i < n_cameras || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            perror("share: client setup");
+            share_drop(c);
+        }
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("share: accept");
+}
+
+
+static void share_input(struct share_client *c, uint32_t events)
+{
+    frame_share_msg_t m;
+    int r;
+
+    while ((r = frame_share_recv(c->fd, &m, NULL, NULL)) == 1)
+        if (m.type == SHARE_RELEASE)
+            share_release(c, m.camera, m.index);
+
+    if (r == 0 || (r == -1 && errno != EAGAIN) || (events & (EPOLLHUP | EPOLLERR)))
+        share_drop(c);
+}
+
+
+static void start_sharing(void)
+{
+    unsigned int j;
+    int i;
+
+    if (!share_path)
+        return;
+
+    if (io != IO_METHOD_MMAP)
+    {
+        fprintf(stderr, "-E needs memory mapped (-m) buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < MAX_SHARE_CLIENTS; i++)
+        share_clients[i].fd = -1;
+
+    for (i = 0; i < n_cameras; i++)
+    {
+        if (cameras[i].n_buffers > FRAME_SHARE_MAX_FDS)
+        {
+            fprintf(stderr, "-E shares at most %d buffers per camera\n", FRAME_SHARE_MAX_FDS);
+            exit(EXIT_FAILURE);
+        }
+
+        cameras[i].dmabuf = malloc(cameras[i].n_buffers * sizeof(int));
+        if (!cameras[i].dmabuf)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (j = 0; j < cameras[i].n_buffers; j++)
+            if ((cameras[i].dmabuf[j] = frame_share_export(cameras[i].fd, j)) == -1)
+                errno_exit("VIDIOC_EXPBUF");
+    }
+
+    if ((share_fd = frame_share_listen(share_path)) == -1)
+        errno_exit(share_path);
+}
+
+
+// After STREAMOFF: the driver owns nothing any more, clients keep their
+// mappings (a dmabuf outlives its exporter's fd) until they close them
+static void stop_sharing(void)
+{
+    unsigned int j;
+    int i;
+
+    if (share_fd == -1)
+        return;
+
+    for (i = 0; i < MAX_SHARE_CLIENTS; i++)
+        if (share_clients[i].fd != -1)
+        {
+            close(share_clients[i].fd);
+            share_clients[i].fd = -1;
+        }
+
+    close(share_fd);
+    share_fd = -1;
+    unlink(share_path);
+
+    for (i = 0; i < n_cameras; i++)
+    {
+        for (j = 0; j < cameras[i].n_buffers; j++)
+            close(cameras[i].dmabuf[j]);
+        free(cameras[i].dmabuf);
+    }
+}
+
+
+// Capture and process on the calling thread (-w 0, and always for read())
+static int read_frame(struct camera *cam)
+{
+    struct frame *f, rf;
+
     switch (io)
     {
 
         case IO_METHOD_READ:
-            if (-1 == read(fd, buffers[0].start, buffers[0].length))
+            if (-1 == read(cam->fd, cam->buffers[0].start, cam->buffers[0].length))
             {
                 switch (errno)
                 {
@@ -318,146 +956,308 @@ static int read_frame(void)
                 }
             }
 
-            process_image(buffers[0].start, buffers[0].length);
+            // read() has no v4l2_buffer; number and stamp the frame here
+            CLEAR(rf);
+            rf.cam = cam;
+            rf.start = cam->buffers[0].start;
+            rf.size = cam->buffers[0].length;
+            rf.tag = ++cam->framecnt;
+            rf.buf.sequence = cam->framecnt - 1;
+            gettimeofday(&rf.buf.timestamp, NULL);
+            frame_stamp(cam, &rf);
+            dedup_frame(cam, &rf);
+            process_image(&rf, bigbuffer);
             break;
 
         case IO_METHOD_MMAP:
-            CLEAR(buf);
+        case IO_METHOD_USERPTR:
+            if ((f = dequeue_frame(cam)) == NULL)
+                return 0;
 
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_MMAP;
+            share_frame(f);
+            dedup_frame(cam, f);
+            process_image(f, bigbuffer);
+            frame_put(f);
+            break;
+    }
 
-            if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-            {
-                switch (errno)
-                {
-                    case EAGAIN:
-                        return 0;
+    //printf("R");
+    return 1;
+}
 
-                    case EIO:
-                        /* Could ignore EIO, but drivers should only set for serious errors, although some set for
-                           non-fatal errors too.
-                         */
-                        return 0;
 
+// Largest processing output over all cameras, an RGB frame
+static size_t max_frame_bytes(void)
+{
+    size_t n, max = 0;
+    int i;
 
-                    default:
-                        printf("mmap failure\n");
-                        errno_exit("VIDIOC_DQBUF");
-                }
-            }
+    for (i = 0; i < n_cameras; i++)
+    {
+        n = (size_t)cameras[i].fmt.fmt.pix.width * cameras[i].fmt.fmt.pix.height * 3;
+        if (n < cameras[i].fmt.fmt.pix.sizeimage)
+            n = cameras[i].fmt.fmt.pix.sizeimage;
+        if (n > max)
+            max = n;
+    }
 
-            assert(buf.index < n_buffers);
+    return max;
+}
+
+
+// arg is this worker's scratch buffer
+static void *process_worker(void *arg)
+{
+    unsigned char *scratch = arg;
+    struct frame *f;
+    uint64_t one = 1;
 
-            process_image(buffers[buf.index].start, buf.bytesused);
+    for (;;)
+    {
+        while (sem_wait(&work_sem) == -1 && errno == EINTR)
+            ;
 
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-                    errno_exit("VIDIOC_QBUF");
+        // Every post matches one push, so the pop cannot miss
+        if (frame_ring_pop(&work_ring, (void **)&f) == -1 || f == NULL)
             break;
 
-        case IO_METHOD_USERPTR:
-            CLEAR(buf);
+        process_image(f, scratch);
 
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_USERPTR;
+        frame_ring_push(&done_ring, f);
+        if (write(done_efd, &one, sizeof(one)) != sizeof(one))
+            perror("eventfd write");
+    }
 
-            if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-            {
-                switch (errno)
-                {
-                    case EAGAIN:
-                        return 0;
+    return NULL;
+}
 
-                    case EIO:
-                        /* Could ignore EIO, see spec. */
 
-                        /* fall through */
+static void start_workers(void)
+{
+    unsigned int total = 0;
+    int i;
 
-                    default:
-                        errno_exit("VIDIOC_DQBUF");
-                }
-            }
+    if (io == IO_METHOD_READ)
+        n_workers = 0;
 
-            for (i = 0; i < n_buffers; ++i)
-                    if (buf.m.userptr == (unsigned long)buffers[i].start
-                        && buf.length == buffers[i].length)
-                            break;
+    // Processing output goes to pinned memory too, faulted in before the
+    // first frame rather than on it
+    if (buf_pool_create(&scratch_pool, max_frame_bytes(), n_workers + 1) == -1)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    bigbuffer = buf_pool_block(&scratch_pool, 0);
 
-            assert(i < n_buffers);
+    // dequeue_frame() fills these on the inline path too
+    for (i = 0; i < n_cameras; i++)
+    {
+        cameras[i].frames = calloc(cameras[i].n_buffers, sizeof(struct frame));
+        if (!cameras[i].frames)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        total += cameras[i].n_buffers;
+    }
 
-            process_image((void *)buf.m.userptr, buf.bytesused);
+    if (n_workers == 0)
+        return;
 
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-                    errno_exit("VIDIOC_QBUF");
-            break;
+    // Only the cameras' buffers exist as frames, plus one stop marker per worker
+    if (frame_ring_init(&work_ring, total + n_workers) == -1 ||
+        frame_ring_init(&done_ring, total) == -1)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
     }
 
-    //printf("R");
-    return 1;
+    if (sem_init(&work_sem, 0, 0) == -1)
+        errno_exit("sem_init");
+
+    if ((done_efd = eventfd(0, EFD_NONBLOCK)) == -1)
+        errno_exit("eventfd");
+
+    for (i = 0; i < n_workers; i++)
+        if (pthread_create(&workers[i], NULL, process_worker, buf_pool_block(&scratch_pool, i + 1)) != 0)
+            errno_exit("pthread_create");
 }
 
 
+static void stop_workers(void)
+{
+    int i;
+
+    for (i = 0; i < n_workers; i++)
+    {
+        frame_ring_push(&work_ring, NULL);
+        sem_post(&work_sem);
+    }
+
+    for (i = 0; i < n_workers; i++)
+        pthread_join(workers[i], NULL);
+
+    if (n_workers)
+    {
+        frame_ring_destroy(&work_ring);
+        frame_ring_destroy(&done_ring);
+        sem_destroy(&work_sem);
+        close(done_efd);
+    }
+    for (i = 0; i < n_cameras; i++)
+        free(cameras[i].frames);
+    buf_pool_destroy(&scratch_pool);
+}
+
+
+// A camera leaves the epoll set once it has captured its count, so a finished
+// device that keeps streaming cannot spin the loop
+static void camera_done(int epfd, struct camera *cam)
+{
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, cam->fd, NULL) == -1)
+        errno_exit("epoll_ctl");
+}
+
+
+// The capture thread never processes (unless -w 0): it dequeues from whichever
+// camera has a filled buffer and requeues whatever the workers have finished,
+// so a slow dump only delays the buffers it holds rather than the whole queue,
+// and one camera's stall never holds up another's.  With the vivid test driver
+// (modprobe vivid n_devs=4) this runs every device at full sensor rate:
+//   ./capture -d /dev/video0 -d /dev/video1 -d /dev/video2 -d /dev/video3 -w 4 -c 300
+// Share clients' releases come in on the same loop, so frame references are
+// only ever touched by this thread.
+#define MAX_EVENTS (MAX_CAMERAS + MAX_SHARE_CLIENTS + 2)
 static void mainloop(void)
 {
-    unsigned int count;
-    struct timespec read_delay;
-    struct timespec time_error;
+    struct epoll_event ev, events[MAX_EVENTS];
+    unsigned int capturing = 0, outstanding = 0;
+    struct camera *cam;
+    struct frame *f;
+    uint64_t done;
+    int epfd, i, n;
 
-    read_delay.tv_sec=0;
-    read_delay.tv_nsec=30000;
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        errno_exit("epoll_create1");
 
-    count = frame_count;
+    for (i = 0; i < n_cameras; i++)
+    {
+        cam = &cameras[i];
+        cam->remaining = frame_count;
+        cam->outstanding = 0;
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_CAMERA | i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, cam->fd, &ev) == -1)
+            errno_exit("epoll_ctl");
+        if (cam->remaining > 0)
+            capturing++;
+        else
+            camera_done(epfd, cam);
+    }
 
-    while (count > 0)
+    if (n_workers)
     {
-        for (;;)
-        {
-            fd_set fds;
-            struct timeval tv;
-            int r;
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_DONE;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, done_efd, &ev) == -1)
+            errno_exit("epoll_ctl");
+    }
 
-            FD_ZERO(&fds);
-            FD_SET(fd, &fds);
+    if (share_fd != -1)
+    {
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_LISTEN;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, share_fd, &ev) == -1)
+            errno_exit("epoll_ctl");
+    }
 
-            /* Timeout. */
-            tv.tv_sec = 2;
-            tv.tv_usec = 0;
+    while (capturing > 0 || outstanding > 0)
+    {
+        /* Timeout. */
+        n = epoll_wait(epfd, events, MAX_EVENTS, 2000);
+
+        if (-1 == n)
+        {
+            if (EINTR == errno)
+                continue;
+            errno_exit("epoll_wait");
+        }
 
-            r = select(fd + 1, &fds, NULL, NULL, &tv);
+        if (0 == n)
+        {
+            fprintf(stderr, "epoll timeout\n");
+            exit(EXIT_FAILURE);
+        }
 
-            if (-1 == r)
+        // Finished and released frames go back to their driver first so it
+        // never runs dry
+        for (i = 0; i < n; i++)
+        {
+            switch (EV_KIND(events[i].data.u64))
             {
-                if (EINTR == errno)
-                    continue;
-                errno_exit("select");
+                case EV_DONE:
+                    if (read(done_efd, &done, sizeof(done)) != sizeof(done) && errno != EAGAIN)
+                        errno_exit("eventfd read");
+
+                    while (frame_ring_pop(&done_ring, (void **)&f) == 0)
+                    {
+                        outstanding--;
+                        f->cam->outstanding--;
+                        frame_put(f);
+                    }
+                    break;
+
+                case EV_LISTEN:
+                    share_accept(epfd);
+                    break;
+
+                case EV_CLIENT:
+                    share_input(&share_clients[EV_INDEX(events[i].data.u64)], events[i].events);
+                    break;
             }
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (EV_KIND(events[i].data.u64) != EV_CAMERA)
+                continue;
+
+            cam = &cameras[EV_INDEX(events[i].data.u64)];
+            if (cam->remaining == 0)
+                continue;
 
-            if (0 == r)
+            if (n_workers == 0)
             {
-                fprintf(stderr, "select timeout\n");
-                exit(EXIT_FAILURE);
+                /* EAGAIN - wait again unless count done. */
+                if (read_frame(cam))
+                    cam->remaining--;
+            }
+            else
+            {
+                while (cam->remaining > 0 && (f = dequeue_frame(cam)) != NULL)
+                {
+                    share_frame(f);
+                    dedup_frame(cam, f);
+                    frame_ring_push(&work_ring, f);
+                    sem_post(&work_sem);
+                    outstanding++;
+                    cam->outstanding++;
+                    cam->remaining--;
+                }
             }
 
-            if (read_frame())
+            if (cam->remaining == 0)
             {
-                if(nanosleep(&read_delay, &time_error) != 0)
-                    perror("nanosleep");
-                else
-                    printf("time_error.tv_sec=%ld, time_error.tv_nsec=%ld\n", time_error.tv_sec, time_error.tv_nsec);
-
-                count--;
-                break;
+                camera_done(epfd, cam);
+                capturing--;
             }
-
-            /* EAGAIN - continue select loop unless count done. */
-            if(count <= 0) break;
         }
-
-        if(count <= 0) break;
     }
+
+    close(epfd);
 }
 
-static void stop_capturing(void)
+static void stop_capturing(struct camera *cam)
 {
         enum v4l2_buf_type type;
 
@@ -469,13 +1269,13 @@ static void stop_capturing(void)
         case IO_METHOD_MMAP:
         case IO_METHOD_USERPTR:
                 type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
+                if (-1 == xioctl(cam->fd, VIDIOC_STREAMOFF, &type))
                         errno_exit("VIDIOC_STREAMOFF");
                 break;
         }
 }
 
-static void start_capturing(void)
+static void start_capturing(struct camera *cam)
 {
         unsigned int i;
         enum v4l2_buf_type type;
@@ -488,7 +1288,7 @@ static void start_capturing(void)
                 break;
 
         case IO_METHOD_MMAP:
-                for (i = 0; i < n_buffers; ++i) 
+                for (i = 0; i < cam->n_buffers; ++i) 
                 {
                         printf("allocated buffer %d\n", i);
                         struct v4l2_buffer buf;
@@ -498,95 +1298,94 @@ static void start_capturing(void)
                         buf.memory = V4L2_MEMORY_MMAP;
                         buf.index = i;
 
-                        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+                        if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &buf))
                                 errno_exit("VIDIOC_QBUF");
                 }
                 type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+                if (-1 == xioctl(cam->fd, VIDIOC_STREAMON, &type))
                         errno_exit("VIDIOC_STREAMON");
                 break;
 
         case IO_METHOD_USERPTR:
-                for (i = 0; i < n_buffers; ++i) {
+                for (i = 0; i < cam->n_buffers; ++i) {
                         struct v4l2_buffer buf;
 
                         CLEAR(buf);
                         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
                         buf.memory = V4L2_MEMORY_USERPTR;
                         buf.index = i;
-                        buf.m.userptr = (unsigned long)buffers[i].start;
-                        buf.length = buffers[i].length;
+                        buf.m.userptr = (unsigned long)cam->buffers[i].start;
+                        buf.length = cam->buffers[i].length;
 
-                        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+                        if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &buf))
                                 errno_exit("VIDIOC_QBUF");
                 }
                 type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+                if (-1 == xioctl(cam->fd, VIDIOC_STREAMON, &type))
                         errno_exit("VIDIOC_STREAMON");
                 break;
         }
 }
 
-static void uninit_device(void)
+static void uninit_device(struct camera *cam)
 {
         unsigned int i;
 
         switch (io) {
         case IO_METHOD_READ:
-                free(buffers[0].start);
+                free(cam->buffers[0].start);
                 break;
 
         case IO_METHOD_MMAP:
-                for (i = 0; i < n_buffers; ++i)
-                        if (-1 == munmap(buffers[i].start, buffers[i].length))
+                for (i = 0; i < cam->n_buffers; ++i)
+                        if (-1 == munmap(cam->buffers[i].start, cam->buffers[i].length))
                                 errno_exit("munmap");
                 break;
 
         case IO_METHOD_USERPTR:
-                for (i = 0; i < n_buffers; ++i)
-                        free(buffers[i].start);
+                buf_pool_destroy(&cam->pool);
                 break;
         }
 
-        free(buffers);
+        free(cam->buffers);
 }
 
-static void init_read(unsigned int buffer_size)
+static void init_read(struct camera *cam, unsigned int buffer_size)
 {
-        buffers = calloc(1, sizeof(*buffers));
+        cam->buffers = calloc(1, sizeof(*cam->buffers));
 
-        if (!buffers) 
+        if (!cam->buffers) 
         {
                 fprintf(stderr, "Out of memory\n");
                 exit(EXIT_FAILURE);
         }
 
-        buffers[0].length = buffer_size;
-        buffers[0].start = malloc(buffer_size);
+        cam->buffers[0].length = buffer_size;
+        cam->buffers[0].start = malloc(buffer_size);
 
-        if (!buffers[0].start) 
+        if (!cam->buffers[0].start) 
         {
                 fprintf(stderr, "Out of memory\n");
                 exit(EXIT_FAILURE);
         }
 }
 
-static void init_mmap(void)
+static void init_mmap(struct camera *cam)
 {
         struct v4l2_requestbuffers req;
 
         CLEAR(req);
 
-        req.count = 6;
+        req.count = req_buffers ? req_buffers : 6;
         req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         req.memory = V4L2_MEMORY_MMAP;
 
-        if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) 
+        if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &req)) 
         {
                 if (EINVAL == errno) 
                 {
                         fprintf(stderr, "%s does not support "
-                                 "memory mapping\n", dev_name);
+                                 "memory mapping\n", cam->dev_name);
                         exit(EXIT_FAILURE);
                 } else 
                 {
@@ -596,93 +1395,312 @@ static void init_mmap(void)
 
         if (req.count < 2) 
         {
-                fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name);
+                fprintf(stderr, "Insufficient buffer memory on %s\n", cam->dev_name);
                 exit(EXIT_FAILURE);
         }
 
-        buffers = calloc(req.count, sizeof(*buffers));
+        cam->buffers = calloc(req.count, sizeof(*cam->buffers));
 
-        if (!buffers) 
+        if (!cam->buffers) 
         {
                 fprintf(stderr, "Out of memory\n");
                 exit(EXIT_FAILURE);
         }
 
-        for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+        for (cam->n_buffers = 0; cam->n_buffers < req.count; ++cam->n_buffers) {
                 struct v4l2_buffer buf;
 
                 CLEAR(buf);
 
                 buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
                 buf.memory      = V4L2_MEMORY_MMAP;
-                buf.index       = n_buffers;
+                buf.index       = cam->n_buffers;
 
-                if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
+                if (-1 == xioctl(cam->fd, VIDIOC_QUERYBUF, &buf))
                         errno_exit("VIDIOC_QUERYBUF");
 
-                buffers[n_buffers].length = buf.length;
-                buffers[n_buffers].start =
+                cam->buffers[cam->n_buffers].length = buf.length;
+                cam->buffers[cam->n_buffers].start =
                         mmap(NULL /* start anywhere */,
                               buf.length,
                               PROT_READ | PROT_WRITE /* required */,
                               MAP_SHARED /* recommended */,
-                              fd, buf.m.offset);
+                              cam->fd, buf.m.offset);
 
-                if (MAP_FAILED == buffers[n_buffers].start)
+                if (MAP_FAILED == cam->buffers[cam->n_buffers].start)
                         errno_exit("mmap");
         }
 }
 
-static void init_userp(unsigned int buffer_size)
+static void init_userp(struct camera *cam, unsigned int buffer_size)
 {
         struct v4l2_requestbuffers req;
 
         CLEAR(req);
 
-        req.count  = 4;
+        req.count  = req_buffers ? req_buffers : 4;
         req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         req.memory = V4L2_MEMORY_USERPTR;
 
-        if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+        if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &req)) {
                 if (EINVAL == errno) {
                         fprintf(stderr, "%s does not support "
-                                 "user pointer i/o\n", dev_name);
+                                 "user pointer i/o\n", cam->dev_name);
                         exit(EXIT_FAILURE);
                 } else {
                         errno_exit("VIDIOC_REQBUFS");
                 }
         }
 
-        buffers = calloc(4, sizeof(*buffers));
+        // The driver may adjust the count, as for MMAP
+        cam->buffers = calloc(req.count, sizeof(*cam->buffers));
+
+        if (!cam->buffers) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+        }
 
-        if (!buffers) {
+        // One pinned, pre-faulted pool for all of them, see buf_pool.h
+        if (buf_pool_create(&cam->pool, buffer_size, req.count) == -1) {
                 fprintf(stderr, "Out of memory\n");
                 exit(EXIT_FAILURE);
         }
+        printf("%s: %u userptr buffers in %s\n", cam->dev_name, req.count, buf_pool_describe(&cam->pool));
 
-        for (n_buffers = 0; n_buffers < 4; ++n_buffers) {
-                buffers[n_buffers].length = buffer_size;
-                buffers[n_buffers].start = malloc(buffer_size);
+        for (cam->n_buffers = 0; cam->n_buffers < req.count; ++cam->n_buffers) {
+                cam->buffers[cam->n_buffers].length = buffer_size;
+                cam->buffers[cam->n_buffers].start = buf_pool_block(&cam->pool, cam->n_buffers);
+        }
+}
 
-                if (!buffers[n_buffers].start) {
-                        fprintf(stderr, "Out of memory\n");
-                        exit(EXIT_FAILURE);
-                }
+// Bytes per pixel of the formats process_image() understands, 0 otherwise
+static unsigned int format_bpp(unsigned int fourcc)
+{
+    switch (fourcc)
+    {
+        case V4L2_PIX_FMT_GREY:
+            return 1;
+        case V4L2_PIX_FMT_YUYV:
+            return 2;
+        case V4L2_PIX_FMT_RGB24:
+            return 3;
+    }
+    return 0;
+}
+
+
+// Formats the configured processing can take: colour when COLOR_CONVERT
+// produces RGB, anything with a luma plane otherwise
+static int format_usable(unsigned int fourcc)
+{
+#if defined(COLOR_CONVERT)
+    if (fourcc == V4L2_PIX_FMT_GREY)
+        return 0;
+#endif
+    return format_bpp(fourcc) != 0;
+}
+
+
+static unsigned int clamp_step(unsigned int v, unsigned int min, unsigned int max, unsigned int step)
+{
+    if (step == 0)
+        step = 1;
+    if (v < min)
+        v = min;
+    if (v > max)
+        v = max;
+    v = min + (v - min + step - 1)/step*step;
+    return (v > max) ? v - step : v;
+}
+
+
+// Is w x h a better fit for want_width x want_height than bw x bh: the
+// smallest size that covers it, else the largest there is
+static int size_better(unsigned int w, unsigned int h, unsigned int bw, unsigned int bh)
+{
+    int covers = w >= want_width && h >= want_height;
+    int best_covers = bw >= want_width && bh >= want_height;
+
+    if (bw == 0 || covers != best_covers)
+        return bw == 0 || covers;
+
+    return covers ? (uint64_t)w*h < (uint64_t)bw*bh : (uint64_t)w*h > (uint64_t)bw*bh;
+}
+
+
+// Native frame size closest to the wanted one for fourcc.  The enumerated
+// sizes are for the full sensor, so a cropped camera and drivers that do not
+// enumerate get the wanted size and S_FMT adjusts it.
+static void pick_size(struct camera *cam, unsigned int fourcc, unsigned int *w, unsigned int *h)
+{
+    struct v4l2_frmsizeenum fs;
+
+    *w = want_width;
+    *h = want_height;
+    if (cam->cropped)
+        return;
+
+    CLEAR(fs);
+    fs.pixel_format = fourcc;
+    if (-1 == xioctl(cam->fd, VIDIOC_ENUM_FRAMESIZES, &fs))
+        return;
+
+    if (fs.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+    {
+        *w = clamp_step(want_width, fs.stepwise.min_width, fs.stepwise.max_width, fs.stepwise.step_width);
+        *h = clamp_step(want_height, fs.stepwise.min_height, fs.stepwise.max_height, fs.stepwise.step_height);
+        return;
+    }
+
+    *w = *h = 0;
+    do
+    {
+        if (size_better(fs.discrete.width, fs.discrete.height, *w, *h))
+        {
+            *w = fs.discrete.width;
+            *h = fs.discrete.height;
+        }
+        fs.index++;
+    } while (0 == xioctl(cam->fd, VIDIOC_ENUM_FRAMESIZES, &fs));
+}
+
+
+// Is fourcc's best size w x h at cost bytes per frame a better mode than
+// bw x bh at best: sizes that cover the wanted one rank first as in
+// size_better(), then the fewest bytes
+static int mode_better(unsigned int w, unsigned int h, uint64_t cost,
+                       unsigned int bw, unsigned int bh, uint64_t best)
+{
+    int covers = w >= want_width && h >= want_height;
+    int best_covers = bw >= want_width && bh >= want_height;
+
+    if (bw == 0 || covers != best_covers)
+        return bw == 0 || covers;
+
+    // Neither covers: the largest, then the cheapest
+    if (!covers && (uint64_t)w*h != (uint64_t)bw*bh)
+        return (uint64_t)w*h > (uint64_t)bw*bh;
+
+    return cost < best;
+}
+
+
+// Cheapest native mode: of the usable, uncompressed, non-emulated formats
+// whose best size covers the wanted one, the one with the fewest bytes per
+// frame, e.g. GREY over YUYV when only luma is processed.  YUYV at the wanted
+// size if nothing enumerates.
+static void pick_format(struct camera *cam)
+{
+    struct v4l2_fmtdesc fd;
+    struct v4l2_pix_format *pix = &cam->fmt.fmt.pix;
+    unsigned int w, h, bw = 0, bh = 0;
+    uint64_t cost, best = UINT64_MAX;
+
+    pix->pixelformat = want_format ? want_format : V4L2_PIX_FMT_YUYV;
+    pick_size(cam, pix->pixelformat, &pix->width, &pix->height);
+    if (want_format)
+        return;
+
+    CLEAR(fd);
+    fd.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (; 0 == xioctl(cam->fd, VIDIOC_ENUM_FMT, &fd); fd.index++)
+    {
+        if ((fd.flags & (V4L2_FMT_FLAG_COMPRESSED | V4L2_FMT_FLAG_EMULATED)) || !format_usable(fd.pixelformat))
+            continue;
+
+        pick_size(cam, fd.pixelformat, &w, &h);
+        cost = (uint64_t)w*h*format_bpp(fd.pixelformat);
+        if (mode_better(w, h, cost, bw, bh, best))
+        {
+            best = cost;
+            bw = w;
+            bh = h;
+            pix->pixelformat = fd.pixelformat;
+            pix->width = w;
+            pix->height = h;
+        }
+    }
+}
+
+
+// Crop the sensor to -R before S_FMT, which then scales (or, without a
+// scaler, sizes) the frame to it
+static void set_roi(struct camera *cam)
+{
+    struct v4l2_selection sel;
+
+    CLEAR(sel);
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP;
+    sel.r = roi;
+
+    if (-1 == xioctl(cam->fd, VIDIOC_S_SELECTION, &sel))
+    {
+        fprintf(stderr, "%s cannot crop (%s), capturing the full frame\n", cam->dev_name, strerror(errno));
+        return;
+    }
+
+    cam->cropped = 1;
+    if (sel.r.left != roi.left || sel.r.top != roi.top || sel.r.width != roi.width || sel.r.height != roi.height)
+        printf("%s: ROI adjusted to %d,%d %ux%u\n", cam->dev_name,
+               sel.r.left, sel.r.top, sel.r.width, sel.r.height);
+}
+
+
+// -I: the slowest native interval that still reaches want_fps
+static void set_frame_rate(struct camera *cam)
+{
+    struct v4l2_frmivalenum fi;
+    struct v4l2_streamparm parm;
+    struct v4l2_fract best = { 1, want_fps };
+    int found = 0;
+
+    if (!want_fps)
+        return;
+
+    CLEAR(fi);
+    fi.pixel_format = cam->fmt.fmt.pix.pixelformat;
+    fi.width = cam->fmt.fmt.pix.width;
+    fi.height = cam->fmt.fmt.pix.height;
+    while (0 == xioctl(cam->fd, VIDIOC_ENUM_FRAMEINTERVALS, &fi) && fi.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+    {
+        // interval n/d is fast enough when n*fps <= d
+        if ((uint64_t)fi.discrete.numerator*want_fps <= fi.discrete.denominator &&
+            (!found || (uint64_t)fi.discrete.numerator*best.denominator > (uint64_t)best.numerator*fi.discrete.denominator))
+        {
+            best = fi.discrete;
+            found = 1;
         }
+        fi.index++;
+    }
+
+    CLEAR(parm);
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe = best;
+    if (-1 == xioctl(cam->fd, VIDIOC_S_PARM, &parm) ||
+        !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+    {
+        fprintf(stderr, "%s cannot set the frame rate\n", cam->dev_name);
+        return;
+    }
+
+    printf("%s: %u/%u s per frame\n", cam->dev_name, parm.parm.capture.timeperframe.numerator,
+           parm.parm.capture.timeperframe.denominator);
 }
 
-static void init_device(void)
+
+static void init_device(struct camera *cam)
 {
     struct v4l2_capability cap;
     struct v4l2_cropcap cropcap;
     struct v4l2_crop crop;
     unsigned int min;
 
-    if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap))
+    if (-1 == xioctl(cam->fd, VIDIOC_QUERYCAP, &cap))
     {
         if (EINVAL == errno) {
             fprintf(stderr, "%s is no V4L2 device\n",
-                     dev_name);
+                     cam->dev_name);
             exit(EXIT_FAILURE);
         }
         else
@@ -694,7 +1712,7 @@ static void init_device(void)
     if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
     {
         fprintf(stderr, "%s is no video capture device\n",
-                 dev_name);
+                 cam->dev_name);
         exit(EXIT_FAILURE);
     }
 
@@ -704,7 +1722,7 @@ static void init_device(void)
             if (!(cap.capabilities & V4L2_CAP_READWRITE))
             {
                 fprintf(stderr, "%s does not support read i/o\n",
-                         dev_name);
+                         cam->dev_name);
                 exit(EXIT_FAILURE);
             }
             break;
@@ -714,7 +1732,7 @@ static void init_device(void)
             if (!(cap.capabilities & V4L2_CAP_STREAMING))
             {
                 fprintf(stderr, "%s does not support streaming i/o\n",
-                         dev_name);
+                         cam->dev_name);
                 exit(EXIT_FAILURE);
             }
             break;
@@ -728,12 +1746,16 @@ static void init_device(void)
 
     cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-    if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap))
+    if (roi.width)
+    {
+        set_roi(cam);
+    }
+    else if (0 == xioctl(cam->fd, VIDIOC_CROPCAP, &cropcap))
     {
         crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         crop.c = cropcap.defrect; /* reset to default */
 
-        if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop))
+        if (-1 == xioctl(cam->fd, VIDIOC_S_CROP, &crop))
         {
             switch (errno)
             {
@@ -753,120 +1775,421 @@ static void init_device(void)
     }
 
 
-    CLEAR(fmt);
+    CLEAR(cam->fmt);
 
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
     if (force_format)
     {
         printf("FORCING FORMAT\n");
-        fmt.fmt.pix.width       = HRES;
-        fmt.fmt.pix.height      = VRES;
-
-        // Specify the Pixel Coding Formate here
 
-        // This one work for Logitech C200
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+        // Pixel coding and size: the cheapest the camera offers natively
+        // (YUYV for the Logitech C200, GREY where the sensor has it), or -P
+        pick_format(cam);
 
-        //fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_UYVY;
-        //fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_VYUY;
+        //cam->fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+        cam->fmt.fmt.pix.field       = V4L2_FIELD_NONE;
 
-        // Would be nice if camera supported
-        //fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
-        //fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24;
-
-        //fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
-        fmt.fmt.pix.field       = V4L2_FIELD_NONE;
-
-        if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
+        if (-1 == xioctl(cam->fd, VIDIOC_S_FMT, &cam->fmt))
                 errno_exit("VIDIOC_S_FMT");
 
         /* Note VIDIOC_S_FMT may change width and height. */
+        set_frame_rate(cam);
     }
     else
     {
         printf("ASSUMING FORMAT\n");
         /* Preserve original settings as set by v4l2-ctl for example */
-        if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt))
+        if (-1 == xioctl(cam->fd, VIDIOC_G_FMT, &cam->fmt))
                     errno_exit("VIDIOC_G_FMT");
     }
 
+    printf("%s: %.4s %ux%u, %u bytes per frame\n", cam->dev_name, (const char *)&cam->fmt.fmt.pix.pixelformat,
+           cam->fmt.fmt.pix.width, cam->fmt.fmt.pix.height, cam->fmt.fmt.pix.sizeimage);
+
     /* Buggy driver paranoia. */
-    min = fmt.fmt.pix.width * 2;
-    if (fmt.fmt.pix.bytesperline < min)
-            fmt.fmt.pix.bytesperline = min;
-    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-    if (fmt.fmt.pix.sizeimage < min)
-            fmt.fmt.pix.sizeimage = min;
+    min = cam->fmt.fmt.pix.width * (format_bpp(cam->fmt.fmt.pix.pixelformat) ? : 2);
+    if (cam->fmt.fmt.pix.bytesperline < min)
+            cam->fmt.fmt.pix.bytesperline = min;
+    min = cam->fmt.fmt.pix.bytesperline * cam->fmt.fmt.pix.height;
+    if (cam->fmt.fmt.pix.sizeimage < min)
+            cam->fmt.fmt.pix.sizeimage = min;
 
     switch (io)
     {
         case IO_METHOD_READ:
-            init_read(fmt.fmt.pix.sizeimage);
+            init_read(cam, cam->fmt.fmt.pix.sizeimage);
             break;
 
         case IO_METHOD_MMAP:
-            init_mmap();
+            init_mmap(cam);
             break;
 
         case IO_METHOD_USERPTR:
-            init_userp(fmt.fmt.pix.sizeimage);
+            init_userp(cam, cam->fmt.fmt.pix.sizeimage);
             break;
     }
 }
 
 
-static void close_device(void)
+static void close_device(struct camera *cam)
 {
-        if (-1 == close(fd))
+        if (-1 == close(cam->fd))
                 errno_exit("close");
 
-        fd = -1;
+        cam->fd = -1;
 }
 
-static void open_device(void)
+static void open_device(struct camera *cam)
 {
         struct stat st;
 
-        if (-1 == stat(dev_name, &st)) {
+        if (-1 == stat(cam->dev_name, &st)) {
                 fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-                         dev_name, errno, strerror(errno));
+                         cam->dev_name, errno, strerror(errno));
                 exit(EXIT_FAILURE);
         }
 
         if (!S_ISCHR(st.st_mode)) {
-                fprintf(stderr, "%s is no device\n", dev_name);
+                fprintf(stderr, "%s is no device\n", cam->dev_name);
                 exit(EXIT_FAILURE);
         }
 
-        fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+        cam->fd = open(cam->dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
 
-        if (-1 == fd) {
+        if (-1 == cam->fd) {
                 fprintf(stderr, "Cannot open '%s': %d, %s\n",
-                         dev_name, errno, strerror(errno));
+                         cam->dev_name, errno, strerror(errno));
                 exit(EXIT_FAILURE);
         }
 }
 
+// Slots hold the largest dump, an RGB frame plus its header
+static void start_dump_writer(void)
+{
+    size_t frame = max_frame_bytes();
+
+    if (store_path && frame_store_create(&store, store_path, STORE_PREALLOC, dump_slots > 0) == -1)
+        exit(EXIT_FAILURE);
+
+    if (dedup_thresh >= 0 && !store_path)
+    {
+        if ((dedup_log = fopen("dedup.log", "w")) == NULL)
+            errno_exit("dedup.log");
+        fprintf(dedup_log, "# camera tag sequence timestamp same_as_tag\n");
+    }
+
+    if (dump_slots <= 0)
+        return;
+
+    if (dump_writer_start(dump_slots, frame + 96 + sizeof(frame_record_t), DUMP_BATCH, dump_pool, dump_drop) == -1)
+    {
+        fprintf(stderr, "Cannot start dump writer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "Dump writer: %s, %d buffers\n", dump_writer_backend(), dump_slots);
+}
+
+
+// Drain the writer and report whether storage kept up; the container's
+// index can only be written once every frame has landed
+static void stop_dump_writer(void)
+{
+    dump_writer_stats_t st;
+    int i;
+
+    if (dump_slots > 0)
+        dump_writer_stop();
+
+    if (dedup_thresh >= 0)
+        for (i = 0; i < n_cameras; i++)
+            fprintf(stderr, "%s: %lu of %u frames were duplicates, not dumped\n", cameras[i].dev_name,
+                    cameras[i].dedup_skipped, cameras[i].framecnt);
+    if (dedup_log)
+        fclose(dedup_log);
+
+    if (store_path && frame_store_close(&store) == 0)
+        fprintf(stderr, "Stored %lu frames in %s\n", (unsigned long)store.count, store_path);
+
+    if (dump_slots <= 0)
+        return;
+
+    dump_writer_stats(&st);
+
+    fprintf(stderr, "Dump writer: %lu files %.1f MB, %lu errors, peak %d/%d buffers\n",
+            st.frames, st.bytes/1e6, st.errors, st.high_water, dump_slots);
+    fprintf(stderr, "  write latency avg %.2f ms max %.2f ms\n",
+            (st.frames + st.errors) ? st.write_ms_total/(st.frames + st.errors) : 0.0, st.write_ms_max);
+    if (st.stalls || st.dropped)
+        fprintf(stderr, "  storage fell behind: %lu stalls (%.1f ms waiting), %lu dropped\n",
+                st.stalls, st.stall_ms, st.dropped);
+}
+
+
+// ---- -B benchmark ----
+
+static const char *io_names[] = { "read", "mmap", "userptr" };
+
+struct bench_result
+{
+    enum io_method io;
+    int            req;             // buffers asked for
+    unsigned int   got;             // buffers the driver gave
+    unsigned int   frames;
+    double         fps;
+    double         cpu_us;          // user + system CPU per frame
+    double         copy_mbs;        // consuming the frame from its buffer
+    double         lost_pct;        // sequence gaps
+};
+
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+}
+
+
+// Whether cam->dev_name can do method m at all; init_device() exits otherwise
+static int bench_supported(struct camera *cam, enum io_method m)
+{
+    struct v4l2_capability vcap;
+    struct v4l2_requestbuffers req;
+    int ok;
+
+    open_device(cam);
+    ok = (0 == xioctl(cam->fd, VIDIOC_QUERYCAP, &vcap));
+    if (ok && m == IO_METHOD_READ)
+        ok = !!(vcap.capabilities & V4L2_CAP_READWRITE);
+    else if (ok)
+    {
+        // A zero count REQBUFS only checks the memory type
+        CLEAR(req);
+        req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.memory = (m == IO_METHOD_MMAP) ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+        ok = (vcap.capabilities & V4L2_CAP_STREAMING) && 0 == xioctl(cam->fd, VIDIOC_REQBUFS, &req);
+    }
+    close_device(cam);
+    return ok;
+}
+
+
+// Capture frame_count frames (after a few to settle) with nothing but a copy
+// out of the buffer, the least any consumer does
+static void bench_run(struct camera *cam, struct bench_result *r)
+{
+    unsigned char *copy;
+    struct frame *f, rf;
+    struct pollfd pfd;
+    uint64_t t0 = 0, copy_ns = 0, bytes = 0, t;
+    double cpu0 = 0;
+    unsigned int n, warm = 5, total = frame_count + 5;
+    unsigned long lost0 = 0;
+    int ready;
+
+    io = r->io;
+    req_buffers = r->req;
+    memset(&cam->fmt, 0, sizeof(cam->fmt));
+    cam->framecnt = 0;
+    cam->seq_lost = 0;
+
+    open_device(cam);
+    init_device(cam);
+    r->got = cam->n_buffers;
+    cam->frames = calloc(cam->n_buffers ? cam->n_buffers : 1, sizeof(struct frame));
+    copy = malloc(cam->fmt.fmt.pix.sizeimage);
+    if (!cam->frames || !copy)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    start_capturing(cam);
+
+    pfd.fd = cam->fd;
+    pfd.events = POLLIN;
+
+    for (n = 0; n < total; )
+    {
+        if ((ready = poll(&pfd, 1, 2000)) == -1 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+        {
+            fprintf(stderr, "%s: no frames\n", cam->dev_name);
+            break;
+        }
+
+        if (n == warm)
+        {
+            t0 = mono_ns();
+            cpu0 = cpu_seconds();
+            lost0 = cam->seq_lost;
+            copy_ns = 0;
+            bytes = 0;
+        }
+
+        if (io == IO_METHOD_READ)
+        {
+            ssize_t len = read(cam->fd, cam->buffers[0].start, cam->buffers[0].length);
+
+            if (len == -1)
+            {
+                if (errno == EAGAIN)
+                    continue;
+                errno_exit("read");
+            }
+            CLEAR(rf);
+            rf.cam = cam;
+            rf.start = cam->buffers[0].start;
+            rf.size = len;
+            rf.tag = ++cam->framecnt;
+            rf.buf.sequence = rf.tag - 1;
+            frame_stamp(cam, &rf);
+            f = &rf;
+        }
+        else if ((f = dequeue_frame(cam)) == NULL)
+            continue;
+
+        t = mono_ns();
+        memcpy(copy, f->start, f->size);
+        copy_ns += mono_ns() - t;
+        bytes += f->size;
+
+        if (io != IO_METHOD_READ)
+            requeue_frame(f);
+        n++;
+    }
+
+    if (n > warm)
+    {
+        r->frames = n - warm;
+        r->fps = r->frames/((mono_ns() - t0)/1e9);
+        r->cpu_us = (cpu_seconds() - cpu0)*1e6/r->frames;
+        r->copy_mbs = copy_ns ? bytes/(copy_ns/1e9)/1e6 : 0.0;
+        r->lost_pct = 100.0*(cam->seq_lost - lost0)/(r->frames + cam->seq_lost - lost0);
+    }
+
+    stop_capturing(cam);
+    uninit_device(cam);
+    close_device(cam);
+    free(cam->frames);
+    cam->frames = NULL;
+    free(copy);
+}
+
+
+// Every I/O method the device supports, streaming ones at several buffer
+// counts (or just -n's), then the cheapest by CPU per frame among the runs
+// that lost nothing
+static void benchmark(struct camera *cam)
+{
+    static const int counts[] = { 2, 3, 4, 6, 8, 12 };
+    struct bench_result res[1 + 2*(sizeof(counts)/sizeof(counts[0]))], *best = NULL;
+    int nres = 0, m, c, nc, i, fixed = req_buffers;
+
+    for (m = IO_METHOD_READ; m <= IO_METHOD_USERPTR; m++)
+    {
+        if (!bench_supported(cam, m))
+        {
+            fprintf(stderr, "%s: %s i/o not supported\n", cam->dev_name, io_names[m]);
+            continue;
+        }
+
+        nc = (m == IO_METHOD_READ || fixed) ? 1 : (int)(sizeof(counts)/sizeof(counts[0]));
+        for (c = 0; c < nc; c++)
+        {
+            CLEAR(res[nres]);
+            res[nres].io = m;
+            res[nres].req = (m == IO_METHOD_READ) ? 0 : (fixed ? fixed : counts[c]);
+            bench_run(cam, &res[nres]);
+            if (res[nres].frames)
+                nres++;
+        }
+    }
+
+    printf("\n%s, %u frames per run\n", cam->dev_name, frame_count);
+    printf("%-8s %5s %8s %12s %10s %7s\n", "method", "bufs", "fps", "cpu us/frm", "copy MB/s", "lost %");
+    for (i = 0; i < nres; i++)
+    {
+        printf("%-8s %5u %8.1f %12.1f %10.0f %7.2f\n", io_names[res[i].io], res[i].got, res[i].fps,
+               res[i].cpu_us, res[i].copy_mbs, res[i].lost_pct);
+        if (res[i].lost_pct == 0.0 && (!best || res[i].cpu_us < best->cpu_us))
+            best = &res[i];
+    }
+
+    if (best)
+        printf("cheapest without loss: %s with %u buffers (-%c -n %u)\n", io_names[best->io], best->got,
+               "rmu"[best->io], best->got);
+    else
+        printf("every configuration lost frames\n");
+}
+
+
+// Glass-to-disk latency per stage and frames lost, after the writer drained
+static void trace_report(void)
+{
+    int i;
+
+    if (!trace)
+        return;
+
+    for (i = 0; i < n_cameras; i++)
+        fprintf(stderr, "%s: %u frames, %lu lost to sequence gaps (%.2f%%)%s\n", cameras[i].dev_name,
+                cameras[i].framecnt, cameras[i].seq_lost,
+                cameras[i].framecnt ? 100.0*cameras[i].seq_lost/(cameras[i].framecnt + cameras[i].seq_lost) : 0.0,
+                cameras[i].glass_ok ? "" : ", no monotonic driver timestamps (glass = DQBUF)");
+
+    lat_hist_print_header(stderr);
+    for (i = 0; i < TRACE_STAGES; i++)
+        lat_hist_print(stderr, trace_names[i], &trace_hist[i]);
+
+    if (trace_csv)
+        fclose(trace_csv);
+}
+
+
+static char *default_dev;
+
 static void usage(FILE *fp, int argc, char **argv)
 {
         fprintf(fp,
                  "Usage: %s [options]\n\n"
                  "Version 1.3\n"
                  "Options:\n"
-                 "-d | --device name   Video device name [%s]\n"
+                 "-d | --device name   Video device name, repeat for several cameras [%s]\n"
                  "-h | --help          Print this message\n"
                  "-m | --mmap          Use memory mapped buffers [default]\n"
                  "-r | --read          Use read() calls\n"
                  "-u | --userp         Use application allocated buffers\n"
                  "-o | --output        Outputs stream to stdout\n"
-                 "-f | --format        Force format to 640x480 GREY\n"
+                 "-f | --format        Negotiate the mode (default): cheapest native one covering -G, see -P\n"
                  "-c | --count         Number of frames to grab [%i]\n"
+                 "-w | --workers       Processing threads, 0 processes on the capture thread [%i]\n"
+                 "-y | --yuv           YUYV to RGB matrix: 601, 709, 601full or 709full [601]\n"
+                 "-b | --bgr           Store BGR24 instead of RGB24, needs -S\n"
+                 "-s | --split         Threads converting the rows of each frame [%i]\n"
+                 "-l | --luma          Grayscale output: dump, sobel or thresh[=N] [dump]\n"
+                 "-q | --queue         Dump buffers for the background writer, 0 writes inline [%i]\n"
+                 "-p | --pool          Write dumps with N pwritev threads instead of io_uring\n"
+                 "-x | --drop          Drop dumps instead of waiting when the writer is behind\n"
+                 "-S | --store file    Append dumps to one indexed file (see frame_extract)\n"
+                 "-t | --trace         Glass-to-disk latency histograms and dropped frame counts\n"
+                 "-C | --trace-csv f   Also write each frame's timestamps to a CSV file\n"
+                 "-n | --buffers       Driver buffers to request [6 mmap, 4 userptr]\n"
+                 "-B | --bench         Compare I/O methods and buffer counts, -c frames each\n"
+                 "-E | --export sock   Share buffers as dmabufs over a Unix socket (see frame_client)\n"
+                 "-P | --pixfmt fourcc Pixel format, auto picks the cheapest usable one [auto]\n"
+                 "-G | --size WxH      Frame size, the nearest native one is used [%dx%d]\n"
+                 "-I | --fps N         Frame rate, the slowest native one reaching N [driver's]\n"
+                 "-R | --roi x,y,WxH   Sensor region the driver crops to, frame size follows\n"
+                 "-e | --dedup N       Skip dumps with no luma block changed by more than N\n"
                  "",
-                 argv[0], dev_name, frame_count);
+                 argv[0], default_dev, frame_count, n_workers, convert_threads, dump_slots, HRES, VRES);
 }
 
-static const char short_options[] = "d:hmruofc:";
+static const char short_options[] = "d:hmruofc:w:y:bs:l:q:p:xS:tC:n:BE:P:G:I:R:e:";
 
 static const struct option
 long_options[] = {
@@ -878,15 +2201,40 @@ long_options[] = {
         { "output", no_argument,       NULL, 'o' },
         { "format", no_argument,       NULL, 'f' },
         { "count",  required_argument, NULL, 'c' },
+        { "workers", required_argument, NULL, 'w' },
+        { "yuv",    required_argument, NULL, 'y' },
+        { "bgr",    no_argument,       NULL, 'b' },
+        { "split",  required_argument, NULL, 's' },
+        { "luma",   required_argument, NULL, 'l' },
+        { "queue",  required_argument, NULL, 'q' },
+        { "pool",   required_argument, NULL, 'p' },
+        { "drop",   no_argument,       NULL, 'x' },
+        { "store",  required_argument, NULL, 'S' },
+        { "trace",  no_argument,       NULL, 't' },
+        { "trace-csv", required_argument, NULL, 'C' },
+        { "buffers", required_argument, NULL, 'n' },
+        { "bench",  no_argument,       NULL, 'B' },
+        { "export", required_argument, NULL, 'E' },
+        { "pixfmt", required_argument, NULL, 'P' },
+        { "size",   required_argument, NULL, 'G' },
+        { "fps",    required_argument, NULL, 'I' },
+        { "roi",    required_argument, NULL, 'R' },
+        { "dedup",  required_argument, NULL, 'e' },
         { 0, 0, 0, 0 }
 };
 
 int main(int argc, char **argv)
 {
+    yuv_matrix_t yuv_matrix = YUV_BT601;
+    yuv_range_t yuv_range = YUV_RANGE_LIMITED;
+    int bgr = 0;
+
+    int i;
+
     if(argc > 1)
-        dev_name = argv[1];
+        default_dev = argv[1];
     else
-        dev_name = "/dev/video0";
+        default_dev = "/dev/video0";
 
     for (;;)
     {
@@ -905,7 +2253,12 @@ int main(int argc, char **argv)
                 break;
 
             case 'd':
-                dev_name = optarg;
+                if (n_cameras == MAX_CAMERAS)
+                {
+                    fprintf(stderr, "At most %d cameras\n", MAX_CAMERAS);
+                    exit(EXIT_FAILURE);
+                }
+                cameras[n_cameras++].dev_name = optarg;
                 break;
 
             case 'h':
@@ -939,19 +2292,181 @@ int main(int argc, char **argv)
                         errno_exit(optarg);
                 break;
 
+            case 'w':
+                n_workers = atoi(optarg);
+                if (n_workers < 0 || n_workers > MAX_WORKERS)
+                {
+                        fprintf(stderr, "workers must be 0..%d\n", MAX_WORKERS);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'y':
+                yuv_matrix = strncmp(optarg, "709", 3) ? YUV_BT601 : YUV_BT709;
+                yuv_range = strstr(optarg, "full") ? YUV_RANGE_FULL : YUV_RANGE_LIMITED;
+                break;
+
+            case 'b':
+                bgr = 1;
+                break;
+
+            case 's':
+                convert_threads = atoi(optarg);
+                break;
+
+            case 'l':
+                if (!strcmp(optarg, "sobel"))
+                    luma_op = LUMA_SOBEL;
+                else if (!strncmp(optarg, "thresh", 6))
+                {
+                    luma_op = LUMA_THRESHOLD;
+                    if (optarg[6] == '=')
+                        luma_thresh = atoi(optarg + 7);
+                }
+                else if (!strcmp(optarg, "dump"))
+                    luma_op = LUMA_DUMP;
+                else
+                {
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'q':
+                dump_slots = atoi(optarg);
+                break;
+
+            case 'p':
+                dump_pool = atoi(optarg);
+                break;
+
+            case 'x':
+                dump_drop = 1;
+                break;
+
+            case 'S':
+                store_path = optarg;
+                break;
+
+            case 'C':
+                if ((trace_csv = fopen(optarg, "w")) == NULL)
+                    errno_exit(optarg);
+                fprintf(trace_csv, "camera,tag,sequence,glass_ns,dqbuf_ns,start_ns,end_ns\n");
+                /* fall through */
+
+            case 't':
+                trace = 1;
+                break;
+
+            case 'n':
+                req_buffers = atoi(optarg);
+                break;
+
+            case 'B':
+                bench = 1;
+                break;
+
+            case 'E':
+                share_path = optarg;
+                break;
+
+            case 'P':
+                if (strcmp(optarg, "auto") == 0)
+                    want_format = 0;
+                else if (strlen(optarg) == 4)
+                    want_format = v4l2_fourcc(optarg[0], optarg[1], optarg[2], optarg[3]);
+                else
+                {
+                    fprintf(stderr, "pixel format is a fourcc such as GREY, or auto\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'G':
+                if (sscanf(optarg, "%ux%u", &want_width, &want_height) != 2)
+                {
+                    fprintf(stderr, "size is WxH\n");
+                    exit(EXIT_FAILURE);
+                }
+                want_size = 1;
+                break;
+
+            case 'I':
+                want_fps = atoi(optarg);
+                break;
+
+            case 'e':
+                dedup_thresh = atoi(optarg);
+                break;
+
+            case 'R':
+                if (sscanf(optarg, "%d,%d,%ux%u", &roi.left, &roi.top, &roi.width, &roi.height) != 4 ||
+                    roi.width == 0 || roi.height == 0)
+                {
+                    fprintf(stderr, "roi is x,y,WxH\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             default:
                 usage(stderr, argc, argv);
                 exit(EXIT_FAILURE);
         }
     }
 
-    open_device();
-    init_device();
-    start_capturing();
+    // A P6 file is RGB by definition, only the store records the channel order
+    if (bgr && !store_path)
+    {
+        fprintf(stderr, "-b needs -S, PPM dumps are always RGB\n");
+        exit(EXIT_FAILURE);
+    }
+    yuv_coef_init(&yuv_coef, yuv_matrix, yuv_range, bgr);
+
+    // Capture the ROI 1:1 unless a size was asked for too
+    if (roi.width && !want_size)
+    {
+        want_width = roi.width;
+        want_height = roi.height;
+    }
+
+    if (n_cameras == 0)
+        cameras[n_cameras++].dev_name = default_dev;
+
+    if (bench)
+    {
+        for (i = 0; i < n_cameras; i++)
+            benchmark(&cameras[i]);
+        return 0;
+    }
+
+    for (i = 0; i < n_cameras; i++)
+    {
+        cameras[i].index = i;
+        open_device(&cameras[i]);
+        init_device(&cameras[i]);
+    }
+    for (i = 0; i < TRACE_STAGES; i++)
+        lat_hist_init(&trace_hist[i]);
+    if (trace)
+        dump_writer_on_done(trace_disk);
+
+    start_dump_writer();
+    start_workers();
+    start_sharing();
+    for (i = 0; i < n_cameras; i++)
+        start_capturing(&cameras[i]);
     mainloop();
-    stop_capturing();
-    uninit_device();
-    close_device();
+    for (i = 0; i < n_cameras; i++)
+        stop_capturing(&cameras[i]);
+    stop_sharing();
+    stop_workers();
+    stop_dump_writer();
+    trace_report();
+    for (i = 0; i < n_cameras; i++)
+    {
+        uninit_device(&cameras[i]);
+        close_device(&cameras[i]);
+    }
     fprintf(stderr, "\n");
     return 0;
 }
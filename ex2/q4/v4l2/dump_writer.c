@@ -0,0 +1,576 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+#include "frame_ring.h"
+#include "dump_writer.h"
+#include "buf_pool.h"
+
+#define DUMP_PATH_LEN (64)
+#define DUMP_MAX_POOL (16)
+
+typedef struct
+{
+    char path[DUMP_PATH_LEN];
+    unsigned char *buf;
+    size_t len;
+    size_t done;            // bytes written so far (io_uring short writes)
+    int fd;
+    int own_fd;             // opened from path, closed when written
+    off_t base;             // file offset of buf[0]
+    uint64_t stamp;         // caller's, handed to the done hook
+    struct iovec iov;
+    struct timespec queued;
+} dump_slot_t;
+
+// io_uring rings, mapped from the ring fd
+typedef struct
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+} dump_uring_t;
+
+static dump_slot_t     *slots;
+static buf_pool_t       slot_pool;
+static int              n_slots;
+static size_t           slot_size;
+static int              batch_max;
+static int              drop_full;
+
+static frame_ring_t     free_ring, pending_ring;
+static sem_t            free_sem, pending_sem;
+
+static int              use_uring;
+static dump_uring_t     uring;
+static int              n_threads;
+static pthread_t        threads[DUMP_MAX_POOL];
+
+static pthread_mutex_t  stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static dump_writer_stats_t stats;
+static int              in_use;
+static dump_done_fn     done_hook;
+
+
+static double ms_since(const struct timespec *t0)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t0->tv_sec)*1000.0 + (now.tv_nsec - t0->tv_nsec)/1000000.0;
+}
+
+
+// ---- io_uring without liburing ----
+
+static int uring_setup(dump_uring_t *u, unsigned entries)
+{
+    struct io_uring_params p;
+    unsigned char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_map_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_map_len > u->sq_map_len)
+            u->sq_map_len = u->cq_map_len;
+        u->cq_map_len = 0;
+    }
+
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED)
+        goto fail_fd;
+
+    if (u->cq_map_len)
+    {
+        u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED)
+            goto fail_sq;
+    }
+    else
+        u->cq_map = u->sq_map;
+
+    u->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    sq = u->sq_map;
+    cq = u->cq_map;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail_cq:
+    if (u->cq_map != u->sq_map)
+        munmap(u->cq_map, u->cq_map_len);
+fail_sq:
+    munmap(u->sq_map, u->sq_map_len);
+fail_fd:
+    close(u->fd);
+    return -1;
+}
+
+
+static void uring_teardown(dump_uring_t *u)
+{
+    munmap(u->sqes, u->sqes_len);
+    if (u->cq_map != u->sq_map)
+        munmap(u->cq_map, u->cq_map_len);
+    munmap(u->sq_map, u->sq_map_len);
+    close(u->fd);
+}
+
+
+// Queue one writev of the rest of slot s; the ring has room for batch_max
+static void uring_queue_write(dump_uring_t *u, dump_slot_t *s)
+{
+    unsigned tail = *u->sq_tail, idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    s->iov.iov_base = s->buf + s->done;
+    s->iov.iov_len = s->len - s->done;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = s->fd;
+    sqe->addr = (unsigned long)&s->iov;
+    sqe->len = 1;
+    sqe->off = s->base + s->done;
+    sqe->user_data = (unsigned long)s;
+
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+static int uring_enter(dump_uring_t *u, unsigned submit, unsigned wait)
+{
+    int rc;
+
+    do
+        rc = syscall(__NR_io_uring_enter, u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (rc < 0 && errno == EINTR);
+
+    return rc;
+}
+
+
+// ---- common slot handling ----
+
+static int slot_open(dump_slot_t *s)
+{
+    s->done = 0;
+    if (!s->own_fd)
+        return 0;
+
+    s->fd = open(s->path, O_WRONLY | O_CREAT | O_TRUNC, 00666);
+    if (s->fd < 0)
+        return -1;
+
+    // Reserve the extent up front so the filesystem is not allocating on
+    // every write.  vfat and others may not support it; that is fine.
+    if (fallocate(s->fd, 0, 0, s->len) == -1 && errno != EOPNOTSUPP && errno != ENOSYS)
+        perror("fallocate");
+
+    return 0;
+}
+
+
+// File finished (or failed): account for it and return the slot
+static void slot_release(dump_slot_t *s, int ok)
+{
+    double ms = ms_since(&s->queued);
+
+    if (s->own_fd && s->fd >= 0)
+    {
+        if (close(s->fd) == -1)
+            ok = 0;
+        s->fd = -1;
+    }
+
+    if (!ok)
+        fprintf(stderr, "dump %s failed\n", s->path);
+
+    pthread_mutex_lock(&stats_lock);
+    if (ok)
+    {
+        stats.frames++;
+        stats.bytes += s->len;
+    }
+    else
+        stats.errors++;
+    stats.write_ms_total += ms;
+    if (ms > stats.write_ms_max)
+        stats.write_ms_max = ms;
+    in_use--;
+    pthread_mutex_unlock(&stats_lock);
+
+    if (done_hook)
+        done_hook(s->stamp, ok);
+
+    frame_ring_push(&free_ring, s);
+    sem_post(&free_sem);
+}
+
+
+// Blocking write of the rest, for the pool and for io_uring short writes
+static int slot_write_rest(dump_slot_t *s)
+{
+    struct iovec iov;
+    ssize_t n;
+
+    while (s->done < s->len)
+    {
+        iov.iov_base = s->buf + s->done;
+        iov.iov_len = s->len - s->done;
+        n = pwritev(s->fd, &iov, 1, s->base + s->done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        s->done += n;
+    }
+
+    return 0;
+}
+
+
+// Pop an item a semaphore has already accounted for.  The semaphore is
+// posted after a push completes, but with several producers (capture workers
+// on pending_ring, pool writers on free_ring) a later push can post while an
+// earlier one still owns the cell at the tail; that item is on its way, so
+// yield until it is published rather than returning garbage.
+static void *ring_take(frame_ring_t *r)
+{
+    void *item = NULL;
+
+    while (frame_ring_pop(r, &item) == -1)
+        sched_yield();
+
+    return item;
+}
+
+
+// NULL is the stop marker
+static dump_slot_t *pending_pop(int wait)
+{
+    if (wait)
+    {
+        while (sem_wait(&pending_sem) == -1 && errno == EINTR)
+            ;
+    }
+    else if (sem_trywait(&pending_sem) == -1)
+        return (dump_slot_t *)-1;
+
+    return (dump_slot_t *)ring_take(&pending_ring);
+}
+
+
+static void *uring_writer(void *arg)
+{
+    dump_uring_t *u = &uring;
+    dump_slot_t *s;
+    unsigned head, queued;
+    int inflight = 0, stopping = 0, rc;
+
+    (void)arg;
+
+    while (!stopping || inflight)
+    {
+        // Gather a batch; block only when nothing is in flight
+        queued = 0;
+        while (!stopping && inflight + queued < (unsigned)batch_max)
+        {
+            s = pending_pop(inflight + queued == 0);
+            if (s == (dump_slot_t *)-1)
+                break;
+            if (s == NULL)
+            {
+                stopping = 1;
+                break;
+            }
+            if (slot_open(s) == -1)
+            {
+                slot_release(s, 0);
+                continue;
+            }
+            uring_queue_write(u, s);
+            queued++;
+        }
+
+        if (queued == 0 && inflight == 0)
+            continue;
+
+        // Submit the batch and wait for at least one completion
+        rc = uring_enter(u, queued, 1);
+        if (rc < 0)
+        {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        inflight += queued;
+
+        head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+            s = (dump_slot_t *)(unsigned long)cqe->user_data;
+            if (cqe->res > 0)
+                s->done += cqe->res;
+
+            // A short write is finished here rather than requeued
+            if (cqe->res < 0 || (s->done < s->len && slot_write_rest(s) == -1))
+                slot_release(s, 0);
+            else
+                slot_release(s, 1);
+
+            inflight--;
+            head++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+
+static void *pool_writer(void *arg)
+{
+    dump_slot_t *s;
+
+    (void)arg;
+
+    while ((s = pending_pop(1)) != NULL)
+    {
+        if (slot_open(s) == -1)
+            slot_release(s, 0);
+        else
+            slot_release(s, slot_write_rest(s) == 0);
+    }
+
+    return NULL;
+}
+
+
+int dump_writer_start(int nslots, size_t size, int batch, int pool_threads, int drop)
+{
+    int i;
+
+    if (nslots < 1)
+        nslots = 1;
+    if (batch < 1)
+        batch = 1;
+    if (batch > nslots)
+        batch = nslots;
+
+    n_slots = nslots;
+    slot_size = size;
+    batch_max = batch;
+    drop_full = drop;
+    memset(&stats, 0, sizeof(stats));
+    in_use = 0;
+
+    // Slots are pinned and faulted in now, not on the first frames
+    slots = calloc(nslots, sizeof(*slots));
+    if (!slots || buf_pool_create(&slot_pool, size, nslots) == -1)
+        return -1;
+
+    if (frame_ring_init(&free_ring, nslots) == -1 || frame_ring_init(&pending_ring, nslots + DUMP_MAX_POOL) == -1)
+        return -1;
+    sem_init(&free_sem, 0, nslots);
+    sem_init(&pending_sem, 0, 0);
+
+    for (i = 0; i < nslots; i++)
+    {
+        slots[i].buf = buf_pool_block(&slot_pool, i);
+        slots[i].fd = -1;
+        frame_ring_push(&free_ring, &slots[i]);
+    }
+
+    use_uring = (pool_threads <= 0 && uring_setup(&uring, batch) == 0);
+    if (use_uring)
+    {
+        n_threads = 1;
+        if (pthread_create(&threads[0], NULL, uring_writer, NULL) != 0)
+            return -1;
+        return 0;
+    }
+
+    n_threads = (pool_threads > 0) ? pool_threads : 2;
+    if (n_threads > DUMP_MAX_POOL)
+        n_threads = DUMP_MAX_POOL;
+
+    for (i = 0; i < n_threads; i++)
+        if (pthread_create(&threads[i], NULL, pool_writer, NULL) != 0)
+            return -1;
+
+    return 0;
+}
+
+
+// A free slot, waiting for one unless dropping; NULL when dropped
+static dump_slot_t *slot_get(void)
+{
+    struct timespec t0;
+
+    if (sem_trywait(&free_sem) == -1)
+    {
+        if (drop_full)
+        {
+            pthread_mutex_lock(&stats_lock);
+            stats.dropped++;
+            pthread_mutex_unlock(&stats_lock);
+            return NULL;
+        }
+
+        // Storage has fallen behind by the whole pool
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        while (sem_wait(&free_sem) == -1 && errno == EINTR)
+            ;
+
+        pthread_mutex_lock(&stats_lock);
+        stats.stalls++;
+        stats.stall_ms += ms_since(&t0);
+        pthread_mutex_unlock(&stats_lock);
+    }
+
+    return (dump_slot_t *)ring_take(&free_ring);
+}
+
+
+static void slot_queue(dump_slot_t *s, const void *hdr, size_t hlen, const void *data, size_t size, uint64_t stamp)
+{
+    s->stamp = stamp;
+    memcpy(s->buf, hdr, hlen);
+    memcpy(s->buf + hlen, data, size);
+    s->len = hlen + size;
+    clock_gettime(CLOCK_MONOTONIC, &s->queued);
+
+    pthread_mutex_lock(&stats_lock);
+    if (++in_use > stats.high_water)
+        stats.high_water = in_use;
+    pthread_mutex_unlock(&stats_lock);
+
+    frame_ring_push(&pending_ring, s);
+    sem_post(&pending_sem);
+}
+
+
+int dump_writer_submit(const char *path, const void *hdr, size_t hlen, const void *data, size_t size,
+                       uint64_t stamp)
+{
+    dump_slot_t *s;
+
+    if (hlen + size > slot_size)
+        return -1;
+    if ((s = slot_get()) == NULL)
+        return 1;
+
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    s->own_fd = 1;
+    s->base = 0;
+    slot_queue(s, hdr, hlen, data, size, stamp);
+    return 0;
+}
+
+
+int dump_writer_submit_at(int fd, off_t offset, const void *hdr, size_t hlen, const void *data, size_t size,
+                          uint64_t stamp)
+{
+    dump_slot_t *s;
+
+    if (hlen + size > slot_size)
+        return -1;
+    if ((s = slot_get()) == NULL)
+        return 1;
+
+    snprintf(s->path, sizeof(s->path), "fd %d offset %lld", fd, (long long)offset);
+    s->own_fd = 0;
+    s->fd = fd;
+    s->base = offset;
+    slot_queue(s, hdr, hlen, data, size, stamp);
+    return 0;
+}
+
+
+void dump_writer_stop(void)
+{
+    int i;
+
+    if (!slots)
+        return;
+
+    // One marker per thread, behind every queued file
+    for (i = 0; i < n_threads; i++)
+    {
+        frame_ring_push(&pending_ring, NULL);
+        sem_post(&pending_sem);
+    }
+
+    for (i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    if (use_uring)
+        uring_teardown(&uring);
+
+    sem_destroy(&free_sem);
+    sem_destroy(&pending_sem);
+    frame_ring_destroy(&free_ring);
+    frame_ring_destroy(&pending_ring);
+    buf_pool_destroy(&slot_pool);
+    free(slots);
+    slots = NULL;
+}
+
+
+void dump_writer_on_done(dump_done_fn fn)
+{
+    done_hook = fn;
+}
+
+
+void dump_writer_stats(dump_writer_stats_t *s)
+{
+    pthread_mutex_lock(&stats_lock);
+    *s = stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+
+const char *dump_writer_backend(void)
+{
+    return use_uring ? "io_uring" : "pwritev pool";
+}
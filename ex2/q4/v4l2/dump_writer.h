@@ -0,0 +1,62 @@
+#ifndef DUMP_WRITER_H
+#define DUMP_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Background frame dump writer
+//
+// dump_writer_submit() copies a header and frame into one of a fixed pool of
+// slots and returns; the writes happen off the capture and processing
+// threads.  With io_uring a writer thread gathers up to batch pending files,
+// opens and fallocate()s each, and queues all their writev()s with one
+// io_uring_enter().  Where io_uring is unavailable (old kernel, seccomp) a
+// small thread pool does the same with pwritev().
+//
+// The slot pool is the only buffer against a storage stall.  When it runs
+// dry submit either waits for a slot (the default, the caller sees the stall)
+// or drops the dump, and either way the stall is counted so a recording run
+// shows whether storage kept up.
+
+typedef struct
+{
+    unsigned long frames;       // files written
+    unsigned long long bytes;
+    unsigned long errors;       // open or write failures
+    unsigned long dropped;      // submits refused with the pool empty
+    unsigned long stalls;       // submits that had to wait for a slot
+    double stall_ms;            // total time spent waiting
+    int high_water;             // most slots in use at once
+    double write_ms_max;        // submit to file closed
+    double write_ms_total;
+} dump_writer_stats_t;
+
+// slots buffers of slot_size bytes each.  pool_threads > 0 forces the
+// pwritev() pool with that many threads.  drop selects dropping over
+// waiting when no slot is free.  0 or -1.
+int dump_writer_start(int slots, size_t slot_size, int batch, int pool_threads, int drop);
+
+// Queue path = hdr + data.  stamp is passed to the done hook untouched.
+// 0 queued, 1 dropped, -1 error (too large).
+int dump_writer_submit(const char *path, const void *hdr, size_t hlen, const void *data, size_t size,
+                       uint64_t stamp);
+
+// Queue hdr + data at offset in an open file the caller owns (frame_store).
+// fd must stay open until dump_writer_stop().  Same return values.
+int dump_writer_submit_at(int fd, off_t offset, const void *hdr, size_t hlen, const void *data, size_t size,
+                          uint64_t stamp);
+
+// Called on a writer thread as each queued write lands (ok) or fails.
+typedef void (*dump_done_fn)(uint64_t stamp, int ok);
+void dump_writer_on_done(dump_done_fn fn);
+
+// Wait for every queued file, then stop the writer threads.
+void dump_writer_stop(void);
+
+void dump_writer_stats(dump_writer_stats_t *s);
+
+// "io_uring" or "pwritev pool"
+const char *dump_writer_backend(void);
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ *  Example consumer of capture -E: maps the exported capture buffers
+ *  read-only and reads each announced frame in place, no copy.  Prints the
+ *  mean luma of every frame; hold_ms simulates a slow consumer.
+ *
+ *      capture -E /tmp/capture.sock -c 300 &
+ *      frame_client /tmp/capture.sock 100
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include <linux/videodev2.h>
+#include <linux/dma-buf.h>
+
+#include "frame_share.h"
+
+#define MAX_CAMERAS 8
+
+struct shared_camera
+{
+    frame_share_msg_t hello;
+    int fds[FRAME_SHARE_MAX_FDS];
+    const unsigned char *map[FRAME_SHARE_MAX_FDS];
+};
+
+static struct shared_camera cams[MAX_CAMERAS];
+
+
+// Mean of the Y samples: every byte of GREY, every other byte of YUYV
+static double mean_luma(const frame_share_msg_t *hello, const unsigned char *p, unsigned int size)
+{
+    unsigned int i, step = (hello->pixelformat == V4L2_PIX_FMT_YUYV) ? 2 : 1;
+    unsigned long long sum = 0;
+
+    for (i = 0; i < size; i += step)
+        sum += p[i];
+
+    return size ? (double)sum*step/size : 0.0;
+}
+
+
+static void dmabuf_sync(int fd, unsigned long long flags)
+{
+    struct dma_buf_sync sync = { DMA_BUF_SYNC_READ | flags };
+
+    // Only exporters with CPU caches to manage need this; an error is harmless
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+
+int main(int argc, char **argv)
+{
+    frame_share_msg_t m;
+    struct shared_camera *c;
+    struct timespec hold;
+    int fds[FRAME_SHARE_MAX_FDS];
+    int sock, nfds, r, got = 0, n_cameras = 1;
+    long frames, hold_ms, seen = 0;
+    unsigned int i;
+
+    if (argc < 2 || argc > 4)
+    {
+        fprintf(stderr, "Usage: %s socket [frames] [hold_ms]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    frames = (argc > 2) ? atol(argv[2]) : 0;
+    hold_ms = (argc > 3) ? atol(argv[3]) : 0;
+    hold.tv_sec = hold_ms/1000;
+    hold.tv_nsec = (hold_ms%1000)*1000000L;
+
+    if ((sock = frame_share_connect(argv[1])) == -1)
+    {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    // One HELLO per camera, each with that camera's buffers
+    while (got < n_cameras)
+    {
+        if ((r = frame_share_recv(sock, &m, fds, &nfds)) != 1 || m.type != SHARE_HELLO ||
+            m.camera >= MAX_CAMERAS || m.n_buffers != (unsigned int)nfds)
+        {
+            fprintf(stderr, "Bad hello from %s\n", argv[1]);
+            exit(EXIT_FAILURE);
+        }
+
+        n_cameras = m.n_cameras;
+        c = &cams[m.camera];
+        c->hello = m;
+        for (i = 0; i < m.n_buffers; i++)
+        {
+            c->fds[i] = fds[i];
+            c->map[i] = mmap(NULL, m.length, PROT_READ, MAP_SHARED, fds[i], 0);
+            if (c->map[i] == MAP_FAILED)
+            {
+                perror("mmap dmabuf");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        printf("camera %u: %ux%u %.4s, %u buffers of %u bytes\n", m.camera, m.width, m.height,
+               (const char *)&m.pixelformat, m.n_buffers, m.length);
+        got++;
+    }
+
+    while ((frames == 0 || seen < frames) && (r = frame_share_recv(sock, &m, NULL, NULL)) == 1)
+    {
+        if (m.type != SHARE_FRAME || m.camera >= MAX_CAMERAS || m.index >= cams[m.camera].hello.n_buffers)
+            continue;
+
+        c = &cams[m.camera];
+        dmabuf_sync(c->fds[m.index], DMA_BUF_SYNC_START);
+        printf("cam %u seq %6u buf %2u %8u bytes %lld.%06lld mean luma %6.2f\n", m.camera, m.sequence, m.index,
+               m.bytesused, (long long)m.ts_sec, (long long)m.ts_usec,
+               mean_luma(&c->hello, c->map[m.index], m.bytesused));
+        if (hold_ms)
+            nanosleep(&hold, NULL);
+        dmabuf_sync(c->fds[m.index], DMA_BUF_SYNC_END);
+
+        m.type = SHARE_RELEASE;
+        if (frame_share_send(sock, &m, NULL, 0) == -1)
+            break;
+        seen++;
+    }
+
+    close(sock);
+    return 0;
+}
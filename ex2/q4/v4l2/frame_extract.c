@@ -0,0 +1,163 @@
+/*
+ *  List the frames in a capture -S container, or write frame n out as
+ *  PGM/PPM:
+ *
+ *      frame_extract frames.v4l2
+ *      frame_extract frames.v4l2 42 frame42.pgm
+ *
+ *  A frame capture -e found unchanged is only a reference record; extracting
+ *  it writes the stored frame it refers to, with its own timestamp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <linux/videodev2.h>
+
+#include "frame_store.h"
+
+
+static int write_pnm(const char *path, const frame_record_t *rec, const void *data)
+{
+    const unsigned char *row = data;
+    unsigned char *rgb = NULL;
+    unsigned int x;
+    int channels, y;
+    FILE *fp;
+
+    if (rec->pixelformat == V4L2_PIX_FMT_GREY)
+        channels = 1;
+    else if (rec->pixelformat == V4L2_PIX_FMT_RGB24 || rec->pixelformat == V4L2_PIX_FMT_BGR24)
+        channels = 3;
+    else
+    {
+        fprintf(stderr, "Frame format is not GREY or RGB24\n");
+        return -1;
+    }
+
+    // A damaged or hand-made record must not send the row loop past the payload
+    if ((uint64_t)rec->width*channels > rec->bytesperline ||
+        (uint64_t)rec->bytesperline*rec->height > rec->size)
+    {
+        fprintf(stderr, "Frame payload of %u bytes is short for %ux%u, %u bytes per line\n",
+                rec->size, rec->width, rec->height, rec->bytesperline);
+        return -1;
+    }
+
+    // P6 is RGB, BGR24 rows are swapped back through a row buffer
+    if (rec->pixelformat == V4L2_PIX_FMT_BGR24 && (rgb = malloc((size_t)rec->width*3)) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    if ((fp = fopen(path, "wb")) == NULL)
+    {
+        perror(path);
+        free(rgb);
+        return -1;
+    }
+
+    fprintf(fp, "P%d\n#%010lld sec %010lld msec \n%u %u\n255\n", channels == 1 ? 5 : 6,
+            (long long)rec->ts_sec, (long long)(rec->ts_usec/1000), rec->width, rec->height);
+    for (y = 0; y < (int)rec->height; y++, row += rec->bytesperline)
+    {
+        if (rgb)
+        {
+            for (x = 0; x < rec->width; x++)
+            {
+                rgb[3*x] = row[3*x+2];
+                rgb[3*x+1] = row[3*x+1];
+                rgb[3*x+2] = row[3*x];
+            }
+            fwrite(rgb, 3, rec->width, fp);
+        }
+        else
+            fwrite(row, channels, rec->width, fp);
+    }
+
+    free(rgb);
+    return fclose(fp);
+}
+
+
+// The stored frame a reference record points at: same camera, tag ref,
+// earlier in the file
+static const frame_record_t *resolve_ref(const frame_store_reader_t *r, uint64_t n, const void **data)
+{
+    const frame_record_t *ref, *rec = frame_store_get(r, n, NULL);
+
+    while (n-- > 0)
+    {
+        ref = frame_store_get(r, n, data);
+        if (ref && ref->camera == rec->camera && ref->tag == rec->ref && ref->size)
+            return ref;
+    }
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+    frame_store_reader_t r;
+    const frame_record_t *rec, *ref;
+    frame_record_t out;
+    const void *data;
+    uint64_t n;
+
+    if (argc != 2 && argc != 4)
+    {
+        fprintf(stderr, "Usage: %s file [frame out.pnm]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (frame_store_open(&r, argv[1]) == -1)
+    {
+        fprintf(stderr, "Cannot read %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (argc == 2)
+    {
+        printf("%llu frames\n", (unsigned long long)r.count);
+        for (n = 0; n < r.count; n++)
+        {
+            if ((rec = frame_store_get(&r, n, NULL)) == NULL)
+                continue;
+            printf("%6llu cam %u tag %6u seq %6u %.4s %ux%u %8u bytes %lld.%06lld", (unsigned long long)n,
+                   rec->camera, rec->tag, rec->sequence, (const char *)&rec->pixelformat, rec->width, rec->height,
+                   rec->size, (long long)rec->ts_sec, (long long)rec->ts_usec);
+            if (rec->ref)
+                printf(" same as tag %u", rec->ref);
+            printf("\n");
+        }
+    }
+    else
+    {
+        n = strtoull(argv[2], NULL, 0);
+        if ((rec = frame_store_get(&r, n, &data)) == NULL)
+        {
+            fprintf(stderr, "No frame %llu\n", (unsigned long long)n);
+            exit(EXIT_FAILURE);
+        }
+        if (rec->ref)
+        {
+            if ((ref = resolve_ref(&r, n, &data)) == NULL)
+            {
+                fprintf(stderr, "Frame %llu refers to tag %u, which is not in the file\n",
+                        (unsigned long long)n, rec->ref);
+                exit(EXIT_FAILURE);
+            }
+            out = *ref;
+            out.ts_sec = rec->ts_sec;
+            out.ts_usec = rec->ts_usec;
+            rec = &out;
+        }
+        if (write_pnm(argv[3], rec, data) != 0)
+            exit(EXIT_FAILURE);
+    }
+
+    frame_store_unmap(&r);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "frame_ring.h"
+
+
+int frame_ring_init(frame_ring_t *r, size_t capacity)
+{
+    size_t n = 2, i;
+
+    while (n < capacity)
+        n <<= 1;
+
+    r->cells = calloc(n, sizeof(*r->cells));
+    if (!r->cells)
+        return -1;
+
+    // Cell i is free for the push at position i
+    for (i = 0; i < n; i++)
+        r->cells[i].seq = i;
+
+    r->mask = n - 1;
+    r->head = 0;
+    r->tail = 0;
+    return 0;
+}
+
+
+void frame_ring_destroy(frame_ring_t *r)
+{
+    free(r->cells);
+    r->cells = NULL;
+}
+
+
+int frame_ring_push(frame_ring_t *r, void *item)
+{
+    frame_ring_cell_t *cell;
+    size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED), seq;
+    intptr_t diff;
+
+    for (;;)
+    {
+        cell = &r->cells[pos & r->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return -1;      // a lap behind: full
+        else
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+int frame_ring_pop(frame_ring_t *r, void **item)
+{
+    frame_ring_cell_t *cell;
+    size_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED), seq;
+    intptr_t diff;
+
+    for (;;)
+    {
+        cell = &r->cells[pos & r->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return -1;      // not yet pushed: empty
+        else
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+
+    *item = cell->item;
+
+    // Free the cell for the push one lap later
+    __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stddef.h>
+
+// Bounded lock-free pointer ring
+//
+// Each cell carries a sequence number that tells a producer whether the cell
+// is free for lap n and a consumer whether it holds lap n's item (D. Vyukov's
+// bounded MPMC queue), so any number of producers and consumers can share one
+// ring without a lock.  push and pop never block; callers that need to sleep
+// pair the ring with a semaphore or an eventfd.
+
+typedef struct
+{
+    size_t seq;
+    void *item;
+} frame_ring_cell_t;
+
+typedef struct
+{
+    frame_ring_cell_t *cells;
+    size_t mask;
+    size_t head __attribute__((aligned(64)));     // next push
+    size_t tail __attribute__((aligned(64)));     // next pop
+} frame_ring_t;
+
+// Room for at least capacity items (rounded up to a power of two).  0 or -1.
+int frame_ring_init(frame_ring_t *r, size_t capacity);
+void frame_ring_destroy(frame_ring_t *r);
+
+// 0 on success, -1 when full (push) or empty (pop).  NULL is a valid item.
+int frame_ring_push(frame_ring_t *r, void *item);
+int frame_ring_pop(frame_ring_t *r, void **item);
+
+#endif
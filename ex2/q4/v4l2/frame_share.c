@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <linux/videodev2.h>
+
+#include "frame_share.h"
+
+
+int frame_share_export(int video_fd, unsigned int index)
+{
+    struct v4l2_exportbuffer exp;
+    int r;
+
+    memset(&exp, 0, sizeof(exp));
+    exp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    exp.index = index;
+    exp.flags = O_RDONLY | O_CLOEXEC;
+
+    do
+        r = ioctl(video_fd, VIDIOC_EXPBUF, &exp);
+    while (r == -1 && errno == EINTR);
+
+    return (r == -1) ? -1 : exp.fd;
+}
+
+
+static int share_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+
+int frame_share_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (share_addr(path, &addr) == -1)
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 8) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+int frame_share_accept(int listen_fd)
+{
+    return accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+
+int frame_share_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (share_addr(path, &addr) == -1)
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+int frame_share_send(int fd, const frame_share_msg_t *m, const int *fds, int nfds)
+{
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int)*FRAME_SHARE_MAX_FDS)];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *c;
+    ssize_t n;
+
+    if (nfds < 0 || nfds > FRAME_SHARE_MAX_FDS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    iov.iov_base = (void *)m;
+    iov.iov_len = sizeof(*m);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfds)
+    {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int)*nfds);
+        c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int)*nfds);
+        memcpy(CMSG_DATA(c), fds, sizeof(int)*nfds);
+    }
+
+    do
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    while (n == -1 && errno == EINTR);
+
+    return (n == (ssize_t)sizeof(*m)) ? 0 : -1;
+}
+
+
+int frame_share_recv(int fd, frame_share_msg_t *m, int *fds, int *nfds)
+{
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int)*FRAME_SHARE_MAX_FDS)];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *c;
+    ssize_t n;
+    int got = 0;
+
+    iov.iov_base = m;
+    iov.iov_len = sizeof(*m);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    do
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    while (n == -1 && errno == EINTR);
+
+    if (n <= 0)
+        return (int)n;
+
+    for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        {
+            got = (c->cmsg_len - CMSG_LEN(0))/sizeof(int);
+            if (fds)
+                memcpy(fds, CMSG_DATA(c), sizeof(int)*got);
+            else
+                while (got > 0)
+                    close(((int *)CMSG_DATA(c))[--got]);
+        }
+    }
+
+    if (nfds)
+        *nfds = got;
+
+    if (n != (ssize_t)sizeof(*m))
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 1;
+}
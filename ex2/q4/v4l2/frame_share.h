@@ -0,0 +1,59 @@
+#ifndef FRAME_SHARE_H
+#define FRAME_SHARE_H
+
+#include <stdint.h>
+
+// Zero-copy frame sharing with other local processes
+//
+// Each MMAP capture buffer is exported once as a dmabuf (VIDIOC_EXPBUF).  A
+// client connects to a SOCK_SEQPACKET Unix socket and gets one HELLO per
+// camera carrying that camera's format and, as SCM_RIGHTS, its buffers' dmabuf
+// fds, which it mmaps read-only.  From then on every captured frame is
+// announced with a FRAME message naming the buffer; the client reads it in
+// place and answers RELEASE.  capture.c requeues a buffer only when its own
+// processing and every client it was sent to have let go, so nothing is
+// copied and nothing is overwritten while a client still reads it.
+
+#define FRAME_SHARE_MAX_FDS (32)
+
+enum frame_share_type
+{
+    SHARE_HELLO = 1,        // server: camera format, buffer fds attached
+    SHARE_FRAME,            // server: buffer index holds a new frame
+    SHARE_RELEASE           // client: done with buffer index
+};
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t camera;
+    uint32_t index;         // FRAME, RELEASE: buffer
+    uint32_t n_cameras;     // HELLO
+    uint32_t n_buffers;     // HELLO: fds attached
+    uint32_t length;        // HELLO: bytes per buffer
+    uint32_t width, height, bytesperline, pixelformat;      // HELLO
+    uint32_t bytesused;     // FRAME
+    uint32_t sequence;      // FRAME: v4l2_buffer.sequence
+    int64_t ts_sec, ts_usec;// FRAME: v4l2_buffer.timestamp
+} frame_share_msg_t;
+
+// Export buffer index of an MMAP video fd as a read-only dmabuf.  fd or -1.
+int frame_share_export(int video_fd, unsigned int index);
+
+// Listening socket at path (replacing a stale one), non-blocking.  fd or -1.
+int frame_share_listen(const char *path);
+
+// Accept one client, non-blocking.  fd or -1.
+int frame_share_accept(int listen_fd);
+
+// Client side: connect to path.  fd or -1.
+int frame_share_connect(const char *path);
+
+// Send m with nfds descriptors attached (0 for none).  0 or -1.
+int frame_share_send(int fd, const frame_share_msg_t *m, const int *fds, int nfds);
+
+// Receive one message and up to FRAME_SHARE_MAX_FDS descriptors.
+// 1 received, 0 peer closed, -1 error (EAGAIN when non-blocking and empty).
+int frame_share_recv(int fd, frame_share_msg_t *m, int *fds, int *nfds);
+
+#endif
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "dump_writer.h"
+#include "frame_store.h"
+
+#define STORE_PAD(n) (((n) + FRAME_STORE_ALIGN - 1) & ~(uint64_t)(FRAME_STORE_ALIGN - 1))
+
+// Payloads start on an alignment boundary
+_Static_assert(sizeof(frame_store_header_t) == FRAME_STORE_ALIGN, "header size");
+_Static_assert(sizeof(frame_record_t) == FRAME_STORE_ALIGN, "record size");
+
+
+static int write_all(int fd, const void *p, size_t len, uint64_t off)
+{
+    const unsigned char *b = p;
+    ssize_t n;
+
+    while (len)
+    {
+        n = pwrite(fd, b, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        b += n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+static void store_header(frame_store_header_t *h, uint64_t count, uint64_t index_offset)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, FRAME_STORE_MAGIC, sizeof(h->magic));
+    h->version = FRAME_STORE_VERSION;
+    h->header_size = sizeof(*h);
+    h->frame_count = count;
+    h->index_offset = index_offset;
+    h->align = FRAME_STORE_ALIGN;
+}
+
+
+int frame_store_create(frame_store_t *s, const char *path, uint64_t prealloc, int async)
+{
+    frame_store_header_t h;
+
+    memset(s, 0, sizeof(*s));
+    s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 00666);
+    if (s->fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    store_header(&h, 0, 0);
+    if (write_all(s->fd, &h, sizeof(h), 0) == -1)
+    {
+        perror(path);
+        close(s->fd);
+        return -1;
+    }
+
+    s->async = async;
+    s->end = STORE_PAD(sizeof(h));
+    s->chunk = prealloc;
+    pthread_mutex_init(&s->lock, NULL);
+    return 0;
+}
+
+
+// Called with the lock held: make sure [0, end) is allocated
+static void store_grow(frame_store_t *s, uint64_t end)
+{
+    uint64_t want;
+
+    if (s->chunk == 0 || end <= s->allocated)
+        return;
+
+    want = ((end + s->chunk - 1)/s->chunk)*s->chunk;
+
+    // FALLOC_FL_KEEP_SIZE so a crash leaves no run of zeros after the last
+    // record; unsupported filesystems just allocate as they go
+    if (fallocate(s->fd, FALLOC_FL_KEEP_SIZE, s->allocated, want - s->allocated) == -1)
+    {
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+            perror("fallocate");
+        s->chunk = 0;
+        return;
+    }
+
+    s->allocated = want;
+}
+
+
+int frame_store_append(frame_store_t *s, frame_record_t *rec, const void *data, size_t size, uint64_t stamp)
+{
+    struct iovec iov[2];
+    uint64_t off;
+    int rc = 0;
+
+    rec->magic = FRAME_RECORD_MAGIC;
+    rec->size = size;
+
+    // The offset is only kept if the write is queued, so a dropped frame
+    // leaves no hole in the file
+    pthread_mutex_lock(&s->lock);
+
+    if (s->count == s->cap)
+    {
+        size_t cap = s->cap ? 2*s->cap : 1024;
+        uint64_t *idx = realloc(s->index, cap*sizeof(*idx));
+
+        if (!idx)
+        {
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+        s->index = idx;
+        s->cap = cap;
+    }
+
+    off = s->end;
+    store_grow(s, off + STORE_PAD(sizeof(*rec) + size));
+
+    if (s->async)
+        rc = dump_writer_submit_at(s->fd, off, rec, sizeof(*rec), data, size, stamp);
+    else
+    {
+        iov[0].iov_base = rec;
+        iov[0].iov_len = sizeof(*rec);
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len = size;
+        if (pwritev(s->fd, iov, 2, off) != (ssize_t)(sizeof(*rec) + size))
+            rc = -1;
+    }
+
+    if (rc == 0)
+    {
+        s->index[s->count++] = off;
+        s->end = off + STORE_PAD(sizeof(*rec) + size);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+
+int frame_store_close(frame_store_t *s)
+{
+    frame_store_header_t h;
+    frame_index_t ih;
+    int rc = 0;
+
+    ih.magic = FRAME_INDEX_MAGIC;
+    ih.reserved = 0;
+    ih.count = s->count;
+
+    if (write_all(s->fd, &ih, sizeof(ih), s->end) == -1 ||
+        write_all(s->fd, s->index, s->count*sizeof(*s->index), s->end + sizeof(ih)) == -1 ||
+        ftruncate(s->fd, s->end + sizeof(ih) + s->count*sizeof(*s->index)) == -1)
+        rc = -1;
+
+    // The header goes last, after the index is on disk
+    if (rc == 0 && fdatasync(s->fd) == -1)
+        rc = -1;
+
+    store_header(&h, s->count, s->end);
+    if (rc == 0 && write_all(s->fd, &h, sizeof(h), 0) == -1)
+        rc = -1;
+
+    if (close(s->fd) == -1)
+        rc = -1;
+    if (rc == -1)
+        perror("frame_store_close");
+
+    pthread_mutex_destroy(&s->lock);
+    free(s->index);
+    s->index = NULL;
+    return rc;
+}
+
+
+// Walk records from the header on, for a file that was never closed
+static int store_rebuild(frame_store_reader_t *r, uint64_t start)
+{
+    const frame_record_t *rec;
+    uint64_t off = start, cap = 0, *idx;
+
+    r->count = 0;
+    while (off + sizeof(*rec) <= r->len)
+    {
+        rec = (const frame_record_t *)(r->map + off);
+        if (rec->magic != FRAME_RECORD_MAGIC || off + sizeof(*rec) + rec->size > r->len)
+            break;
+
+        if (r->count == cap)
+        {
+            cap = cap ? 2*cap : 1024;
+            if ((idx = realloc(r->rebuilt, cap*sizeof(*idx))) == NULL)
+                return -1;
+            r->rebuilt = idx;
+        }
+        r->rebuilt[r->count++] = off;
+        off += STORE_PAD(sizeof(*rec) + rec->size);
+    }
+
+    r->index = r->rebuilt;
+    return 0;
+}
+
+
+int frame_store_open(frame_store_reader_t *r, const char *path)
+{
+    const frame_store_header_t *h;
+    const frame_index_t *ih;
+    struct stat st;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*h))
+    {
+        close(fd);
+        return -1;
+    }
+
+    r->len = st.st_size;
+    r->map = mmap(NULL, r->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->map == MAP_FAILED)
+    {
+        r->map = NULL;
+        return -1;
+    }
+
+    h = (const frame_store_header_t *)r->map;
+    if (memcmp(h->magic, FRAME_STORE_MAGIC, sizeof(h->magic)) || h->version != FRAME_STORE_VERSION)
+    {
+        frame_store_unmap(r);
+        return -1;
+    }
+
+    ih = (const frame_index_t *)(r->map + h->index_offset);
+    if (h->index_offset && h->index_offset + sizeof(*ih) <= r->len && ih->magic == FRAME_INDEX_MAGIC &&
+        ih->count == h->frame_count && h->index_offset + sizeof(*ih) + ih->count*sizeof(uint64_t) <= r->len)
+    {
+        r->count = ih->count;
+        r->index = (const uint64_t *)(ih + 1);
+        return 0;
+    }
+
+    if (store_rebuild(r, STORE_PAD(h->header_size)) == -1)
+    {
+        frame_store_unmap(r);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void frame_store_unmap(frame_store_reader_t *r)
+{
+    if (r->map)
+        munmap((void *)r->map, r->len);
+    free(r->rebuilt);
+    memset(r, 0, sizeof(*r));
+}
+
+
+const frame_record_t *frame_store_get(const frame_store_reader_t *r, uint64_t n, const void **data)
+{
+    const frame_record_t *rec;
+
+    if (n >= r->count || r->index[n] + sizeof(*rec) > r->len)
+        return NULL;
+
+    rec = (const frame_record_t *)(r->map + r->index[n]);
+    if (rec->magic != FRAME_RECORD_MAGIC || r->index[n] + sizeof(*rec) + rec->size > r->len)
+        return NULL;
+
+    if (data)
+        *data = rec + 1;
+    return rec;
+}
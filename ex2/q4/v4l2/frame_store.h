@@ -0,0 +1,106 @@
+#ifndef FRAME_STORE_H
+#define FRAME_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Single-file frame container
+//
+//   header      64 bytes, frame_store_header_t
+//   records     frame_record_t (64 bytes) + payload, each padded to 64
+//   index       frame_index_t + one uint64_t record offset per frame
+//
+// Frames are appended at offsets handed out under a lock, so concurrent
+// workers (and the background dump writer, which may complete them out of
+// order) never overlap.  The index and the header's index_offset are written
+// by frame_store_close(); a reader of a file that was never closed (crash,
+// power loss) rebuilds the index by walking the records.  All fields are
+// little-endian, as written by the capture host.
+
+#define FRAME_STORE_MAGIC   "V4L2FRM1"
+#define FRAME_STORE_VERSION (1)
+#define FRAME_STORE_ALIGN   (64)
+#define FRAME_RECORD_MAGIC  (0x43455246)    // "FREC"
+#define FRAME_INDEX_MAGIC   (0x58444946)    // "FIDX"
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t frame_count;       // valid once index_offset is set
+    uint64_t index_offset;      // 0 until closed cleanly
+    uint32_t align;
+    uint32_t reserved[7];
+} frame_store_header_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t pixelformat;       // V4L2 fourcc of the payload (GREY, RGB24, ...)
+    uint32_t width, height;
+    uint32_t bytesperline;
+    uint32_t size;              // payload bytes after this record
+    uint32_t sequence;          // v4l2_buffer.sequence
+    uint32_t flags;             // v4l2_buffer.flags
+    int64_t ts_sec, ts_usec;    // v4l2_buffer.timestamp
+    uint32_t tag;               // capture frame number
+    uint32_t camera;            // capture -d order
+    uint32_t ref;               // capture -e: size 0, same as frame tag ref
+    uint32_t reserved;
+} frame_record_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t count;
+} frame_index_t;
+
+
+// ---- writer ----
+
+typedef struct
+{
+    int fd;
+    int async;                  // payloads go through dump_writer_submit_at()
+    uint64_t end;               // next record offset
+    uint64_t allocated;         // fallocate()d so far
+    uint64_t chunk;
+    uint64_t *index;
+    size_t count, cap;
+    pthread_mutex_t lock;
+} frame_store_t;
+
+// Create path, preallocating in prealloc byte steps.  async appends through
+// the background dump writer (which must then be stopped before close).
+int frame_store_create(frame_store_t *s, const char *path, uint64_t prealloc, int async);
+
+// Append rec (magic and size are filled in) + data.  stamp goes to the dump
+// writer's done hook when async.  0, 1 dropped by the dump writer, -1 error.
+int frame_store_append(frame_store_t *s, frame_record_t *rec, const void *data, size_t size, uint64_t stamp);
+
+// Write the index and header, trim the preallocated tail.  0 or -1.
+int frame_store_close(frame_store_t *s);
+
+
+// ---- reader ----
+
+typedef struct
+{
+    const unsigned char *map;
+    size_t len;
+    uint64_t count;
+    const uint64_t *index;      // into map, or the rebuilt copy
+    uint64_t *rebuilt;
+} frame_store_reader_t;
+
+// mmap path.  0 or -1.
+int frame_store_open(frame_store_reader_t *r, const char *path);
+void frame_store_unmap(frame_store_reader_t *r);
+
+// Record n and its payload, NULL if n is out of range
+const frame_record_t *frame_store_get(const frame_store_reader_t *r, uint64_t n, const void **data);
+
+#endif
@@ -0,0 +1,100 @@
+#include <string.h>
+
+#include "latency_hist.h"
+
+
+static inline int lat_index(uint64_t v)
+{
+    int m;
+
+    if (v < 2*LAT_SUB_COUNT)
+        return (int)v;
+
+    // v has m+1 significant bits: keep the top LAT_SUB_BITS+1
+    m = 63 - __builtin_clzll(v);
+    return (m - LAT_SUB_BITS)*LAT_SUB_COUNT + (int)(v >> (m - LAT_SUB_BITS));
+}
+
+
+// Largest value that lands in bucket i
+static uint64_t lat_value(int i)
+{
+    int m, shift;
+    uint64_t sub;
+
+    if (i < 2*LAT_SUB_COUNT)
+        return i;
+
+    m = i/LAT_SUB_COUNT + LAT_SUB_BITS - 1;
+    shift = m - LAT_SUB_BITS;
+    sub = (uint64_t)(i % LAT_SUB_COUNT + LAT_SUB_COUNT);
+    return ((sub + 1) << shift) - 1;
+}
+
+
+void lat_hist_init(lat_hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+
+void lat_hist_record(lat_hist_t *h, uint64_t v)
+{
+    uint64_t cur;
+
+    __atomic_fetch_add(&h->count[lat_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+
+    cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (v < cur && !__atomic_compare_exchange_n(&h->min, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(&h->max, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+uint64_t lat_hist_percentile(const lat_hist_t *h, double pct)
+{
+    uint64_t want, seen = 0;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+
+    want = (uint64_t)(pct/100.0*h->total + 0.5);
+    if (want < 1)
+        want = 1;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+    {
+        seen += h->count[i];
+        if (seen >= want)
+            return lat_value(i) < h->max ? lat_value(i) : h->max;
+    }
+
+    return h->max;
+}
+
+
+void lat_hist_print_header(FILE *fp)
+{
+    fprintf(fp, "%-20s %8s %9s %9s %9s %9s %9s %9s   (ms)\n",
+            "stage", "count", "min", "p50", "p90", "p99", "p99.9", "max");
+}
+
+
+void lat_hist_print(FILE *fp, const char *name, const lat_hist_t *h)
+{
+    if (h->total == 0)
+    {
+        fprintf(fp, "%-20s %8d\n", name, 0);
+        return;
+    }
+
+    fprintf(fp, "%-20s %8llu %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", name, (unsigned long long)h->total,
+            h->min/1e6, lat_hist_percentile(h, 50.0)/1e6, lat_hist_percentile(h, 90.0)/1e6,
+            lat_hist_percentile(h, 99.0)/1e6, lat_hist_percentile(h, 99.9)/1e6, h->max/1e6);
+}
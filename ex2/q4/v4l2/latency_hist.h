@@ -0,0 +1,36 @@
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Log-linear latency histogram (the HdrHistogram layout)
+//
+// Values below 2^(LAT_SUB_BITS+1) get a bucket each; above that every power
+// of two is split into 2^LAT_SUB_BITS equal buckets, so any recorded value is
+// known to within 1/64 (1.6%) from 1 ns to the full 64-bit range in 30 KB.
+// Recording is a few atomic adds, safe from any number of threads.
+
+#define LAT_SUB_BITS (6)
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB_COUNT)
+
+typedef struct
+{
+    uint64_t count[LAT_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min, max;
+} lat_hist_t;
+
+void lat_hist_init(lat_hist_t *h);
+void lat_hist_record(lat_hist_t *h, uint64_t v);
+
+// Smallest recorded bucket value v such that pct percent of samples are <= v
+uint64_t lat_hist_percentile(const lat_hist_t *h, double pct);
+
+// One row: count, min, p50, p90, p99, p99.9, max in ms (values are ns)
+void lat_hist_print_header(FILE *fp);
+void lat_hist_print(FILE *fp, const char *name, const lat_hist_t *h);
+
+#endif
@@ -0,0 +1,273 @@
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "luma_view.h"
+
+
+void luma_view_yuyv(luma_view_t *v, const void *yuyv, size_t bytesperline, int width, int height)
+{
+    v->base = (const unsigned char *)yuyv;
+    v->stride = bytesperline;
+    v->step = 2;
+    v->width = width;
+    v->height = height;
+}
+
+
+void luma_view_grey(luma_view_t *v, const void *grey, size_t bytesperline, int width, int height)
+{
+    v->base = (const unsigned char *)grey;
+    v->stride = bytesperline;
+    v->step = 1;
+    v->width = width;
+    v->height = height;
+}
+
+
+#if defined(__SSE2__)
+
+// Eight luma samples from pixel x on as 16-bit words.  For YUYV masking off
+// the chroma bytes leaves Y already widened, so no shuffle is needed.
+static inline __m128i luma_load8(const unsigned char *row, int x, int step)
+{
+    if (step == 2)
+        return _mm_and_si128(_mm_loadu_si128((const __m128i *)(row + 2*x)), _mm_set1_epi16(0x00ff));
+
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x)), _mm_setzero_si128());
+}
+
+#endif
+
+
+void luma_extract(const luma_view_t *v, unsigned char *out, size_t out_stride)
+{
+    const unsigned char *in;
+    int x, y;
+
+    for (y = 0; y < v->height; y++, out += out_stride)
+    {
+        in = luma_row(v, y);
+
+        if (v->step == 1)
+        {
+            memcpy(out, in, v->width);
+            continue;
+        }
+
+        x = 0;
+#if defined(__SSE2__)
+        // 32 bytes of YUYV to 16 bytes of Y
+        for (; x + 16 <= v->width; x += 16)
+            _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(luma_load8(in, x, 2), luma_load8(in, x + 8, 2)));
+#endif
+        for (; x < v->width; x++)
+            out[x] = in[2*x];
+    }
+}
+
+
+void luma_threshold(const luma_view_t *v, int thresh, unsigned char *out, size_t out_stride)
+{
+    const unsigned char *in;
+    int x, y;
+
+    for (y = 0; y < v->height; y++, out += out_stride)
+    {
+        in = luma_row(v, y);
+        x = 0;
+#if defined(__SSE2__)
+        __m128i t = _mm_set1_epi16(thresh < 0 ? -1 : (thresh > 255 ? 255 : thresh));
+
+        for (; x + 16 <= v->width; x += 16)
+            _mm_storeu_si128((__m128i *)(out + x),
+                             _mm_packs_epi16(_mm_cmpgt_epi16(luma_load8(in, x, v->step), t),
+                                             _mm_cmpgt_epi16(luma_load8(in, x + 8, v->step), t)));
+#endif
+        for (; x < v->width; x++)
+            out[x] = (in[(size_t)x*v->step] > thresh) ? 255 : 0;
+    }
+}
+
+
+static inline int sobel_at(const unsigned char *a, const unsigned char *b, const unsigned char *c, int x, int step)
+{
+    int l = (x - 1)*step, r = (x + 1)*step, m = x*step;
+    int gx = (a[r] + 2*b[r] + c[r]) - (a[l] + 2*b[l] + c[l]);
+    int gy = (c[l] + 2*c[m] + c[r]) - (a[l] + 2*a[m] + a[r]);
+    int g = abs(gx) + abs(gy);
+
+    return g > 255 ? 255 : g;
+}
+
+
+void luma_sobel(const luma_view_t *v, unsigned char *out, size_t out_stride)
+{
+    const unsigned char *a, *b, *c;
+    unsigned char *o;
+    int x, y, w = v->width, h = v->height;
+
+    if (w < 3 || h < 3)
+    {
+        for (y = 0; y < h; y++)
+            memset(out + (size_t)y*out_stride, 0, w);
+        return;
+    }
+
+    memset(out, 0, w);
+    memset(out + (size_t)(h - 1)*out_stride, 0, w);
+
+    for (y = 1; y < h - 1; y++)
+    {
+        a = luma_row(v, y - 1);
+        b = luma_row(v, y);
+        c = luma_row(v, y + 1);
+        o = out + (size_t)y*out_stride;
+
+        o[0] = 0;
+        o[w - 1] = 0;
+        x = 1;
+#if defined(__SSE2__)
+        // Eight outputs per iteration from nine word loads; the sums fit
+        // in 16 bits (|Gx|, |Gy| <= 1020)
+        for (; x + 8 <= w - 1; x += 8)
+        {
+            __m128i al = luma_load8(a, x - 1, v->step), am = luma_load8(a, x, v->step), ar = luma_load8(a, x + 1, v->step);
+            __m128i bl = luma_load8(b, x - 1, v->step), br = luma_load8(b, x + 1, v->step);
+            __m128i cl = luma_load8(c, x - 1, v->step), cm = luma_load8(c, x, v->step), cr = luma_load8(c, x + 1, v->step);
+            __m128i gx, gy, zero = _mm_setzero_si128();
+
+            gx = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(ar, cr), _mm_add_epi16(br, br)),
+                               _mm_add_epi16(_mm_add_epi16(al, cl), _mm_add_epi16(bl, bl)));
+            gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(cl, cr), _mm_add_epi16(cm, cm)),
+                               _mm_add_epi16(_mm_add_epi16(al, ar), _mm_add_epi16(am, am)));
+            gx = _mm_max_epi16(gx, _mm_sub_epi16(zero, gx));
+            gy = _mm_max_epi16(gy, _mm_sub_epi16(zero, gy));
+
+            _mm_storel_epi64((__m128i *)(o + x), _mm_packus_epi16(_mm_add_epi16(gx, gy), zero));
+        }
+#endif
+        for (; x < w - 1; x++)
+            o[x] = sobel_at(a, b, c, x, v->step);
+    }
+}
+
+
+long luma_diff(const luma_view_t *a, const luma_view_t *b, int thresh)
+{
+    const unsigned char *pa, *pb;
+    long count = 0;
+    int x, y, d;
+
+    for (y = 0; y < a->height; y++)
+    {
+        pa = luma_row(a, y);
+        pb = luma_row(b, y);
+        x = 0;
+#if defined(__SSE2__)
+        __m128i t = _mm_set1_epi16(thresh < 0 ? -1 : (thresh > 255 ? 255 : thresh)), zero = _mm_setzero_si128();
+
+        // Each word that passes sets two mask bits
+        for (; x + 8 <= a->width; x += 8)
+        {
+            __m128i dv = _mm_sub_epi16(luma_load8(pa, x, a->step), luma_load8(pb, x, b->step));
+
+            dv = _mm_max_epi16(dv, _mm_sub_epi16(zero, dv));
+            count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi16(dv, t))) / 2;
+        }
+#endif
+        for (; x < a->width; x++)
+        {
+            d = pa[(size_t)x*a->step] - pb[(size_t)x*b->step];
+            count += abs(d) > thresh;
+        }
+    }
+
+    return count;
+}
+
+
+// Sum of pixels x..end-1 of one luma row
+static inline unsigned int luma_sum(const unsigned char *row, int x, int end, int step)
+{
+    unsigned int s = 0;
+
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+
+    // The words' high bytes are zero, so a SAD against zero sums the Y bytes
+    for (; x + 8 <= end; x += 8)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(luma_load8(row, x, step), zero));
+    s = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; x < end; x++)
+        s += row[(size_t)x*step];
+
+    return s;
+}
+
+
+void luma_signature(const luma_view_t *v, unsigned char *sig)
+{
+    unsigned int acc[LUMA_SIG_W], n;
+    int x0[LUMA_SIG_W + 1];
+    int bx, by, y, y0, y1;
+    const unsigned char *row;
+
+    for (bx = 0; bx <= LUMA_SIG_W; bx++)
+        x0[bx] = bx*v->width/LUMA_SIG_W;
+
+    for (by = 0; by < LUMA_SIG_H; by++)
+    {
+        y0 = by*v->height/LUMA_SIG_H;
+        y1 = (by + 1)*v->height/LUMA_SIG_H;
+        memset(acc, 0, sizeof(acc));
+
+        for (y = y0; y < y1; y++)
+        {
+            row = luma_row(v, y);
+            for (bx = 0; bx < LUMA_SIG_W; bx++)
+                acc[bx] += luma_sum(row, x0[bx], x0[bx + 1], v->step);
+        }
+
+        for (bx = 0; bx < LUMA_SIG_W; bx++)
+        {
+            n = (unsigned int)(x0[bx + 1] - x0[bx])*(y1 - y0);
+            *sig++ = n ? (acc[bx] + n/2)/n : 0;
+        }
+    }
+}
+
+
+int luma_sig_distance(const unsigned char *a, const unsigned char *b)
+{
+    int i = 0, d, max = 0;
+
+#if defined(__SSE2__)
+    __m128i m = _mm_setzero_si128(), va, vb;
+
+    // |a - b| as the OR of both saturating differences, one of which is 0
+    for (; i + 16 <= LUMA_SIG_SIZE; i += 16)
+    {
+        va = _mm_loadu_si128((const __m128i *)(a + i));
+        vb = _mm_loadu_si128((const __m128i *)(b + i));
+        m = _mm_max_epu8(m, _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va)));
+    }
+    m = _mm_max_epu8(m, _mm_srli_si128(m, 8));
+    m = _mm_max_epu8(m, _mm_srli_si128(m, 4));
+    m = _mm_max_epu8(m, _mm_srli_si128(m, 2));
+    m = _mm_max_epu8(m, _mm_srli_si128(m, 1));
+    max = _mm_cvtsi128_si32(m) & 0xff;
+#endif
+    for (; i < LUMA_SIG_SIZE; i++)
+    {
+        d = abs(a[i] - b[i]);
+        if (d > max)
+            max = d;
+    }
+
+    return max;
+}
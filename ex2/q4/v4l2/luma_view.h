@@ -0,0 +1,60 @@
+#ifndef LUMA_VIEW_H
+#define LUMA_VIEW_H
+
+#include <stddef.h>
+
+// Strided luma view over a captured buffer
+//
+// A YUYV row is Y0 U0 Y1 V0 ..., so luma is every other byte and the view
+// just records where it is: step 2 for YUYV, 1 for GREY, and bytesperline
+// between rows.  The operators below read the driver's buffer through the
+// view, so grayscale analytics need no separate Y plane.  luma_extract()
+// packs one when a contiguous plane is really needed (a PGM dump, a library
+// that wants width-stride bytes).
+
+typedef struct
+{
+    const unsigned char *base;  // Y of pixel (0,0)
+    size_t stride;              // bytes between rows
+    int step;                   // bytes between pixels
+    int width, height;
+} luma_view_t;
+
+void luma_view_yuyv(luma_view_t *v, const void *yuyv, size_t bytesperline, int width, int height);
+void luma_view_grey(luma_view_t *v, const void *grey, size_t bytesperline, int width, int height);
+
+static inline const unsigned char *luma_row(const luma_view_t *v, int y)
+{
+    return v->base + (size_t)y*v->stride;
+}
+
+static inline unsigned char luma_at(const luma_view_t *v, int x, int y)
+{
+    return luma_row(v, y)[(size_t)x*v->step];
+}
+
+// Packed width x height plane, out_stride bytes per output row
+void luma_extract(const luma_view_t *v, unsigned char *out, size_t out_stride);
+
+// 255 where Y > thresh, else 0
+void luma_threshold(const luma_view_t *v, int thresh, unsigned char *out, size_t out_stride);
+
+// |Gx| + |Gy| of the 3x3 Sobel, clamped to 255; the one pixel border is 0
+void luma_sobel(const luma_view_t *v, unsigned char *out, size_t out_stride);
+
+// Number of pixels where |a - b| > thresh; the views must be the same size
+long luma_diff(const luma_view_t *a, const luma_view_t *b, int thresh);
+
+// Frame signature: the mean luma of each block of a LUMA_SIG_W x LUMA_SIG_H
+// grid, so sensor noise averages out while anything moving in a block shifts
+// its mean.  Frames are alike when no block moved by more than a threshold.
+#define LUMA_SIG_W (16)
+#define LUMA_SIG_H (12)
+#define LUMA_SIG_SIZE (LUMA_SIG_W * LUMA_SIG_H)
+
+void luma_signature(const luma_view_t *v, unsigned char *sig);
+
+// Largest block difference of two signatures, 0..255
+int luma_sig_distance(const unsigned char *a, const unsigned char *b);
+
+#endif
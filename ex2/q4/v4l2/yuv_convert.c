@@ -0,0 +1,236 @@
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "yuv_convert.h"
+
+
+void yuv_coef_init(yuv_coef_t *c, yuv_matrix_t matrix, yuv_range_t range, int bgr)
+{
+    double kr = (matrix == YUV_BT709) ? 0.2126 : 0.299;
+    double kb = (matrix == YUV_BT709) ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double ys = 1.0, cs = 1.0;
+
+    // Limited range stretches 219 luma and 224 chroma steps to 255
+    if (range == YUV_RANGE_LIMITED)
+    {
+        ys = 255.0 / 219.0;
+        cs = 255.0 / 224.0;
+    }
+
+    c->y = (short)lround(256.0 * ys);
+    c->rv = (short)lround(256.0 * cs * 2.0 * (1.0 - kr));
+    c->gu = (short)-lround(256.0 * cs * 2.0 * (1.0 - kb) * kb / kg);
+    c->gv = (short)-lround(256.0 * cs * 2.0 * (1.0 - kr) * kr / kg);
+    c->bu = (short)lround(256.0 * cs * 2.0 * (1.0 - kb));
+    c->yoff = (range == YUV_RANGE_LIMITED) ? 16 : 0;
+    c->bgr = bgr;
+}
+
+
+static inline unsigned char clamp8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+
+// One macropixel, two output pixels
+static inline void yuyv_pair(const unsigned char *in, unsigned char *out, const yuv_coef_t *c)
+{
+    int c0 = (in[0] - c->yoff) * c->y, c1 = (in[2] - c->yoff) * c->y;
+    int d = in[1] - 128, e = in[3] - 128;
+    int r = c->rv * e + 128, g = c->gu * d + c->gv * e + 128, b = c->bu * d + 128;
+    int ri = c->bgr ? 2 : 0, bi = c->bgr ? 0 : 2;
+
+    out[ri] = clamp8((c0 + r) >> 8);
+    out[1] = clamp8((c0 + g) >> 8);
+    out[bi] = clamp8((c0 + b) >> 8);
+    out[3 + ri] = clamp8((c1 + r) >> 8);
+    out[4] = clamp8((c1 + g) >> 8);
+    out[3 + bi] = clamp8((c1 + b) >> 8);
+}
+
+
+#if defined(__SSSE3__)
+
+// pshufb masks: word pairs (Y,U) and (Y,V) per pixel, and the scatter of
+// 16 R, G and B bytes into three 16-byte runs of RGB24
+static __m128i yu_mask, yv_mask, rgb_mask[3][3];
+static pthread_once_t masks_once = PTHREAD_ONCE_INIT;
+
+static void yuv_build_masks(void)
+{
+    unsigned char m[16];
+    int k, o, ch;
+
+    // Words in a register: Y0 U0 Y1 V0 Y2 U1 Y3 V1
+    static const unsigned char yu_words[8] = {0, 1, 2, 1, 4, 5, 6, 5};
+    static const unsigned char yv_words[8] = {0, 3, 2, 3, 4, 7, 6, 7};
+
+    for (k = 0; k < 8; k++)
+    {
+        m[2*k] = 2*yu_words[k]; m[2*k+1] = 2*yu_words[k] + 1;
+    }
+    yu_mask = _mm_loadu_si128((const __m128i *)m);
+    for (k = 0; k < 8; k++)
+    {
+        m[2*k] = 2*yv_words[k]; m[2*k+1] = 2*yv_words[k] + 1;
+    }
+    yv_mask = _mm_loadu_si128((const __m128i *)m);
+
+    for (o = 0; o < 3; o++)
+    {
+        for (ch = 0; ch < 3; ch++)
+        {
+            for (k = 0; k < 16; k++)
+                m[k] = ((o*16 + k) % 3 == ch) ? (o*16 + k) / 3 : 0x80;
+            rgb_mask[o][ch] = _mm_loadu_si128((const __m128i *)m);
+        }
+    }
+}
+
+
+// Four pixels of offset words (c,d,c,e,...) to R, G and B in 32-bit lanes
+static inline void yuv_quad(__m128i w, __m128i kr, __m128i kg1, __m128i kg2, __m128i kb,
+                            __m128i rnd, __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i yu = _mm_shuffle_epi8(w, yu_mask), yv = _mm_shuffle_epi8(w, yv_mask);
+
+    *r = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yv, kr), rnd), 8);
+    *g = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(yu, kg1), _mm_madd_epi16(yv, kg2)), rnd), 8);
+    *b = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yu, kb), rnd), 8);
+}
+
+
+// 16 pixels per iteration
+static void yuyv_row(const unsigned char *in, unsigned char *out, int width, const yuv_coef_t *c)
+{
+    __m128i zero = _mm_setzero_si128(), rnd = _mm_set1_epi32(128);
+    __m128i off = _mm_setr_epi16(c->yoff, 128, c->yoff, 128, c->yoff, 128, c->yoff, 128);
+    __m128i kr = _mm_setr_epi16(c->y, c->rv, c->y, c->rv, c->y, c->rv, c->y, c->rv);
+    __m128i kg1 = _mm_setr_epi16(c->y, c->gu, c->y, c->gu, c->y, c->gu, c->y, c->gu);
+    __m128i kg2 = _mm_setr_epi16(0, c->gv, 0, c->gv, 0, c->gv, 0, c->gv);
+    __m128i kb = _mm_setr_epi16(c->y, c->bu, c->y, c->bu, c->y, c->bu, c->y, c->bu);
+    __m128i w[4], r[4], g[4], b[4], R, G, B, lo, hi;
+    int x = 0, q, o;
+
+    pthread_once(&masks_once, yuv_build_masks);
+
+    for (; x + 16 <= width; x += 16, in += 32, out += 48)
+    {
+        lo = _mm_loadu_si128((const __m128i *)in);
+        hi = _mm_loadu_si128((const __m128i *)(in + 16));
+        w[0] = _mm_sub_epi16(_mm_unpacklo_epi8(lo, zero), off);
+        w[1] = _mm_sub_epi16(_mm_unpackhi_epi8(lo, zero), off);
+        w[2] = _mm_sub_epi16(_mm_unpacklo_epi8(hi, zero), off);
+        w[3] = _mm_sub_epi16(_mm_unpackhi_epi8(hi, zero), off);
+
+        for (q = 0; q < 4; q++)
+            yuv_quad(w[q], kr, kg1, kg2, kb, rnd, &r[q], &g[q], &b[q]);
+
+        // packs keeps the sign for packus to clamp at 0 and 255
+        R = _mm_packus_epi16(_mm_packs_epi32(r[0], r[1]), _mm_packs_epi32(r[2], r[3]));
+        G = _mm_packus_epi16(_mm_packs_epi32(g[0], g[1]), _mm_packs_epi32(g[2], g[3]));
+        B = _mm_packus_epi16(_mm_packs_epi32(b[0], b[1]), _mm_packs_epi32(b[2], b[3]));
+        if (c->bgr)
+        {
+            lo = R; R = B; B = lo;
+        }
+
+        for (o = 0; o < 3; o++)
+            _mm_storeu_si128((__m128i *)(out + 16*o),
+                             _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(R, rgb_mask[o][0]),
+                                                       _mm_shuffle_epi8(G, rgb_mask[o][1])),
+                                          _mm_shuffle_epi8(B, rgb_mask[o][2])));
+    }
+
+    for (; x < width; x += 2, in += 4, out += 6)
+        yuyv_pair(in, out, c);
+}
+
+const char *yuv_convert_isa(void) { return "SSSE3"; }
+
+#else
+
+static void yuyv_row(const unsigned char *in, unsigned char *out, int width, const yuv_coef_t *c)
+{
+    int x;
+
+    for (x = 0; x < width; x += 2, in += 4, out += 6)
+        yuyv_pair(in, out, c);
+}
+
+const char *yuv_convert_isa(void) { return "scalar"; }
+
+#endif
+
+
+void yuyv_to_rgb_rows(const unsigned char *yuyv, size_t in_stride, unsigned char *rgb, size_t out_stride,
+                      int width, int rows, const yuv_coef_t *c)
+{
+    int i;
+
+    for (i = 0; i < rows; i++)
+        yuyv_row(yuyv + i*in_stride, rgb + i*out_stride, width, c);
+}
+
+
+typedef struct
+{
+    const unsigned char *yuyv;
+    size_t in_stride;
+    unsigned char *rgb;
+    int width, rows;
+    const yuv_coef_t *c;
+} yuv_slice_t;
+
+static void *yuv_slice(void *arg)
+{
+    yuv_slice_t *s = (yuv_slice_t *)arg;
+
+    yuyv_to_rgb_rows(s->yuyv, s->in_stride, s->rgb, (size_t)s->width*3, s->width, s->rows, s->c);
+    return NULL;
+}
+
+
+void yuyv_to_rgb(const unsigned char *yuyv, size_t in_stride, unsigned char *rgb,
+                 int width, int height, const yuv_coef_t *c, int nthreads)
+{
+    pthread_t tid[YUV_MAX_THREADS];
+    yuv_slice_t slice[YUV_MAX_THREADS];
+    int t, row = 0, started = 0;
+
+    if (nthreads > YUV_MAX_THREADS)
+        nthreads = YUV_MAX_THREADS;
+    if (nthreads > height)
+        nthreads = height;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    for (t = 0; t < nthreads; t++)
+    {
+        slice[t].rows = height/nthreads + (t < height % nthreads);
+        slice[t].yuyv = yuyv + row*in_stride;
+        slice[t].in_stride = in_stride;
+        slice[t].rgb = rgb + (size_t)row*width*3;
+        slice[t].width = width;
+        slice[t].c = c;
+        row += slice[t].rows;
+    }
+
+    // Slice 0 runs here; a helper that fails to start is run here as well
+    for (t = 1; t < nthreads; t++, started++)
+        if (pthread_create(&tid[t], NULL, yuv_slice, &slice[t]) != 0)
+            break;
+
+    yuv_slice(&slice[0]);
+    for (t = started + 1; t < nthreads; t++)
+        yuv_slice(&slice[t]);
+
+    for (t = 1; t <= started; t++)
+        pthread_join(tid[t], NULL);
+}
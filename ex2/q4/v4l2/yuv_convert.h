@@ -0,0 +1,50 @@
+#ifndef YUV_CONVERT_H
+#define YUV_CONVERT_H
+
+#include <stddef.h>
+
+// YUYV (YUV 4:2:2) to packed RGB24/BGR24
+//
+// Integer Q8 arithmetic throughout, the same form as yuv2rgb() in capture.c:
+//   R = (Ky*(Y-Yoff) + Krv*(V-128) + 128) >> 8, clamped to [0,255]
+// and likewise for G and B.  With BT.601 limited range the coefficients are
+// exactly yuv2rgb()'s (298, 409, -100, -208, 516), so the output is
+// bit-identical to it.  The SSSE3 path converts 16 pixels per iteration with
+// pmaddwd in 32-bit lanes, so it matches the scalar code exactly.
+
+typedef enum
+{
+    YUV_BT601,
+    YUV_BT709
+} yuv_matrix_t;
+
+typedef enum
+{
+    YUV_RANGE_LIMITED,      // Y 16..235, C 16..240 (most webcams)
+    YUV_RANGE_FULL          // Y and C 0..255 (JPEG style)
+} yuv_range_t;
+
+typedef struct
+{
+    short y, rv, gu, gv, bu;    // Q8
+    short yoff;
+    int bgr;                    // store B,G,R instead of R,G,B
+} yuv_coef_t;
+
+void yuv_coef_init(yuv_coef_t *c, yuv_matrix_t matrix, yuv_range_t range, int bgr);
+
+// Convert rows of width pixels (width even).  in_stride is bytesperline,
+// out_stride the output row pitch in bytes.
+void yuyv_to_rgb_rows(const unsigned char *yuyv, size_t in_stride, unsigned char *rgb, size_t out_stride,
+                      int width, int rows, const yuv_coef_t *c);
+
+// Whole frame into a packed width*3 buffer, rows split across nthreads
+// (the caller plus nthreads-1 short-lived helpers; 1 or less converts inline).
+#define YUV_MAX_THREADS 16
+void yuyv_to_rgb(const unsigned char *yuyv, size_t in_stride, unsigned char *rgb,
+                 int width, int height, const yuv_coef_t *c, int nthreads);
+
+// Name of the instruction set yuyv_to_rgb_rows() was compiled for.
+const char *yuv_convert_isa(void);
+
+#endif
@@ -13,9 +13,18 @@
 
 #include "opencv2/imgproc.hpp"
 #include "opencv2/highgui.hpp"
+#include "opencv2/imgcodecs.hpp"
 #include <iostream>
 #include <chrono>
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "perf_counters.h"		//Shared with ex1/sharpen-psf, see Makefile
+
 //Define the image size
 #define IMG_HEIGHT	480
 #define IMG_WIDTH 	640
@@ -34,7 +43,10 @@ static struct {
 	char edgeMode;				//'c' = canny, 's' = sobel, 'n' = none. Window is created/destroyed when changed (as needed)
 	int minThresh;				//minimum threshold for canny edge detection
 	double calcFramerate;		//Calculated framerate (updated every STATE_PRINT_INTERVAL (1000ms))
-} state = {.edgeMode = 'n', .minThresh = 50};
+	bool profile;				//'p' toggles hardware counters around each frame
+	bool fusedSobel;			//'f' switches Sobel mode between fusedSobel() and the OpenCV chain
+	bool parityCheck;			//'v' compares the two on the next frame
+} state = {.edgeMode = 'n', .minThresh = 50, .fusedSobel = true};
 
 
 using namespace cv;
@@ -93,6 +105,291 @@ static Mat simpleCanny(Mat frame, int minThresh, int ratio = 3, int kernel_size
 }
 
 
+/**
+	Fused Sobel pipeline, the equivalent of
+		cvtColor(COLOR_BGR2GRAY) -> GaussianBlur(3x3) -> simpleSobel()
+	in one pass over the frame. The frame is cut into strips of FUSED_STRIP_ROWS rows run in parallel; within
+	a strip each output row needs three blurred rows, each of those three gray rows, and both are kept in tiny
+	row rings (a few KB, cache resident) so no full-frame intermediate is ever written. All arithmetic is
+	integer (int16 lanes in the SIMD paths) and follows OpenCV's own rounding, so the result is meant to be
+	bit-exact with the OpenCV pipeline; press 'v' to check that on a live frame.
+**/
+
+#define FUSED_STRIP_ROWS	32
+
+//cvtColor's fixed-point BGR to gray weights (0.114, 0.587, 0.299 in 14 bits)
+#define GRAY_SHIFT	14
+#define GRAY_B		1868
+#define GRAY_G		9617
+#define GRAY_R		4899
+
+
+//BORDER_DEFAULT (BORDER_REFLECT_101) index
+static inline int reflect101(int i, int n){
+	return i < 0 ? -i : (i >= n ? 2*n - 2 - i : i);
+}
+
+
+//One BGR row to gray, rounding as cvtColor does
+static void grayRow(const uchar *bgr, uchar *gray, int width){
+	int x = 0;
+	
+#if defined(__SSSE3__)
+	//Pair each pixel's B,G and R,1 as 16-bit words so one madd applies the weights (and the rounding term)
+	const __m128i shufBG = _mm_setr_epi8(0,-1,1,-1, 3,-1,4,-1, 6,-1,7,-1, 9,-1,10,-1);
+	const __m128i shufR = _mm_setr_epi8(2,-1,-1,-1, 5,-1,-1,-1, 8,-1,-1,-1, 11,-1,-1,-1);
+	const __m128i one = _mm_set1_epi32(1 << 16);
+	const __m128i coefBG = _mm_set1_epi32((GRAY_G << 16) | GRAY_B);
+	const __m128i coefR = _mm_set1_epi32(((1 << (GRAY_SHIFT - 1)) << 16) | GRAY_R);
+	
+	//Each 16-byte load covers 4 pixels; the second one reads 2 pixels past the 8, hence the +10
+	for(; x + 10 <= width; x += 8){
+		const uchar *p = bgr + 3*x;
+		__m128i y[2];
+		for(int h = 0; h < 2; h++){
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + 12*h));
+			__m128i bg = _mm_madd_epi16(_mm_shuffle_epi8(v, shufBG), coefBG);
+			__m128i r1 = _mm_madd_epi16(_mm_or_si128(_mm_shuffle_epi8(v, shufR), one), coefR);
+			y[h] = _mm_srli_epi32(_mm_add_epi32(bg, r1), GRAY_SHIFT);
+		}
+		__m128i g = _mm_packs_epi32(y[0], y[1]);
+		_mm_storel_epi64((__m128i *)(gray + x), _mm_packus_epi16(g, g));
+	}
+#endif
+	
+	for(; x < width; x++){
+		const uchar *p = bgr + 3*x;
+		gray[x] = (uchar)((p[0]*GRAY_B + p[1]*GRAY_G + p[2]*GRAY_R + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT);
+	}
+}
+
+
+/**
+	Blur one row with the 3x3 Gaussian (1 2 1 both ways, /16, rounded as GaussianBlur does for 8-bit)
+	
+	@param a, b, c - gray rows above, at and below
+	@param vsum - width+2 shorts of scratch, indexed from -1
+	@param out - blurred row, also indexed -1..width so the Sobel can read one pixel past either edge
+*/
+static void blurRow(const uchar *a, const uchar *b, const uchar *c, short *vsum, uchar *out, int width){
+	int x = 0;
+	
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for(; x + 8 <= width; x += 8){
+		__m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + x)), zero);
+		__m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + x)), zero);
+		__m128i vc = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(c + x)), zero);
+		_mm_storeu_si128((__m128i *)(vsum + x), _mm_add_epi16(_mm_add_epi16(va, vc), _mm_slli_epi16(vb, 1)));
+	}
+#endif
+	for(; x < width; x++)
+		vsum[x] = a[x] + 2*b[x] + c[x];
+	vsum[-1] = vsum[1];
+	vsum[width] = vsum[width - 2];
+	
+	x = 0;
+#if defined(__SSE2__)
+	const __m128i round = _mm_set1_epi16(8);
+	for(; x + 8 <= width; x += 8){
+		__m128i l = _mm_loadu_si128((const __m128i *)(vsum + x - 1));
+		__m128i m = _mm_loadu_si128((const __m128i *)(vsum + x));
+		__m128i r = _mm_loadu_si128((const __m128i *)(vsum + x + 1));
+		__m128i s = _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(_mm_slli_epi16(m, 1), round));
+		s = _mm_srli_epi16(s, 4);
+		_mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(s, s));
+	}
+#endif
+	for(; x < width; x++)
+		out[x] = (uchar)((vsum[x - 1] + 2*vsum[x] + vsum[x + 1] + 8) >> 4);
+	out[-1] = out[1];
+	out[width] = out[width - 2];
+}
+
+
+/**
+	Sobel magnitude of one row from three padded blurred rows: 0.5*|Gx| + 0.5*|Gy|, each clamped to 255 first
+	as convertScaleAbs does, and the sum rounded half to even as addWeighted does
+*/
+static void sobelRow(const uchar *a, const uchar *b, const uchar *c, uchar *out, int width){
+	int x = 0;
+	
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1), max = _mm_set1_epi16(255);
+	for(; x + 8 <= width; x += 8){
+		__m128i al = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + x - 1)), zero);
+		__m128i am = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + x)), zero);
+		__m128i ar = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + x + 1)), zero);
+		__m128i bl = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + x - 1)), zero);
+		__m128i br = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + x + 1)), zero);
+		__m128i cl = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(c + x - 1)), zero);
+		__m128i cm = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(c + x)), zero);
+		__m128i cr = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(c + x + 1)), zero);
+		
+		__m128i gx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(ar, al), _mm_sub_epi16(cr, cl)),
+								   _mm_slli_epi16(_mm_sub_epi16(br, bl), 1));
+		__m128i gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(cl, cr), _mm_slli_epi16(cm, 1)),
+								   _mm_add_epi16(_mm_add_epi16(al, ar), _mm_slli_epi16(am, 1)));
+		gx = _mm_min_epi16(_mm_max_epi16(gx, _mm_sub_epi16(zero, gx)), max);
+		gy = _mm_min_epi16(_mm_max_epi16(gy, _mm_sub_epi16(zero, gy)), max);
+		
+		__m128i s = _mm_add_epi16(gx, gy);
+		s = _mm_srli_epi16(_mm_add_epi16(s, _mm_and_si128(_mm_srli_epi16(s, 1), one)), 1);
+		_mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(s, s));
+	}
+#endif
+	for(; x < width; x++){
+		int gx = (a[x+1] - a[x-1]) + 2*(b[x+1] - b[x-1]) + (c[x+1] - c[x-1]);
+		int gy = (c[x-1] + 2*c[x] + c[x+1]) - (a[x-1] + 2*a[x] + a[x+1]);
+		int s = std::min(std::abs(gx), 255) + std::min(std::abs(gy), 255);
+		out[x] = (uchar)((s + ((s >> 1) & 1)) >> 1);
+	}
+}
+
+
+/**
+	Rows [y0, y1) of the fused pipeline. Gray and blurred rows live in rings of 4 tagged by row number:
+	the three rows any step needs are consecutive (or reflected) row numbers, so never share a slot.
+*/
+static void fusedSobelRows(const uchar *src, size_t srcStep, uchar *dst, size_t dstStep, int width, int height,
+						   int y0, int y1){
+	size_t grayStep = (width + 15) & ~15, blurStep = (width + 2 + 15) & ~15;
+	AutoBuffer<uchar> buf(4*grayStep + 4*blurStep + (width + 2)*sizeof(short));
+	uchar *gray = buf.data(), *blur = gray + 4*grayStep;
+	short *vsum = (short *)(blur + 4*blurStep) + 1;
+	int grayTag[4] = {-1, -1, -1, -1}, blurTag[4] = {-1, -1, -1, -1};
+	
+	auto grayAt = [&](int r) -> const uchar *{
+		r = reflect101(r, height);
+		uchar *g = gray + (r & 3)*grayStep;
+		if(grayTag[r & 3] != r){
+			grayRow(src + r*srcStep, g, width);
+			grayTag[r & 3] = r;
+		}
+		return g;
+	};
+	auto blurAt = [&](int r) -> const uchar *{
+		r = reflect101(r, height);
+		uchar *b = blur + (r & 3)*blurStep + 1;
+		if(blurTag[r & 3] != r){
+			blurRow(grayAt(r - 1), grayAt(r), grayAt(r + 1), vsum, b, width);
+			blurTag[r & 3] = r;
+		}
+		return b;
+	};
+	
+	for(int y = y0; y < y1; y++){
+		const uchar *a = blurAt(y - 1), *b = blurAt(y), *c = blurAt(y + 1);
+		sobelRow(a, b, c, dst + y*dstStep, width);
+	}
+}
+
+
+/**
+	BGR frame to Sobel edges in one fused pass, equivalent to the cvtColor/GaussianBlur/simpleSobel() chain
+	
+	@param frame - CV_8UC3 BGR frame
+	
+	@return - CV_8UC1 edge magnitude
+*/
+static Mat fusedSobel(const Mat &frame){
+	
+	//The kernel needs at least 2x2 and 8-bit BGR; anything else takes the OpenCV path
+	if(frame.type() != CV_8UC3 || frame.cols < 2 || frame.rows < 2){
+		Mat gray;
+		cvtColor(frame, gray, COLOR_BGR2GRAY);
+		GaussianBlur(gray, gray, Size(3,3), 0, 0, BORDER_DEFAULT);
+		return simpleSobel(gray);
+	}
+	
+	Mat edges(frame.size(), CV_8UC1);
+	int strips = (frame.rows + FUSED_STRIP_ROWS - 1) / FUSED_STRIP_ROWS;
+	
+	parallel_for_(Range(0, strips), [&](const Range &range){
+		for(int s = range.start; s < range.end; s++)
+			fusedSobelRows(frame.data, frame.step, edges.data, edges.step, frame.cols, frame.rows,
+						   s*FUSED_STRIP_ROWS, std::min((s + 1)*FUSED_STRIP_ROWS, frame.rows));
+	});
+	
+	return edges;
+}
+
+
+/**
+	Run the OpenCV Sobel chain and fusedSobel() on the same frame and report how far apart they are, and
+	what each took
+	
+	@return - the number of pixels that differ
+*/
+static int sobelParity(const Mat &frame){
+	
+	auto t0 = chrono::high_resolution_clock::now();
+	Mat gray;
+	cvtColor(frame, gray, COLOR_BGR2GRAY);
+	GaussianBlur(gray, gray, Size(3,3), 0, 0, BORDER_DEFAULT);
+	Mat reference = simpleSobel(gray);
+	auto t1 = chrono::high_resolution_clock::now();
+	Mat fused = fusedSobel(frame);
+	auto t2 = chrono::high_resolution_clock::now();
+	
+	Mat diff;
+	absdiff(reference, fused, diff);
+	double maxDiff;
+	minMaxLoc(diff, NULL, &maxDiff);
+	int mismatched = countNonZero(diff);
+	
+	cout << "Sobel parity: " << mismatched << " of " << diff.total() << " pixels differ, max difference "
+		 << maxDiff << (mismatched ? "" : " (bit-exact)") << "; OpenCV "
+		 << chrono::duration<double, milli>(t1 - t0).count() << " ms, fused "
+		 << chrono::duration<double, milli>(t2 - t1).count() << " ms" << endl;
+	
+	return mismatched;
+}
+
+
+/**
+	edge --parity: sobelParity() on a whole image, then on crops that reach the corners of fusedSobel() -
+	the 2x2 minimum, 3x5 and other tiny sizes, widths that are not a multiple of its 16 pixel vectors, and
+	a (1,1) offset so the rows are not contiguous
+	
+	@param path - image to check against, e.g. ../q3/bbb_200.ppm
+	
+	@return - 0 if every case is bit-exact, 1 if any pixel differs, 2 if the image cannot be read
+*/
+static int sobelParityImage(const char *path){
+	
+	Mat image = imread(path, IMREAD_COLOR);
+	if(image.empty()){
+		cout << "Unable to read " << path << endl;
+		return 2;
+	}
+	
+	//Crop sizes (width x height), all taken at (1,1)
+	static const int crops[][2] = {{2, 2}, {3, 5}, {5, 3}, {2, 9}, {15, 4}, {17, 17}, {31, 8}, {33, 2},
+								   {47, 13}, {250, 3}};
+	
+	vector<Rect> cases;
+	cases.push_back(Rect(0, 0, image.cols, image.rows));
+	cases.push_back(Rect(1, 1, image.cols - 1, image.rows - 1));
+	for(const auto &c : crops)
+		cases.push_back(Rect(1, 1, c[0], c[1]));
+	
+	int failed = 0, run = 0;
+	for(const Rect &r : cases){
+		if(r.width < 1 || r.height < 1 || r.x + r.width > image.cols || r.y + r.height > image.rows)
+			continue;
+		
+		cout << r.width << "x" << r.height << " at (" << r.x << "," << r.y << "): ";
+		if(sobelParity(image(r)) != 0)
+			failed++;
+		run++;
+	}
+	
+	cout << failed << " of " << run << " cases differ" << endl;
+	return failed ? 1 : 0;
+}
+
+
 
 static void onTrackbar(int val, void* arg){
 
@@ -102,6 +399,14 @@ static void onTrackbar(int val, void* arg){
 
 int main(int argc, char *argv[]){
 	
+	//edge --parity image: check fusedSobel() against the OpenCV chain without a camera or window
+	if(argc == 3 && string(argv[1]) == "--parity")
+		return sobelParityImage(argv[2]);
+	if(argc != 1){
+		cout << "Usage: " << argv[0] << " [--parity image]" << endl;
+		return 1;
+	}
+	
 	//Create the capture instance which will open the camera
 	VideoCapture cap(0, CAP_V4L2);
 	if(!cap.isOpened()){
@@ -131,10 +436,22 @@ int main(int argc, char *argv[]){
 	unsigned long frameCount = 0;
 
 
+	//Hardware counters for this thread, opened the first time 'p' is pressed. OpenCV's
+	//own worker threads are not followed, so compare runs at the same setNumThreads().
+	perf_counters_t perf;
+	perf_sample_t perfSample;
+	bool perfOpen = false;
+	char perfLine[160];
+	unsigned long perfFrame = 0;
+
+
 	Mat frame;
 	bool running = true;
 	while(running){
 		
+		if(state.profile)
+			perf_counters_start(&perf);
+		
 		//Read frame and verify it is valid
 		cap >> frame;
 		if(frame.empty()){
@@ -150,6 +467,10 @@ int main(int argc, char *argv[]){
 			Mat canny = simpleCanny(gray, state.minThresh);
 			imshow(WINDOW_NAME_EDGE, canny);
 		}
+		else if(state.edgeMode == 's' && state.fusedSobel){
+			Mat sobel = fusedSobel(frame);
+			imshow(WINDOW_NAME_EDGE, sobel);
+		}
 		else if(state.edgeMode == 's'){
 			Mat gray;
 			cvtColor(frame, gray, COLOR_BGR2GRAY);
@@ -160,6 +481,11 @@ int main(int argc, char *argv[]){
 		else{	//None
 			
 		}
+		
+		if(state.parityCheck){
+			sobelParity(frame);
+			state.parityCheck = false;
+		}
 
 		//Overlay framerate on image frame
 		string framerate = std::to_string(state.calcFramerate);
@@ -167,6 +493,14 @@ int main(int argc, char *argv[]){
 		putText(frame, framerate, Point(10,30), FONT_HERSHEY_COMPLEX_SMALL, 1.0, Scalar(255,255,255), 1);
 		imshow(WINDOW_NAME, frame);
 		
+		//Capture through display of this frame, normalized per pixel
+		if(state.profile){
+			perf_counters_stop(&perf);
+			perf_counters_read(&perf, &perfSample);
+			cout << "frame " << perfFrame++ << " (" << state.edgeMode << ") perf: "
+				 << perf_sample_format(&perfSample, (double)frame.total(), perfLine, sizeof(perfLine)) << endl;
+		}
+		
 
 		//Get the current time, and save time if this frame starts a new set of frames we'll be calculating FPS over.
 		last = chrono::high_resolution_clock::now();
@@ -215,17 +549,37 @@ int main(int argc, char *argv[]){
 			state.edgeMode = 's';
 			cout << "(s) Enable Sobel edge detection" << endl;
 			break;
+		case 'f':
+			//Switch Sobel mode between the fused kernel and the cvtColor/GaussianBlur/simpleSobel() chain
+			state.fusedSobel = !state.fusedSobel;
+			cout << "(f) Sobel uses " << (state.fusedSobel ? "the fused kernel" : "OpenCV") << endl;
+			break;
+		case 'v':
+			//Check the fused kernel against the OpenCV chain on the next frame
+			state.parityCheck = true;
+			break;
+			
+		case 'p':
+			//Toggle per-frame hardware counters (cycles, IPC, cache and branch misses per pixel)
+			if(!perfOpen)
+				perfOpen = perf_counters_open(&perf) > 0;
+			state.profile = perfOpen && !state.profile;
+			cout << "(p) Hardware counters " << (state.profile ? "on" : "off") << endl;
+			break;
 			
 		case -1:
 			break;
 		default:
-			cout << "Invalid key. Expected: c, s, n, or ESC" << endl;
+			cout << "Invalid key. Expected: c, s, f, v, n, p, or ESC" << endl;
 			break;
 		}
 			
 	}
 
 	
+	if(perfOpen)
+		perf_counters_close(&perf);
+	
 	//Cleanup the window we created (close it)
 	destroyWindow(WINDOW_NAME);
 	if(state.edgeMode != 'n')